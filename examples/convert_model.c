@@ -0,0 +1,24 @@
+#include <stdio.h>
+
+// Convert a model saved in the text format of older versions to the binary
+// format. convert_cnn_model.x is the same program built for the CNN.
+#ifdef CONVERT_CNN
+#include "cnn.h"
+typedef CNN Model;
+#else
+#include "network.h"
+typedef Network Model;
+#endif
+
+int main(int argc, char* argv[]){
+    if (argc < 3){
+        printf("Usage: %s <text_model_path> <binary_model_path>\n", argv[0]);
+        return 0;
+    }
+    Model* network = create_network(0);
+    load_network(network, argv[1]);
+    save_network(network, argv[2]);
+    printf("Saved network to %s\n", argv[2]);
+    free_network(network);
+    return 0;
+}
@@ -0,0 +1,110 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "network.h"
+#include "ndarray.h"
+#include "threadpool.h"
+#include "misc.h"
+
+#define IMAGE_SIZE 20
+#define BATCH_SIZE 32
+#define EPOCHS 3
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+// Epoch time of the training modes of the dense network, all starting from
+// the same weights: the single-threaded loop, the synchronous data-parallel
+// step and the asynchronous (Hogwild) mode.
+typedef enum {
+    SERIAL,
+    SYNC,
+    HOGWILD,
+} TrainMode;
+
+static const char *mode_names[] = {
+    [SERIAL] = "single thread",
+    [SYNC] = "data parallel",
+    [HOGWILD] = "hogwild",
+};
+
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static float train_epoch(Network *network, TrainMode mode, ndarray *inputs, ndarray *targets, ndarray *outputs){
+    int num = inputs->shape[1];
+    if (mode == HOGWILD) {
+        return network_train_hogwild(network, inputs, targets, outputs, BATCH_SIZE);
+    }
+    float loss = 0;
+    for (int i = 0; i < num; i += BATCH_SIZE) {
+        int n = MIN(BATCH_SIZE, num - i);
+        ndarray *x = nda_slice(inputs, 1, i, i + n);
+        ndarray *t = nda_slice(targets, 1, i, i + n);
+        ndarray *y = nda_slice(outputs, 1, i, i + n);
+        if (mode == SYNC) {
+            network_train_batch(network, x, t, y);
+        } else {
+            network_forward(network, x, y);
+            network_backward(network, t);
+            network_update(network);
+        }
+        loss += network->loss * n;
+        nda_free(x), nda_free(t), nda_free(y);
+    }
+    return loss / num;
+}
+
+int main() {
+    srand(time(NULL));
+
+    int train_num = 3500;
+    ndarray** train_images = (ndarray**)(malloc(train_num * sizeof(ndarray*)));
+    int* train_labels = (int*)(malloc(train_num * sizeof(int)));
+    ndarray* train_data = read_data_parallel("../datasets/mnist_20x20/train_labels.txt", train_images, train_labels, train_num, IMAGE_SIZE, 2, (int[]){IMAGE_SIZE*IMAGE_SIZE, 1});
+    data_shuffle(train_images, train_labels, train_num);
+
+    // The whole epoch as one batch of columns.
+    ndarray* inputs = nda_zero(2, (int[]){IMAGE_SIZE*IMAGE_SIZE, train_num});
+    ndarray* targets = nda_zero(2, (int[]){10, train_num});
+    ndarray* outputs = nda_zero(2, (int[]){10, train_num});
+    data_batch(train_images, train_labels, 0, inputs, targets);
+
+    Network* initial = create_network(0.003 * BATCH_SIZE);
+    ndarray *x = nda_slice(inputs, 1, 0, 1), *y = nda_slice(outputs, 1, 0, 1);
+    network_forward(initial, x, y);
+    nda_free(x), nda_free(y);
+
+    int threads = nda_num_threads();
+    double serial_time = 0;
+    for (TrainMode mode = SERIAL; mode <= HOGWILD; mode++) {
+        nda_set_num_threads(mode == SERIAL ? 1 : threads);
+        Network* network = create_network(initial->learning_rate);
+        copy_network(network, initial);
+        double time = 0;
+        float loss = 0;
+        for (int epoch = 1; epoch <= EPOCHS; epoch++) {
+            double start = now();
+            loss = train_epoch(network, mode, inputs, targets, outputs);
+            time += now() - start;
+        }
+        time /= EPOCHS;
+        if (mode == SERIAL) {
+            serial_time = time;
+        }
+        printf("%-14s %2d thread(s): %.3f s per epoch, speedup %.2f, loss after %d epochs = %f\n",
+               mode_names[mode], mode == SERIAL ? 1 : threads, time, serial_time / time, EPOCHS, loss);
+        free_network(network);
+    }
+
+    for(int i = 0; i < train_num; i++) {
+        nda_free(train_images[i]);
+    }
+    nda_free(train_data);
+    free(train_images), free(train_labels);
+    nda_free(inputs), nda_free(targets), nda_free(outputs);
+    free_network(initial);
+    return 0;
+}
@@ -8,17 +8,33 @@
 #include "misc.h"
 
 #define IMAGE_SIZE 20
+#define EVAL_BATCH_SIZE 64
+#define BATCH_SIZE 32
 #define MAX(x, y) (((x) > (y)) ? (x) : (y))
-
-float valuate(CNN* network, ndarray** images, int* labels, int num) {
-    int correct = 0; 
-    ndarray* output = nda_zero(2, (int[]){10, 1});
-    for (int i = 0; i < num; i++) {
-        network_forward(network, images[i], output);
-        correct += nda_argmax(output) == labels[i];
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+// Number of columns of output whose largest entry is in the row of their label.
+static int count_correct(ndarray *output, int *labels){
+    int correct = 0;
+    for (int j = 0; j < output->shape[1]; j++) {
+        int argmax = 0;
+        for (int i = 1; i < output->shape[0]; i++) {
+            if (output->data[i * output->strides[0] + j * output->strides[1]] >
+                output->data[argmax * output->strides[0] + j * output->strides[1]]) {
+                argmax = i;
+            }
+        }
+        correct += argmax == labels[j];
     }
-    nda_free(output);
-    return (float)correct / num;
+    return correct;
+}
+
+float valuate(CNN* network, ndarray** images, int* labels, int num, ndarray* confusion) {
+    int* predictions = (int*)(malloc(num * sizeof(int)));
+    network_predict(network, images, num, EVAL_BATCH_SIZE, predictions);
+    float acc = evaluate_predictions(predictions, labels, num, confusion);
+    free(predictions);
+    return acc;
 }
 
 int main() {
@@ -28,11 +44,11 @@ int main() {
     time(&current_time);
     struct tm *local_time = localtime(&current_time);
 
-    char logname[50], networkname[50];
+    char logname[100], networkname[100];
     sprintf(logname, "../logs/log_cnn_%d_%d_%d_%d_%d_%d.txt", 
             local_time->tm_year+1900, local_time->tm_mon+1, local_time->tm_mday,
             local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
-    sprintf(networkname, "../models/cnn_%d_%d_%d_%d_%d_%d.txt", 
+    sprintf(networkname, "../models/cnn_%d_%d_%d_%d_%d_%d.bin", 
             local_time->tm_year+1900, local_time->tm_mon+1, local_time->tm_mday,
             local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
     FILE *file = fopen(logname, "w");
@@ -49,39 +65,42 @@ int main() {
     ndarray** val_images = (ndarray**)(malloc(val_num * sizeof(ndarray*)));
     int* val_labels = (int*)(malloc(val_num * sizeof(int)));
 
-    read_data("../datasets/mnist_20x20/train_labels.txt", train_images, train_labels, train_num, IMAGE_SIZE, 3, (int[]){1, IMAGE_SIZE, IMAGE_SIZE});
-    read_data("../datasets/mnist_20x20/val_labels.txt", val_images, val_labels, val_num, IMAGE_SIZE, 3, (int[]){1, IMAGE_SIZE, IMAGE_SIZE});
+    ndarray* train_data = read_data_parallel("../datasets/mnist_20x20/train_labels.txt", train_images, train_labels, train_num, IMAGE_SIZE, 3, (int[]){1, IMAGE_SIZE, IMAGE_SIZE});
+    ndarray* val_data = read_data_parallel("../datasets/mnist_20x20/val_labels.txt", val_images, val_labels, val_num, IMAGE_SIZE, 3, (int[]){1, IMAGE_SIZE, IMAGE_SIZE});
 
     data_shuffle(train_images, train_labels, train_num);
 
     // Initialize the network
-    CNN* network = create_network(0.003);
-    ndarray* target = nda_zero(2, (int[]){10, 1});
-    ndarray* output = nda_zero(2, (int[]){10, 1});
+    // The gradients are averaged over a batch, the learning rate scales with its size.
+    CNN* network = create_network(0.003 * BATCH_SIZE);
+    ndarray* inputs = nda_zero(4, (int[]){BATCH_SIZE, 1, IMAGE_SIZE, IMAGE_SIZE});
+    ndarray* target = nda_zero(2, (int[]){10, BATCH_SIZE});
+    ndarray* output = nda_zero(2, (int[]){10, BATCH_SIZE});
 
     float best_val_acc = 0.0;
-    CNN* best_network = create_network(0.003);
+    CNN* best_network = create_network(0.003 * BATCH_SIZE);
     int early_stop = 0;
 
     for(int epoch = 1; epoch <= 70; epoch++) {
         float loss = 0;
         int correct = 0;
 
-        for(int i = 0; i < train_num; i++) {
-            // Forward
-            network_forward(network, train_images[i], output);
+        for(int i = 0; i < train_num; i += BATCH_SIZE) {
+            // The last batch may be smaller.
+            int n = MIN(BATCH_SIZE, train_num - i);
+            ndarray *x = nda_slice(inputs, 0, 0, n);
+            ndarray *t = nda_slice(target, 1, 0, n);
+            ndarray *y = nda_slice(output, 1, 0, n);
+            data_batch(train_images, train_labels, i, x, t);
+            // Forward, backward and update, the batch split across the threads
+            network_train_batch(network, x, t, y);
             // Check the prediction
-            correct += nda_argmax(output) == train_labels[i];
-            // Backward
-            memset(target->data, 0, 10 * sizeof(float));
-            target->data[train_labels[i]] = 1.0;
-            network_backward(network, target);
-            // Update
-            network_update(network);
+            correct += count_correct(y, train_labels + i);
             // Accumulate loss
-            loss += network->loss;
+            loss += network->loss * n;
+            nda_free(x), nda_free(t), nda_free(y);
         }
-        float val_acc = valuate(network, val_images, val_labels, val_num);
+        float val_acc = valuate(network, val_images, val_labels, val_num, NULL);
         float train_acc = (float)correct / train_num;
         // Print the loss
         printf("Epoch %d: loss = %f, train acc = %.2f%%, val acc = %.2f%%, learning rate = %f", 
@@ -90,7 +109,7 @@ int main() {
                 epoch, loss / train_num, train_acc * 100, val_acc * 100, network->learning_rate);
         // Update learning rate
         if (train_acc > 0.2){
-            network->learning_rate  = MAX(0.0005, network->learning_rate * 0.99);
+            network->learning_rate  = MAX(0.0005 * BATCH_SIZE, network->learning_rate * 0.99);
         }
         // Save the best network
         if (val_acc > best_val_acc) {
@@ -122,12 +141,14 @@ int main() {
     for(int i = 0; i < train_num; i++) {
         nda_free(train_images[i]);
     }
+    nda_free(train_data);
     for(int i = 0; i < val_num; i++) {
         nda_free(val_images[i]);
     }
+    nda_free(val_data);
     free(train_images), free(train_labels);
     free(val_images), free(val_labels);
-    nda_free(target), nda_free(output);
+    nda_free(inputs), nda_free(target), nda_free(output);
     free_network(network);
     return 0;
 }
\ No newline at end of file
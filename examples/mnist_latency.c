@@ -0,0 +1,77 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "network.h"
+#include "ndarray.h"
+#include "misc.h"
+
+#define IMAGE_SIZE 20
+#define RUNS 20000
+#define WARMUP 1000
+
+// Latency percentiles of one-image inference with the forward pass of
+// training and with the prepared single-sample path.
+static double now(){
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec * 1e-9;
+}
+
+static int compare_double(const void *a, const void *b){
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+static void report(const char *name, double *latencies, int num){
+    qsort(latencies, num, sizeof(double), compare_double);
+    printf("%-18s p50 = %7.2f us, p99 = %7.2f us, p999 = %7.2f us\n", name,
+           latencies[num / 2] * 1e6, latencies[num * 99 / 100] * 1e6, latencies[num * 999 / 1000] * 1e6);
+}
+
+int main(int argc, char* argv[]){
+    if (argc < 2){
+        printf("Usage: ./mnist_latency.x <model_path>\n");
+        return 0;
+    }
+    Network* network = create_network(0.003);
+    load_network(network, argv[1]);
+
+    int test_num = 750;
+    ndarray** test_images = (ndarray**)(malloc(test_num * sizeof(ndarray*)));
+    int* test_labels = (int*)(malloc(test_num * sizeof(int)));
+    ndarray* test_data = read_data_parallel("../datasets/mnist_20x20/test_labels.txt", test_images, test_labels, test_num, IMAGE_SIZE, 2, (int[]){IMAGE_SIZE*IMAGE_SIZE, 1});
+
+    double* latencies = (double*)(malloc(RUNS * sizeof(double)));
+    ndarray* output = nda_zero(2, (int[]){10, 1});
+
+    for (int i = -WARMUP; i < RUNS; i++) {
+        double start = now();
+        network_forward(network, test_images[(i + WARMUP) % test_num], output);
+        if (i >= 0) {
+            latencies[i] = now() - start;
+        }
+    }
+    report("network_forward", latencies, RUNS);
+
+    NetworkContext* context = create_network_context();
+    network_prepare_sample(network, context);
+    for (int i = -WARMUP; i < RUNS; i++) {
+        double start = now();
+        network_infer_sample(network, context, test_images[(i + WARMUP) % test_num]->data, output->data);
+        if (i >= 0) {
+            latencies[i] = now() - start;
+        }
+    }
+    report("prepared sample", latencies, RUNS);
+
+    for (int i = 0; i < test_num; i++) {
+        nda_free(test_images[i]);
+    }
+    nda_free(test_data);
+    free(test_images), free(test_labels), free(latencies);
+    nda_free(output);
+    free_network_context(context);
+    free_network(network);
+    return 0;
+}
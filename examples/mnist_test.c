@@ -5,18 +5,18 @@
 #include "network.h"
 #include "ndarray.h"
 #include "misc.h"
+#include "dataset.h"
 
 #define IMAGE_SIZE 20
+#define EVAL_BATCH_SIZE 64
 
-float valuate(Network* network, ndarray** images, int* labels, int num) {
-    int correct = 0; 
-    ndarray* output = nda_zero(2, (int[]){10, 1});
-    for (int i = 0; i < num; i++) {
-        network_forward(network, images[i], output);
-        correct += nda_argmax(output) == labels[i];
-    }
-    nda_free(output);
-    return (float)correct / num;
+float valuate(Network* network, Dataset* dataset, ndarray* confusion) {
+    int num = dataset->num;
+    int* predictions = (int*)(malloc(num * sizeof(int)));
+    network_predict_dataset(network, dataset, EVAL_BATCH_SIZE, predictions);
+    float acc = evaluate_predictions(predictions, dataset->labels, num, confusion);
+    free(predictions);
+    return acc;
 }
 
 int main(int argc, char* argv[]){
@@ -27,23 +27,22 @@ int main(int argc, char* argv[]){
     // Load the network
     Network* network = create_network(0.003);
     load_network(network, argv[1]);
+    // The network is only read by inference, which runs in this context.
+    NetworkContext* context = create_network_context();
 
     // Print the test accuracy
     int test_num = 750;
-    ndarray** test_images = (ndarray**)(malloc(test_num * sizeof(ndarray*)));
-    int* test_labels = (int*)(malloc(test_num * sizeof(int)));
-    read_data("../datasets/mnist_20x20/test_labels.txt", test_images, test_labels, test_num, IMAGE_SIZE, 2, (int[]){IMAGE_SIZE*IMAGE_SIZE, 1});
+    Dataset* test_set = read_dataset("../datasets/mnist_20x20/test_labels.txt", test_num, 2, (int[]){IMAGE_SIZE*IMAGE_SIZE, 1});
     printf("Test data loaded.\n");
 
-    float test_acc = valuate(network, test_images, test_labels, test_num);
+    ndarray* confusion = nda_zero(2, (int[]){10, 10});
+    float test_acc = valuate(network, test_set, confusion);
     printf("Test accuracy: %.2f%%\n", test_acc * 100);
+    print_confusion(confusion);
+    nda_free(confusion);
 
     // Free the test data
-    for (int i = 0; i < test_num; i++) {
-        nda_free(test_images[i]);
-    }
-    free(test_images);
-    free(test_labels);
+    close_dataset(test_set);
     
     // Predict the image given by the user
     char image_path[100], img_name[50];
@@ -53,7 +52,7 @@ int main(int argc, char* argv[]){
     sprintf(image_path, "../datasets/mnist_20x20/test/%s.txt", img_name);
     read_image(image_path, image, IMAGE_SIZE);
     ndarray* output = nda_zero(2, (int[]){10, 1});
-    network_forward(network, image, output);
+    network_infer(network, context, image, output);
 
     // Print the prediction
     printf("Prediction: %d\n", nda_argmax(output));
@@ -61,6 +60,7 @@ int main(int argc, char* argv[]){
     // Free the memory
     nda_free(image);
     nda_free(output);
+    free_network_context(context);
     free_network(network);
     return 0;
 }
\ No newline at end of file
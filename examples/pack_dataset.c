@@ -0,0 +1,26 @@
+#include <stdio.h>
+#include <time.h>
+
+#include "dataset.h"
+
+#define IMAGE_SIZE 20
+
+// Pack the images listed in a *_labels.txt index into a single file that
+// open_dataset maps, e.g. ../datasets/mnist_20x20/train_labels.txt into
+// ../datasets/mnist_20x20/train.bin.
+int main(int argc, char* argv[]){
+    if (argc < 3){
+        printf("Usage: ./pack_dataset.x <labels_path> <dataset_path>\n");
+        return 0;
+    }
+    int num = pack_dataset(argv[1], 2, (int[]){IMAGE_SIZE, IMAGE_SIZE}, argv[2]);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    Dataset* dataset = open_dataset(argv[2]);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    printf("Packed %d images into %s, opened in %.3f ms\n", num, argv[2],
+           (end.tv_sec - start.tv_sec) * 1e3 + (end.tv_nsec - start.tv_nsec) * 1e-6);
+    close_dataset(dataset);
+    return 0;
+}
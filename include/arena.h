@@ -0,0 +1,66 @@
+#ifndef ARENA_H
+#define ARENA_H
+
+#include <stddef.h>
+
+// Alignment of every block handed out by nda_alloc and arena_alloc.
+#define NDA_ALIGN 64
+
+// Allocation hooks used for every heap allocation made by the library.
+// alloc_fn follows aligned_alloc: (alignment, size), size a multiple of alignment.
+typedef void *(*AllocFunc)(size_t alignment, size_t size);
+typedef void (*FreeFunc)(void *ptr);
+
+void nda_set_allocator(AllocFunc alloc_fn, FreeFunc free_fn);
+void *nda_alloc(size_t size);
+void nda_dealloc(void *ptr);
+
+typedef struct arenablock ArenaBlock;
+
+// Bump allocator for scratch memory. Blocks requested past the capacity are
+// served from overflow blocks, and the next reset of an empty arena replaces
+// everything with one block large enough for the peak usage, so that a
+// workload repeating the same steps stops allocating after its first step.
+typedef struct arena
+{
+    char *data;
+    size_t size;
+    size_t used;
+    size_t peak;
+    ArenaBlock *overflow;
+    size_t overflow_size;
+    // Scratch of the tasks of the parallel loops started from this arena,
+    // one arena per thread of the pool.
+    struct arena **workers;
+    int num_workers;
+} Arena;
+
+Arena *create_arena(size_t size);
+void free_arena(Arena *arena);
+
+void *arena_alloc(Arena *arena, size_t size);
+void arena_reset(Arena *arena);
+// Scoped scratch: release frees everything allocated since the mark.
+typedef struct
+{
+    size_t used;
+    size_t overflow_size;
+} ArenaMark;
+
+ArenaMark arena_mark(Arena *arena);
+void arena_release(Arena *arena, ArenaMark mark);
+
+// Give the arena count worker arenas, all as large as the most scratch a task
+// took from any of them so far: a thread running a kind of task for the first
+// time then does not allocate. Only call it while no task uses them.
+void arena_prepare_workers(Arena *arena, int count);
+Arena *arena_worker(Arena *arena, int i);
+
+// Scratch arena of the calling thread used by the ndarray kernels. Set it to
+// NULL to fall back to a default per-thread arena; returns the previous one.
+Arena *nda_set_workspace(Arena *arena);
+Arena *nda_workspace();
+// Free the default arena of the calling thread, e.g. before it exits.
+void nda_free_default_workspace();
+
+#endif // ARENA_H
@@ -2,35 +2,80 @@
 #define CNN_H
 #include "ndarray.h"
 #include "layer.h"
+#include "model.h"
 
 typedef struct cnn
 {
     float learning_rate;
     float loss;
+    Arena *workspace; // scratch of the layers, reset every step
 
     ConvLayer *conv1;
     FlattenLayer *flat1;
     DenseLayer *dense1;
     DenseLayer *dense2;
+    // All the weights and biases in one flat array, the layers hold views of
+    // it; same for their gradients. A replica's params is a view of those of
+    // the network it replicates.
+    ndarray *params;
+    ndarray *grads;
+    ModelFile *model; // mapped file params points into, NULL if it owns its data
 
     ndarray *c1_output;
-    ndarray *f1_output;
+    ndarray *f1_output; // transposed view of c1_output
     ndarray *d1_output;
-    ndarray *d2_output;
+    ndarray *d2_output; // output of the last forward pass, owned by the caller
 
     ndarray *c1_input_grad;
-    ndarray *f1_input_grad;
+    ndarray *f1_input_grad; // transposed view of c1_input_grad
     ndarray *d1_input_grad;
     ndarray *d2_input_grad;
+
+    int num_replicas;
+    struct cnn **replicas; // data-parallel training, replicas[0] is the network itself
 } CNN;
 
+// Activations of a forward pass for inference. network_infer only reads the
+// network, so threads can share one network, each with its own context.
+typedef struct cnn_context
+{
+    Arena *workspace;
+    ndarray *c1_output;
+    ndarray *f1_output; // transposed view of c1_output
+    ndarray *d1_output;
+} CNNContext;
+
 CNN *create_network(float learning_rate);
 void network_forward(CNN *self, ndarray *input, ndarray *output);
 void network_backward(CNN *self, ndarray *target);
 void network_update(CNN *self);
+// One training step on a batch: forward, backward and update. The batch is
+// split into a shard per thread, run by replicas of the network that share
+// its weights; their gradients are reduced before a single update. The
+// result only depends on the number of threads.
+void network_train_batch(CNN *self, ndarray *input, ndarray *target, ndarray *output);
+// Asynchronous (Hogwild) training over the samples of inputs, batch_size
+// at a time: every thread trains a replica on the next batch left and
+// updates the shared weights at once, without locks or waiting for the
+// others. The updates of the threads interleave, so the result is not
+// deterministic. Returns the mean loss.
+float network_train_hogwild(CNN *self, ndarray *inputs, ndarray *targets, ndarray *outputs, int batch_size);
 void free_network(CNN *self);
 
+CNNContext *create_network_context();
+void network_infer(CNN *self, CNNContext *context, ndarray *input, ndarray *output);
+void free_network_context(CNNContext *context);
+// Predicted class of each of the num samples of data, computed by batches
+// of batch_size split across the threads. Brings the filter transforms of
+// the convolution up to date first.
+void network_predict(CNN *self, ndarray *data[], int num, int batch_size, int predictions[]);
+
+// Copy the weights of src into those of dst, in a single pass.
 void copy_network(CNN *dst, CNN *src);
+// Models are saved in the binary format of model.h. load_network maps them
+// and points the weights at the file, without copies; it also reads the text
+// format older versions saved.
 void save_network(CNN *network, const char *filename);
+// Also prepares the convolution for inference on (1, 20, 20) inputs.
 void load_network(CNN *network, const char *filename);
 #endif // CNN_H
\ No newline at end of file
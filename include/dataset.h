@@ -0,0 +1,59 @@
+#ifndef DATASET_H
+#define DATASET_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ndarray.h"
+
+// Packed datasets: a header, the int32 label of every sample, then the
+// samples as uint8 values, one after the other. Both arrays start at
+// NDA_ALIGN aligned offsets.
+#define DATASET_MAGIC "NDADATA"
+#define DATASET_VERSION 1
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t num; // samples
+    uint32_t ndim;
+    uint32_t shape[NDA_MAX_DIM]; // of a sample
+    uint64_t labels_offset; // bytes from the start of the file
+    uint64_t samples_offset;
+} DatasetHeader;
+
+// Samples kept as uint8 in one contiguous block, a quarter of their size as
+// floats: a packed dataset mapped read-only in memory, whose samples and
+// labels are read straight from the page cache, or a dataset read into
+// memory (read_dataset in misc.h).
+typedef struct {
+    void *map; // NULL if read into memory
+    size_t length;
+    void *block; // labels and samples read into memory
+    int num;
+    int ndim;
+    int shape[NDA_MAX_DIM];
+    int sample_size; // values per sample
+    float scale; // a value is its byte times scale, 1 unless set
+    const int32_t *labels;
+    const uint8_t *samples;
+} Dataset;
+
+// Pack the samples listed in index_file, lines of "<sample file> <label>" as
+// read_data reads them, each with the values of a sample of the given shape
+// in [0, 255]. Returns the number of samples. The index is read twice and
+// nothing is kept in memory per sample.
+int pack_dataset(const char *index_file, int ndim, int *shape, const char *filename);
+Dataset *open_dataset(const char *filename);
+void close_dataset(Dataset *dataset);
+
+// Values of sample i, no copy.
+const uint8_t *dataset_sample(Dataset *dataset, int i);
+
+// Like data_batch: copy samples order[start], order[start + 1], ... (start,
+// start + 1, ... if order is NULL) into a batch as floats, times the scale
+// of the dataset, with one-hot targets unless NULL. Every sample index must
+// be below the number of samples.
+void dataset_batch(Dataset *dataset, const int order[], int start, ndarray *inputs, ndarray *targets);
+
+#endif // DATASET_H
@@ -0,0 +1,39 @@
+#ifndef GEMM_H
+#define GEMM_H
+
+#include <stdint.h>
+
+// Single precision general matrix multiply on raw buffers:
+//     C = alpha * A * B + beta * C
+// A is (m, k), B is (k, n) and C is (m, n). Element (i, j) of a matrix X is
+// stored at X[i * rs_x + j * cs_x], so a transposed operand is passed by
+// swapping its row and column strides. When beta is 0, C is not read.
+void sgemm(int m, int n, int k, float alpha,
+           const float *a, int rs_a, int cs_a,
+           const float *b, int rs_b, int cs_b,
+           float beta, float *c, int rs_c, int cs_c);
+
+// C = act(A * B + bias), with bias (m) added to every column and act ReLU if
+// relu is set, identity otherwise. The bias and activation are applied as
+// the product is written back to C, not in extra passes over it.
+void sgemm_bias(int m, int n, int k,
+                const float *a, int rs_a, int cs_a,
+                const float *b, int rs_b, int cs_b,
+                const float *bias, int relu, float *c, int rs_c, int cs_c);
+
+// Same with B of bytes, each one scaled by scale: B is converted to floats
+// panel by panel as it is packed, it is never materialized in full.
+void sgemm_u8_bias(int m, int n, int k,
+                   const float *a, int rs_a, int cs_a,
+                   const uint8_t *b, int rs_b, int cs_b, float scale,
+                   const float *bias, int relu, float *c, int rs_c, int cs_c);
+
+// Fused matrix-vector product for single-sample inference:
+//     y = act(A * x + bias)
+// A is (m, k) with contiguous rows, act is ReLU if relu is set, identity
+// otherwise. Nothing is checked nor allocated and the loop is not threaded:
+// it is meant for small products where latency matters.
+void sgemv_bias(int m, int k, const float *a, int lda, const float *x,
+                const float *bias, int relu, float *y);
+
+#endif // GEMM_H
@@ -4,6 +4,7 @@
 #include "ndarray.h"
 
 #include <stdio.h>
+#include <stdint.h>
 
 typedef enum {
     NONE,
@@ -19,7 +20,8 @@ typedef struct denselayer
     ndarray *bias;
     ndarray *weights_grad;
     ndarray *bias_grad;
-    ndarray *linear_output;
+    ndarray *linear_output; // error of the samples in the backward pass, the forward pass fuses the activation
+    ndarray *output; // output of the last forward pass, the ReLU mask of the backward pass
     void (*forward)(struct denselayer *self, ndarray *input, ndarray *output);
     void (*backward)(struct denselayer *self, ndarray *input_grad, ndarray *output_grad); 
 } DenseLayer;
@@ -29,12 +31,21 @@ typedef struct convlayer
     ActivationType activation;
     int kernel_num;
     int kernel_size;
+    // One bias per filter, (kernel_num, 1, 1) broadcast over the output
+    // planes, instead of one per output element. Set by create_conv_layer.
+    int channel_bias;
     ndarray *input;
     ndarray *weights;
     ndarray *bias;
     ndarray *weights_grad;
     ndarray *bias_grad;
     ndarray *linear_output;
+    ConvAlgorithm algorithm;
+    int algorithm_selected; // algorithm and filter transforms set up for the input size
+    int prepared_shape[3]; // (depth, height, width) of the inputs they were set up for
+    ndarray *filter_transform; // weights prepared for the algorithm, if it needs it
+    ndarray *filter_transform_grad; // same, for the input gradient
+    int transform_stale; // weights changed since the transforms were computed
     void (*forward)(struct convlayer *self, ndarray *input, ndarray *output);
     void (*backward)(struct convlayer *self, ndarray *input_grad, ndarray *output_grad);
 } ConvLayer;
@@ -50,15 +61,44 @@ DenseLayer *create_dense_layer(ActivationType activation);
 ConvLayer *create_conv_layer(int kernel_num, int kernel_size, ActivationType activation);
 FlattenLayer *create_flatten_layer();
 
+// Allocate and initialize the weights and bias, and their gradients, for
+// the given input size; the forward pass does it on first use otherwise.
+void init_dense_layer(DenseLayer *self, int in_features, int out_features);
+void init_conv_layer(ConvLayer *self, int depth, int out_height, int out_width);
+
+// Forward passes for inference: they only read the layer and write output,
+// so that threads can run the same layer at once. The weights must exist.
+void infer_dense_layer(DenseLayer *self, ndarray *input, ndarray *output);
+void infer_conv_layer(ConvLayer *self, ndarray *input, ndarray *output);
+// Same on a batch of bytes, column j being the in_features bytes at
+// input + j * stride, each one times scale: they are converted inside the
+// product, without a float copy of the batch.
+void infer_dense_layer_u8(DenseLayer *self, const uint8_t *input, int stride, float scale, ndarray *output);
+// Same for one sample on raw buffers, with a single fused pass. Nothing is
+// checked: the weights and bias must be contiguous, see network_prepare_sample.
+void infer_dense_sample(DenseLayer *self, const float *input, float *output);
+// Select the convolution algorithm for (depth, height, width) inputs and
+// compute the filter transforms it needs from the current weights. Inputs
+// of another size select it again.
+void prepare_conv_layer(ConvLayer *self, int depth, int height, int width);
+// Drop the algorithm and the filter transforms, sized for the previous
+// filters, when the number or size of the filters changes.
+void reset_conv_algorithm(ConvLayer *self);
+
 void save_dense_layer(DenseLayer *layer, FILE *file);
 void save_conv_layer(ConvLayer *layer, FILE *file);
 
 void load_dense_layer(DenseLayer *layer, FILE *file);
 void load_conv_layer(ConvLayer *layer, FILE *file);
 
+// Copy the weights of src, in place if dst has weights of the same shape.
 void copy_dense_layer(DenseLayer *dst, DenseLayer *src);
 void copy_conv_layer(ConvLayer *dst, ConvLayer *src);
 
+// Make dst compute with the weights of src, without copying them.
+void share_dense_layer(DenseLayer *dst, DenseLayer *src);
+void share_conv_layer(ConvLayer *dst, ConvLayer *src);
+
 void free_dense_layer(DenseLayer *layer);
 void free_conv_layer(ConvLayer *layer);
 void free_flatten_layer(FlattenLayer *layer);
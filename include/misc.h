@@ -1,7 +1,25 @@
 #include "ndarray.h"
+#include "dataset.h"
 
 void data_shuffle(ndarray *data[], int label[], int size);
 
+// Copy samples start, start + 1, ... into a batch, with one-hot targets (classes, batch) unless NULL.
+// The batch size is the number of columns of inputs if it is a matrix, its first axis otherwise.
+void data_batch(ndarray *data[], int label[], int start, ndarray *inputs, ndarray *targets);
+
+// Fraction of the predictions equal to their label. Unless NULL, confusion
+// (classes, classes) counts the samples of each label (row) predicted as each
+// class (column).
+float evaluate_predictions(int predictions[], const int label[], int num, ndarray *confusion);
+void print_confusion(ndarray *confusion);
+
 void read_data(const char* filename, ndarray** images, int* labels, int num, int image_size, int ndim, int* shape);
+// Same, with the image files spread across the threads and parsed without
+// stdio into one (num, image_size * image_size) array, which is returned.
+// The images are views of it: free them, then it.
+ndarray *read_data_parallel(const char* filename, ndarray** images, int* labels, int num, int image_size, int ndim, int* shape);
+// Same into a dataset that keeps the images as bytes, in one block; samples
+// of the given shape. Free it with close_dataset.
+Dataset *read_dataset(const char* filename, int num, int ndim, int* shape);
 
 void read_image(const char* filename, ndarray* image, int image_size);
\ No newline at end of file
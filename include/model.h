@@ -0,0 +1,68 @@
+#ifndef MODEL_H
+#define MODEL_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include "ndarray.h"
+
+// Binary model files: a header, a table with the layer and shape of every
+// tensor, then the payload, the float32 tensors in native byte order at the
+// NDA_ALIGN aligned offsets nda_pack gives them. The checksum is the CRC-32
+// of the table and the payload.
+#define MODEL_MAGIC "NDAMODEL"
+#define MODEL_VERSION 1
+
+typedef enum {
+    MODEL_FLOAT32,
+} ModelDtype;
+
+typedef enum {
+    MODEL_DENSE,
+    MODEL_CONV,
+} ModelLayer;
+
+typedef struct {
+    char magic[8];
+    uint32_t version;
+    uint32_t dtype;
+    uint32_t num_tensors;
+    uint32_t checksum;
+    uint64_t payload_offset; // bytes from the start of the file
+    uint64_t payload_size; // bytes
+} ModelHeader;
+
+typedef struct {
+    uint32_t layer; // ModelLayer of the layer the tensor belongs to
+    uint32_t ndim;
+    uint32_t shape[NDA_MAX_DIM];
+    uint64_t offset; // bytes from the start of the payload
+} ModelTensor;
+
+// A model file mapped in memory. The mapping is private: weights trained
+// after loading are copied on write, the file is never modified.
+typedef struct {
+    void *map;
+    size_t length;
+    const ModelHeader *header;
+    const ModelTensor *tensors;
+    float *payload;
+} ModelFile;
+
+// Write params, the flat array nda_pack made of tensors; tensors[i] belongs
+// to a layer of type layers[i].
+void save_model(const char *filename, ndarray *params, ndarray *tensors[], const ModelLayer layers[], int count);
+// 1 if the file starts with MODEL_MAGIC.
+int is_model_file(const char *filename);
+// Map a model file and check its header, layout and checksum.
+ModelFile *open_model(const char *filename);
+void close_model(ModelFile *model);
+// Give the tensors the shapes of those of the model, reallocating the ones
+// that differ; returns 1 if any did, the params must then be packed again.
+int ensure_model_shapes(ModelFile *model, ndarray **tensors[], int count);
+// Replace *params and the views *tensors[i] of it by views of the payload,
+// without copies. The model must hold tensors of the same layers, shapes and
+// layout; it has to stay open as long as they are used.
+void bind_model(ModelFile *model, ndarray **params, ndarray **tensors[], const ModelLayer layers[], int count);
+
+#endif // MODEL_H
@@ -3,16 +3,38 @@
 
 #include <stddef.h>
 
+#include "arena.h"
+
+typedef enum {
+    NO_TRANS,
+    TRANS,
+} TransposeType;
+
+// Algorithms available to compute a 3D convolution.
+typedef enum {
+    CONV_IM2COL,
+    CONV_WINOGRAD,
+    CONV_FFT,
+} ConvAlgorithm;
+
+// Highest rank of an ndarray, its shape and strides are stored inline.
+#define NDA_MAX_DIM 4
+
+// An owning ndarray is one NDA_ALIGN aligned allocation: the header, padded
+// to NDA_ALIGN bytes, followed by the data.
 typedef struct {
     int ndim;
     int size;
-    int *shape;
-    int *strides;
+    int shape[NDA_MAX_DIM];
+    int strides[NDA_MAX_DIM];
     float *data;
+    int is_view; // data belongs to another ndarray
 } ndarray;
 
 // Create a new ndarray with the given shape.
 ndarray *nda_zero(int ndim, int *shape);
+// Same, with the header and data taken from an arena; released with the arena, not nda_free.
+ndarray *nda_arena_zero(Arena *arena, int ndim, int *shape);
 
 void nda_init_data(ndarray *arr, float *data);
 void nda_init_rand(ndarray *arr);
@@ -26,6 +48,8 @@ void nda_print_shape(ndarray *arr);
 void nda_free(ndarray *arr);
 
 // Basic calculations on ndarrays.
+// The binary ops broadcast like NumPy: a and b are aligned on their last
+// axis, and each of their axes is either that of out or 1, repeated.
 void nda_add(ndarray *a, ndarray *b, ndarray *out);
 void nda_sub(ndarray *a, ndarray *b, ndarray *out);
 void nda_mul(ndarray *a, ndarray *b, ndarray *out);
@@ -37,16 +61,44 @@ void nda_div_scalar(ndarray *a, float b, ndarray *out);
 float nda_sum(ndarray *a);
 float nda_max(ndarray *a);
 int nda_argmax(ndarray *a);
+// Row of the largest entry of each column of a matrix.
+void nda_argmax_cols(ndarray *a, int out[]);
 void nda_normalize(ndarray *a, ndarray *out);
+// Batches are matrices with one sample per column.
+// out = a + col, col : (rows, 1) is added to every column of a.
+void nda_add_cols(ndarray *a, ndarray *col, ndarray *out);
+// out : (rows, 1) = alpha * sum of the columns of a.
+void nda_sum_cols(ndarray *a, float alpha, ndarray *out);
 
 // Ndarray operations.
-void nda_reshape(ndarray *a, int ndim, int *shape);
+// Views share the data of a, freeing one with nda_free leaves the data alone.
+ndarray *nda_view(ndarray *a, int ndim, int *shape, int *strides, int offset);
+// Contiguous view of data owned by the caller, e.g. a mapped file.
+ndarray *nda_wrap(float *data, int ndim, int *shape);
+// Elements [start, end) along axis.
+ndarray *nda_slice(ndarray *a, int axis, int start, int end);
+// Same, returned by value so that nothing is allocated; never nda_free it.
+ndarray nda_slice_of(ndarray *a, int axis, int start, int end);
+// Contiguous view of a with another shape of the same size.
+ndarray *nda_reshape(ndarray *a, int ndim, int *shape);
+int nda_is_contiguous(ndarray *a);
+// Replace *a (which may be NULL) by a new ndarray unless it already has the shape, returns 1 if it did.
+int nda_ensure_shape(ndarray **a, int ndim, int *shape);
 ndarray* nda_deepcopy(ndarray *a);
 void nda_copy(ndarray *a, ndarray *out);
 void nda_stack(ndarray *a[], int n, ndarray *out);
+// Move *arrays[0], ..., *arrays[count - 1] into one new flat ndarray and
+// replace each by a contiguous view of it, starting on an NDA_ALIGN
+// boundary. The old arrays are freed; the flat one is returned.
+ndarray *nda_pack(ndarray **arrays[], int count);
 
 // Matrix operations.
 void nda_dot(ndarray *a, ndarray *b, ndarray *out);
+// out = alpha * op(a) * op(b) + beta * out, op transposes its operand if asked.
+void nda_gemm(TransposeType trans_a, TransposeType trans_b, float alpha, ndarray *a, ndarray *b, float beta, ndarray *out);
+// out = act(a * b + bias), bias : (rows, 1) added to every column, act is the
+// ReLU if relu is set. Bias and activation are fused into the product.
+void nda_dot_bias(ndarray *a, ndarray *b, ndarray *bias, int relu, ndarray *out);
 void nda_T(ndarray *a);
 void nda_flip(ndarray *a);
 void nda_pad(ndarray *a, int pad, ndarray *out);
@@ -54,15 +106,46 @@ void nda_pad(ndarray *a, int pad, ndarray *out);
 // Convolution operations.
 void nda_conv2d(ndarray *a, ndarray *b, ndarray *out);
 void nda_conv3d(ndarray *a, ndarray *b, ndarray *out);
+// Lower a (in_depth, H, W) input into a (in_depth * kh * kw, out_h * out_w) column matrix.
+void nda_im2col(ndarray *a, int kh, int kw, ndarray *col);
+// 3D convolution as one GEMM over the im2col lowering of a, stored in col.
+void nda_conv3d_gemm(ndarray *a, ndarray *b, ndarray *col, ndarray *out);
+// Scatter-add a column matrix back into a zeroed (in_depth, H, W) array, inverse of nda_im2col.
+void nda_col2im(ndarray *col, int kh, int kw, ndarray *out);
+// Gradients of nda_conv3d_gemm given the output gradient dy : (filter_num, out_height, out_width).
+// col holds the lowering of the input, col_grad is the workspace for its gradient.
+// The weights gradient is db = alpha * dy * col^T + beta * db, to accumulate over a batch.
+void nda_conv3d_grad_weights(float alpha, ndarray *dy, ndarray *col, float beta, ndarray *db);
+void nda_conv3d_grad_input(ndarray *dy, ndarray *b, ndarray *col_grad, ndarray *da);
+// Winograd F(m x m, 3 x 3) convolution for 3x3 filters, m is 2 or 4 and alpha = m + 2.
+// Filters are transformed once into u : (alpha * alpha, filter_num, in_depth), or for the
+// input gradient into (alpha * alpha, in_depth, filter_num) with the filters rotated by 180 degrees.
+void nda_winograd_filter(ndarray *b, int m, ndarray *u);
+void nda_winograd_filter_grad(ndarray *b, int m, ndarray *u);
+// a is implicitly zero padded by pad on each side, out : (filter_num, H + 2 * pad - 2, W + 2 * pad - 2).
+void nda_conv3d_winograd(ndarray *a, ndarray *u, int m, int pad, ndarray *out);
+// FFT convolution on a grid of nda_fft_length(H) x nda_fft_length(W) points, the
+// smallest powers of two holding the input. The filters are transformed once into
+// spectra : (filter_num, in_depth, rows, 2 * cols), interleaved complex values.
+int nda_fft_length(int n);
+void nda_fft_filter(ndarray *b, ndarray *spectra);
+// out : (filter_num, H - kernel_size + 1, W - kernel_size + 1).
+void nda_conv3d_fft(ndarray *a, ndarray *spectra, int kernel_size, ndarray *out);
+// Pick the cheapest algorithm for a stride 1 convolution from a cost model.
+ConvAlgorithm nda_conv_select(int in_depth, int h, int w, int filter_num, int kernel_size);
 
 // Activation functions.
 void nda_relu(ndarray *a, ndarray *out);
 void nda_identity(ndarray *a, ndarray *out);
+// Each column of a matrix is a separate distribution.
 void nda_softmax(ndarray *a, ndarray *out);
 
 // Activation function derivatives.
 void nda_relu_prime(ndarray *a, ndarray *out);
 void nda_identity_prime(ndarray *a, ndarray *out);
+// out = grad where output > 0, 0 elsewhere: grad through the ReLU that gave
+// output, in one pass.
+void nda_relu_grad(ndarray *grad, ndarray *output, ndarray *out);
 
 // Loss functions.
 float mse(ndarray *pr, ndarray *tr);
@@ -70,8 +153,18 @@ void mse_prime(ndarray *pr, ndarray *tr, ndarray *out);
 
 float cross_entropy(ndarray *pr, ndarray *tr);
 void cross_entropy_prime(ndarray *pr, ndarray *tr, ndarray *out);
+// Cross entropy of the softmax output pr (its log clamped like cross_entropy)
+// and, in the same pass, its gradient with respect to the logits, pr - tr.
+float nda_softmax_cross_entropy(ndarray *pr, ndarray *tr, ndarray *grad);
 
 // Optimizers.
 void sgd(ndarray *w, ndarray *dw, float lr);
 
+// Data-parallel training. grads[r * count + i] is gradient i of replica r.
+// Scale the gradients of replica r by scale[r] and sum them into those of
+// replica 0 along a binary tree (replica r + 1 into r, then r + 2 into r, ...):
+// the order of the additions only depends on the number of replicas. The
+// gradients must be contiguous, a flat one per replica reduces in one pass.
+void nda_tree_reduce(ndarray *grads[], const float scale[], int replicas, int count);
+
 #endif // NDARRAY_H
@@ -2,15 +2,24 @@
 #define NETWORK_H
 
 #include "layer.h"
+#include "model.h"
+#include "dataset.h"
 
 typedef struct network
 {
     float learning_rate;
     float loss;
+    Arena *workspace; // scratch of the layers, reset every step
 
     DenseLayer *dense1;
     DenseLayer *dense2;
     DenseLayer *dense3;
+    // All the weights and biases in one flat array, the layers hold views of
+    // it; same for their gradients. A replica's params is a view of those of
+    // the network it replicates.
+    ndarray *params;
+    ndarray *grads;
+    ModelFile *model; // mapped file params points into, NULL if it owns its data
 
     ndarray *d1_output;
     ndarray *d1_input_grad;
@@ -18,17 +27,60 @@ typedef struct network
     ndarray *d2_output;
     ndarray *d2_input_grad;
 
-    ndarray *d3_output;
+    ndarray *d3_output; // output of the last forward pass, owned by the caller
     ndarray *d3_input_grad;
+
+    int num_replicas;
+    struct network **replicas; // data-parallel training, replicas[0] is the network itself
 } Network;
 
+// Activations of a forward pass for inference. network_infer only reads the
+// network, so threads can share one network, each with its own context.
+typedef struct network_context
+{
+    Arena *workspace;
+    ndarray *d1_output;
+    ndarray *d2_output;
+} NetworkContext;
+
 Network *create_network(float learning_rate);
 void network_forward(Network *self, ndarray *input, ndarray *output);
 void network_backward(Network *self, ndarray *target);
 void network_update(Network *self);
+// One training step on a batch: forward, backward and update. The batch is
+// split into a shard per thread, run by replicas of the network that share
+// its weights; their gradients are reduced before a single update. The
+// result only depends on the number of threads.
+void network_train_batch(Network *self, ndarray *input, ndarray *target, ndarray *output);
+// Asynchronous (Hogwild) training over the samples of inputs, batch_size
+// at a time: every thread trains a replica on the next batch left and
+// updates the shared weights at once, without locks or waiting for the
+// others. The updates of the threads interleave, so the result is not
+// deterministic. Returns the mean loss.
+float network_train_hogwild(Network *self, ndarray *inputs, ndarray *targets, ndarray *outputs, int batch_size);
 void free_network(Network *self);
 
+NetworkContext *create_network_context();
+void network_infer(Network *self, NetworkContext *context, ndarray *input, ndarray *output);
+void free_network_context(NetworkContext *context);
+// Low-latency inference of one sample. network_prepare_sample checks the
+// weights and sizes the buffers of the context once; network_infer_sample
+// then reads input (400 floats) and writes output (10 floats) with no
+// checks, allocations or copies. Prepare again after new weights are loaded.
+void network_prepare_sample(Network *self, NetworkContext *context);
+void network_infer_sample(Network *self, NetworkContext *context, const float *input, float *output);
+// Predicted class of each of the num samples of data, computed by batches
+// of batch_size split across the threads.
+void network_predict(Network *self, ndarray *data[], int num, int batch_size, int predictions[]);
+// Same on the bytes of a dataset, never converted as a whole: the first layer
+// scales them to floats as it packs them for its GEMM.
+void network_predict_dataset(Network *self, Dataset *dataset, int batch_size, int predictions[]);
+
+// Copy the weights of src into those of dst, in a single pass.
 void copy_network(Network *dst, Network *src);
+// Models are saved in the binary format of model.h. load_network maps them
+// and points the weights at the file, without copies; it also reads the text
+// format older versions saved.
 void save_network(Network *network, const char *filename);
 void load_network(Network *network, const char *filename);
 #endif // NETWORK_H
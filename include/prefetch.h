@@ -0,0 +1,30 @@
+#ifndef PREFETCH_H
+#define PREFETCH_H
+
+#include "dataset.h"
+
+// Batches of a dataset prepared ahead by a background thread. The thread
+// converts the next batches into a ring of preallocated buffers, handed
+// over through a single-producer single-consumer queue, while the caller
+// trains on the current one. Memory stays bounded by the ring, whatever the
+// size of the dataset. The batches run through the dataset epoch after
+// epoch, reshuffled at the start of each one if asked to.
+typedef struct
+{
+    ndarray *inputs; // laid out like data_batch fills them
+    ndarray *targets; // one-hot, (classes, size)
+    int *labels;
+    int size; // samples, the last batch of an epoch may be smaller
+    int epoch;
+} Batch;
+
+typedef struct prefetcher Prefetcher;
+
+// Batches with inputs of the given shape, the batch size on the last axis of
+// a matrix, on the first axis otherwise; depth is the number of buffers.
+Prefetcher *create_prefetcher(Dataset *dataset, int ndim, int *shape, int classes, int depth, int shuffle);
+// Next batch, valid until the following call.
+Batch *next_batch(Prefetcher *prefetcher);
+void free_prefetcher(Prefetcher *prefetcher);
+
+#endif // PREFETCH_H
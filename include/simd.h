@@ -0,0 +1,50 @@
+#ifndef SIMD_H
+#define SIMD_H
+
+// Vectorized kernels on contiguous float buffers, with one implementation
+// per instruction set. The widest set the CPU supports is bound on first
+// use; the NDA_SIMD environment variable (scalar, sse4.2, avx2 or avx512)
+// picks a narrower one.
+typedef enum {
+    SIMD_SCALAR,
+    SIMD_SSE42,
+    SIMD_AVX2,
+    SIMD_AVX512,
+    SIMD_ISA_COUNT,
+} SimdIsa;
+
+typedef struct {
+    const char *name;
+    // out = a op b
+    void (*add)(int n, const float *a, const float *b, float *out);
+    void (*sub)(int n, const float *a, const float *b, float *out);
+    void (*mul)(int n, const float *a, const float *b, float *out);
+    void (*div)(int n, const float *a, const float *b, float *out);
+    // out = a op s
+    void (*add_scalar)(int n, const float *a, float s, float *out);
+    void (*sub_scalar)(int n, const float *a, float s, float *out);
+    void (*mul_scalar)(int n, const float *a, float s, float *out);
+    void (*div_scalar)(int n, const float *a, float s, float *out);
+    // Pairwise sum: the rounding error grows with log(n), not n.
+    float (*sum)(int n, const float *a);
+    // Largest element and the index of its first occurrence, n > 0.
+    float (*max)(int n, const float *a);
+    int (*argmax)(int n, const float *a);
+    void (*relu)(int n, const float *a, float *out);
+    void (*relu_prime)(int n, const float *a, float *out);
+    // out = grad where output > 0, 0 elsewhere.
+    void (*relu_grad)(int n, const float *grad, const float *output, float *out);
+    // y += alpha * x
+    void (*axpy)(int n, float alpha, const float *x, float *y);
+    // y = exp(x - shift), added to sum.
+    void (*exp_row)(int n, const float *x, const float *shift, float *y, float *sum);
+    // g = p - t, returns the cross entropy -sum(t * log(clamp(p, 1e-8, 1 - 1e-8))).
+    float (*xent)(int n, const float *p, const float *t, float *g);
+} SimdKernels;
+
+// Kernels bound for this process.
+const SimdKernels *simd_kernels();
+// Kernels of one instruction set, NULL if the CPU does not support it.
+const SimdKernels *simd_kernels_for(SimdIsa isa);
+
+#endif // SIMD_H
@@ -0,0 +1,33 @@
+#ifndef THREADPOOL_H
+#define THREADPOOL_H
+
+// Work-stealing thread pool shared by the ndarray kernels.
+//
+// A parallel loop over [0, n) is cut into chunks of grain iterations. Every
+// thread starts with an even share of the chunks and, once it runs out,
+// steals half of the chunks left to another thread. The calling thread
+// takes part in the loop. Loops started from inside a parallel loop run
+// serially on the calling thread.
+
+// Body of a parallel loop, called on the iterations [begin, end).
+typedef void (*RangeFunc)(void *arg, int begin, int end);
+// Same, returning the partial result of its iterations.
+typedef float (*ReduceFunc)(void *arg, int begin, int end);
+
+// Number of threads, the caller included. The default is the NDA_NUM_THREADS
+// environment variable, or the number of online cores; setting 0 restores it.
+// Changing the pool waits for a loop running on another thread to finish; it
+// is an error from inside a loop.
+void nda_set_num_threads(int num_threads);
+int nda_num_threads();
+// Pin worker i to core i (modulo the number of cores), also enabled by setting
+// NDA_PIN_THREADS=1. The workers are threads 1 to n - 1: the calling thread is
+// never pinned. Takes effect when the pool is (re)started.
+void nda_set_thread_pinning(int pin);
+
+void nda_parallel_for(int n, int grain, RangeFunc fn, void *arg);
+// Sum of the partial results of the chunks, added in chunk order: the result
+// does not depend on the number of threads or on the schedule.
+float nda_parallel_reduce(int n, int grain, ReduceFunc fn, void *arg);
+
+#endif // THREADPOOL_H
@@ -0,0 +1,177 @@
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define ALIGN_UP(n) (((n) + NDA_ALIGN - 1) / NDA_ALIGN * NDA_ALIGN)
+
+struct arenablock
+{
+    ArenaBlock *next;
+    size_t size;
+};
+
+static AllocFunc alloc_hook = aligned_alloc;
+static FreeFunc free_hook = free;
+
+// Scratch arena of the calling thread, and the default one used when none is set.
+static _Thread_local Arena *current_workspace = NULL;
+static _Thread_local Arena *default_workspace = NULL;
+
+void nda_set_allocator(AllocFunc alloc_fn, FreeFunc free_fn){
+    alloc_hook = alloc_fn != NULL ? alloc_fn : aligned_alloc;
+    free_hook = free_fn != NULL ? free_fn : free;
+}
+
+void *nda_alloc(size_t size){
+    void *ptr = alloc_hook(NDA_ALIGN, ALIGN_UP(size > 0 ? size : 1));
+    if (ptr == NULL) {
+        fprintf(stderr, "malloc failed\n");
+        exit(1);
+    }
+    return ptr;
+}
+
+void nda_dealloc(void *ptr){
+    if (ptr != NULL) {
+        free_hook(ptr);
+    }
+}
+
+Arena *create_arena(size_t size){
+    Arena *arena = nda_alloc(sizeof(Arena));
+    arena->size = ALIGN_UP(size);
+    arena->data = arena->size > 0 ? nda_alloc(arena->size) : NULL;
+    arena->used = 0;
+    arena->peak = 0;
+    arena->overflow = NULL;
+    arena->overflow_size = 0;
+    arena->workers = NULL;
+    arena->num_workers = 0;
+    return arena;
+}
+
+static void free_overflow(Arena *arena){
+    while (arena->overflow != NULL) {
+        ArenaBlock *next = arena->overflow->next;
+        nda_dealloc(arena->overflow);
+        arena->overflow = next;
+    }
+    arena->overflow_size = 0;
+}
+
+static void free_workers(Arena *arena){
+    for (int i = 0; i < arena->num_workers; i++) {
+        free_arena(arena->workers[i]);
+    }
+    nda_dealloc(arena->workers);
+    arena->workers = NULL;
+    arena->num_workers = 0;
+}
+
+void free_arena(Arena *arena){
+    free_workers(arena);
+    free_overflow(arena);
+    nda_dealloc(arena->data);
+    nda_dealloc(arena);
+}
+
+void *arena_alloc(Arena *arena, size_t size){
+    size = ALIGN_UP(size);
+    if (arena->used + size <= arena->size) {
+        void *ptr = arena->data + arena->used;
+        arena->used += size;
+        if (arena->used + arena->overflow_size > arena->peak) {
+            arena->peak = arena->used + arena->overflow_size;
+        }
+        return ptr;
+    }
+    // Out of room: serve the request from its own block until the next reset.
+    ArenaBlock *block = nda_alloc(NDA_ALIGN + size);
+    block->next = arena->overflow;
+    block->size = size;
+    arena->overflow = block;
+    arena->overflow_size += size;
+    if (arena->used + arena->overflow_size > arena->peak) {
+        arena->peak = arena->used + arena->overflow_size;
+    }
+    return (char *)block + NDA_ALIGN;
+}
+
+void arena_reset(Arena *arena){
+    if (arena->overflow != NULL || arena->peak > arena->size) {
+        free_overflow(arena);
+        nda_dealloc(arena->data);
+        arena->size = ALIGN_UP(arena->peak);
+        arena->data = nda_alloc(arena->size);
+    }
+    arena->used = 0;
+}
+
+ArenaMark arena_mark(Arena *arena){
+    return (ArenaMark){arena->used, arena->overflow_size};
+}
+
+void arena_release(Arena *arena, ArenaMark mark){
+    // Overflow blocks are stacked, the ones allocated since the mark are on top.
+    while (arena->overflow != NULL && arena->overflow_size > mark.overflow_size) {
+        ArenaBlock *next = arena->overflow->next;
+        arena->overflow_size -= arena->overflow->size;
+        nda_dealloc(arena->overflow);
+        arena->overflow = next;
+    }
+    if (mark.used <= arena->used) {
+        arena->used = mark.used;
+    }
+}
+
+void arena_prepare_workers(Arena *arena, int count){
+    if (arena->num_workers != count) {
+        free_workers(arena);
+        arena->workers = nda_alloc(count * sizeof(Arena *));
+        for (int i = 0; i < count; i++) {
+            arena->workers[i] = create_arena(0);
+        }
+        arena->num_workers = count;
+    }
+    size_t peak = 0;
+    for (int i = 0; i < count; i++) {
+        peak = arena->workers[i]->peak > peak ? arena->workers[i]->peak : peak;
+    }
+    for (int i = 0; i < count; i++) {
+        arena->workers[i]->peak = peak;
+        arena_reset(arena->workers[i]);
+    }
+}
+
+Arena *arena_worker(Arena *arena, int i){
+    return arena->workers[i];
+}
+
+Arena *nda_set_workspace(Arena *arena){
+    Arena *previous = current_workspace;
+    current_workspace = arena;
+    return previous;
+}
+
+Arena *nda_workspace(){
+    if (current_workspace != NULL) {
+        return current_workspace;
+    }
+    if (default_workspace == NULL) {
+        default_workspace = create_arena(0);
+    }
+    // Nothing outlives a kernel call in the default arena, so it can be
+    // compacted whenever it is handed out empty.
+    if (default_workspace->used == 0 && default_workspace->overflow == NULL) {
+        arena_reset(default_workspace);
+    }
+    return default_workspace;
+}
+
+void nda_free_default_workspace(){
+    if (default_workspace != NULL) {
+        free_arena(default_workspace);
+        default_workspace = NULL;
+    }
+}
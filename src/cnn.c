@@ -1,29 +1,104 @@
 #include "cnn.h"
+#include "threadpool.h"
+#include "misc.h"
+#include "model.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdatomic.h>
+
+// Size the activations and their gradients for a batch, they are only
+// reallocated when the batch size changes.
+static void network_resize(CNN *self, int batch){
+    int c1_shape[4] = {batch, 32, 18, 18};
+    int realloc_output = nda_ensure_shape(&self->c1_output, 4, c1_shape);
+    int realloc_grad = nda_ensure_shape(&self->c1_input_grad, 4, c1_shape);
+    // Flattening is free: the dense layer reads the convolution output, one
+    // sample per column, through a transposed view.
+    if (realloc_output) {
+        if (self->f1_output != NULL) nda_free(self->f1_output);
+        self->f1_output = nda_reshape(self->c1_output, 2, (int[]){batch, 32*18*18});
+        nda_T(self->f1_output);
+    }
+    if (realloc_grad) {
+        if (self->f1_input_grad != NULL) nda_free(self->f1_input_grad);
+        self->f1_input_grad = nda_reshape(self->c1_input_grad, 2, (int[]){batch, 32*18*18});
+        nda_T(self->f1_input_grad);
+    }
+    nda_ensure_shape(&self->d1_output, 2, (int[]){128, batch});
+    nda_ensure_shape(&self->d1_input_grad, 2, (int[]){128, batch});
+    nda_ensure_shape(&self->d2_input_grad, 2, (int[]){10, batch});
+}
+
+#define NUM_PARAMS 6
+
+static void network_tensors(CNN *self, ndarray **params[], ndarray **grads[]){
+    params[0] = &self->conv1->weights;
+    params[1] = &self->conv1->bias;
+    params[2] = &self->dense1->weights;
+    params[3] = &self->dense1->bias;
+    params[4] = &self->dense2->weights;
+    params[5] = &self->dense2->bias;
+    grads[0] = &self->conv1->weights_grad;
+    grads[1] = &self->conv1->bias_grad;
+    grads[2] = &self->dense1->weights_grad;
+    grads[3] = &self->dense1->bias_grad;
+    grads[4] = &self->dense2->weights_grad;
+    grads[5] = &self->dense2->bias_grad;
+}
+
+static const ModelLayer layer_types[NUM_PARAMS] = {MODEL_CONV, MODEL_CONV, MODEL_DENSE, MODEL_DENSE, MODEL_DENSE, MODEL_DENSE};
+
+// Move the weights and biases of the layers into params and their gradients
+// into grads, once they were created or replaced.
+static void network_pack(CNN *self){
+    ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS];
+    network_tensors(self, params, grads);
+    for (int i = 0; i < NUM_PARAMS; i++) {
+        nda_ensure_shape(grads[i], (*params[i])->ndim, (*params[i])->shape);
+    }
+    ndarray *packed_params = nda_pack(params, NUM_PARAMS), *packed_grads = nda_pack(grads, NUM_PARAMS);
+    if (self->params != NULL) nda_free(self->params);
+    if (self->grads != NULL) nda_free(self->grads);
+    self->params = packed_params;
+    self->grads = packed_grads;
+    self->conv1->transform_stale = 1;
+}
 
 CNN *create_network(float learning_rate){
     // input: (1, 20, 20)
-    CNN *network = malloc(sizeof(CNN));
+    CNN *network = nda_alloc(sizeof(CNN));
 
     network->conv1 = create_conv_layer(32, 3, RELU);
     network->flat1 = create_flatten_layer();
     network->dense1 = create_dense_layer(RELU);
     network->dense2 = create_dense_layer(SOFTMAX);
+    init_conv_layer(network->conv1, 1, 18, 18);
+    init_dense_layer(network->dense1, 32*18*18, 128);
+    init_dense_layer(network->dense2, 128, 10);
+    network->params = NULL;
+    network->grads = NULL;
+    network->model = NULL;
+    network_pack(network);
+
+    network->c1_output = NULL;
+    network->c1_input_grad = NULL;
+
+    network->f1_output = NULL;
+    network->f1_input_grad = NULL;
 
-    network->c1_output = nda_zero(3, (int[]){32, 18, 18});
-    network->c1_input_grad = nda_zero(3, (int[]){32, 18, 18});
+    network->d1_output = NULL;
+    network->d1_input_grad = NULL;
 
-    network->f1_output = nda_zero(2, (int[]){32*18*18, 1});
-    network->f1_input_grad = nda_zero(2, (int[]){32*18*18, 1});
+    network->d2_output = NULL;
+    network->d2_input_grad = NULL;
+    network_resize(network, 1);
 
-    network->d1_output = nda_zero(2, (int[]){128, 1});
-    network->d1_input_grad = nda_zero(2, (int[]){128, 1});
+    network->workspace = create_arena(0);
 
-    network->d2_output = nda_zero(2, (int[]){10, 1});
-    network->d2_input_grad = nda_zero(2, (int[]){10, 1});
+    network->num_replicas = 0;
+    network->replicas = NULL;
 
     network->loss = 0;
     network->learning_rate = learning_rate;
@@ -31,47 +106,189 @@ CNN *create_network(float learning_rate){
 }
 
 void network_forward(CNN *self, ndarray *input, ndarray *output){
-    // input : (1, 20, 20)
-    // output: (10, 1)
+    // input : (1, 20, 20) or (batch, 1, 20, 20)
+    // output: (10, batch)
+    network_resize(self, input->ndim == 4 ? input->shape[0] : 1);
+    // A step starts with the forward pass, its scratch memory is recycled.
+    arena_reset(self->workspace);
+    Arena *previous = nda_set_workspace(self->workspace);
     self->conv1->forward(self->conv1, input, self->c1_output);
     self->flat1->forward(self->c1_output, self->f1_output);
     self->dense1->forward(self->dense1, self->f1_output, self->d1_output);
+    // The last layer writes straight into the caller's output, which the
+    // backward pass reads back.
+    self->d2_output = output;
     self->dense2->forward(self->dense2, self->d1_output, self->d2_output);
-    nda_copy(self->d2_output, output);
+    nda_set_workspace(previous);
 }
 
 void network_backward(CNN *self, ndarray *target){
-    // target: (10, 1)
-    self->loss = cross_entropy(self->d2_output, target);
-    cross_entropy_prime(self->d2_output, target, self->d2_input_grad);
+    // target: (10, batch), the gradients are averaged over the batch
+    Arena *previous = nda_set_workspace(self->workspace);
+    self->loss = nda_softmax_cross_entropy(self->d2_output, target, self->d2_input_grad);
     self->dense2->backward(self->dense2, self->d2_input_grad, self->d1_input_grad);
     self->dense1->backward(self->dense1, self->d1_input_grad, self->f1_input_grad);
     self->flat1->backward(self->f1_input_grad, self->c1_input_grad);
     self->conv1->backward(self->conv1, self->c1_input_grad, NULL);
+    nda_set_workspace(previous);
 }
 
 void network_update(CNN *self){
-    sgd(self->conv1->weights, self->conv1->weights_grad, self->learning_rate);
-    sgd(self->conv1->bias, self->conv1->bias_grad, self->learning_rate);
+    sgd(self->params, self->grads, self->learning_rate);
+}
+
+static void free_replicas(CNN *self){
+    for (int r = 1; r < self->num_replicas; r++) {
+        free_network(self->replicas[r]);
+    }
+    if (self->replicas != NULL) nda_dealloc(self->replicas);
+    self->replicas = NULL;
+    self->num_replicas = 0;
+}
+
+// One replica per thread, rebuilt when the number of threads changes or the
+// weights of the network were packed anew (load_network).
+static void network_replicate(CNN *self){
+    int num = nda_num_threads();
+    int current = self->num_replicas == num;
+    for (int r = 1; current && r < num; r++) {
+        current = self->replicas[r]->params->data == self->params->data;
+    }
+    if (current) {
+        return;
+    }
+    free_replicas(self);
+    self->replicas = nda_alloc(num * sizeof(CNN *));
+    self->replicas[0] = self;
+    for (int r = 1; r < num; r++) {
+        CNN *replica = create_network(self->learning_rate);
+        share_conv_layer(replica->conv1, self->conv1);
+        share_dense_layer(replica->dense1, self->dense1);
+        share_dense_layer(replica->dense2, self->dense2);
+        nda_free(replica->params);
+        replica->params = nda_reshape(self->params, 1, self->params->shape);
+        self->replicas[r] = replica;
+    }
+    self->num_replicas = num;
+}
+
+typedef struct
+{
+    CNN *network;
+    ndarray *input;
+    ndarray *target;
+    ndarray *output;
+    int shards;
+} TrainArgs;
+
+static void train_shards(void *arg, int begin, int end){
+    TrainArgs *t = arg;
+    int batch = t->input->shape[0];
+    for (int r = begin; r < end; r++) {
+        int start = batch * r / t->shards, stop = batch * (r + 1) / t->shards;
+        CNN *replica = t->network->replicas[r];
+        ndarray x = nda_slice_of(t->input, 0, start, stop);
+        ndarray y = nda_slice_of(t->output, 1, start, stop);
+        ndarray target = nda_slice_of(t->target, 1, start, stop);
+        network_forward(replica, &x, &y);
+        network_backward(replica, &target);
+    }
+}
+
+void network_train_batch(CNN *self, ndarray *input, ndarray *target, ndarray *output){
+    if (input->ndim != 4) {
+        network_forward(self, input, output);
+        network_backward(self, target);
+        network_update(self);
+        return;
+    }
+    int batch = input->shape[0];
+    network_replicate(self);
+    int shards = self->num_replicas < batch ? self->num_replicas : batch;
+    TrainArgs t = {self, input, target, output, shards};
+    nda_parallel_for(shards, 1, train_shards, &t);
+
+    // The batch gradient is the mean of the shard gradients weighted by
+    // their sizes, and so is the loss.
+    ndarray *grads[shards];
+    float scale[shards];
+    float loss = 0;
+    for (int r = 0; r < shards; r++) {
+        scale[r] = (float)(batch * (r + 1) / shards - batch * r / shards) / batch;
+        loss += scale[r] * self->replicas[r]->loss;
+        grads[r] = self->replicas[r]->grads;
+    }
+    if (shards > 1) {
+        nda_tree_reduce(grads, scale, shards, 1);
+    }
+    self->loss = loss;
+    self->d2_output = output;
+    network_update(self);
+}
+
+typedef struct
+{
+    CNN *network;
+    ndarray *inputs;
+    ndarray *targets;
+    ndarray *outputs;
+    int batch_size;
+    atomic_int next; // first sample of the next batch to train on
+    float *losses; // loss summed over the samples of each replica
+} HogwildArgs;
+
+static void hogwild_replicas(void *arg, int begin, int end){
+    HogwildArgs *h = arg;
+    int num = h->inputs->shape[0];
+    for (int r = begin; r < end; r++) {
+        CNN *replica = h->network->replicas[r];
+        replica->learning_rate = h->network->learning_rate;
+        int start;
+        while ((start = atomic_fetch_add(&h->next, h->batch_size)) < num) {
+            int stop = start + h->batch_size < num ? start + h->batch_size : num;
+            ndarray x = nda_slice_of(h->inputs, 0, start, stop);
+            ndarray y = nda_slice_of(h->outputs, 1, start, stop);
+            ndarray target = nda_slice_of(h->targets, 1, start, stop);
+            network_forward(replica, &x, &y);
+            network_backward(replica, &target);
+            // The weights are shared: the update races with the other
+            // replicas on purpose, without locks.
+            network_update(replica);
+            h->losses[r] += replica->loss * (stop - start);
+        }
+    }
+}
 
-    sgd(self->dense1->weights, self->dense1->weights_grad, self->learning_rate);
-    sgd(self->dense1->bias, self->dense1->bias_grad, self->learning_rate);
-    // printf("dense1\n");
-    sgd(self->dense2->weights, self->dense2->weights_grad, self->learning_rate);
-    sgd(self->dense2->bias, self->dense2->bias_grad, self->learning_rate);
-    // printf("dense2\n");
+float network_train_hogwild(CNN *self, ndarray *inputs, ndarray *targets, ndarray *outputs, int batch_size){
+    int num = inputs->shape[0];
+    network_replicate(self);
+    float losses[self->num_replicas];
+    for (int r = 0; r < self->num_replicas; r++) {
+        losses[r] = 0;
+    }
+    HogwildArgs h = {self, inputs, targets, outputs, batch_size, 0, losses};
+    nda_parallel_for(self->num_replicas, 1, hogwild_replicas, &h);
+    float loss = 0;
+    for (int r = 0; r < self->num_replicas; r++) {
+        loss += losses[r];
+    }
+    self->loss = loss / num;
+    return self->loss;
 }
 
 void free_network(CNN *self){
+    free_replicas(self);
     free_dense_layer(self->dense1);
     free_dense_layer(self->dense2);
     free_flatten_layer(self->flat1);
     free_conv_layer(self->conv1);
+    nda_free(self->params);
+    nda_free(self->grads);
+    if (self->model != NULL) close_model(self->model);
 
     nda_free(self->d1_output);
     nda_free(self->d1_input_grad);
 
-    nda_free(self->d2_output);
     nda_free(self->d2_input_grad);
     
     nda_free(self->f1_output);
@@ -80,26 +297,97 @@ void free_network(CNN *self){
     nda_free(self->c1_output);
     nda_free(self->c1_input_grad);
     
-    free(self);
+    free_arena(self->workspace);
+    nda_dealloc(self);
 }
 
-void save_network(CNN *network, const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        printf("Error opening file!\n");
-        exit(1);
+CNNContext *create_network_context(){
+    CNNContext *context = nda_alloc(sizeof(CNNContext));
+    context->workspace = create_arena(0);
+    context->c1_output = NULL;
+    context->f1_output = NULL;
+    context->d1_output = NULL;
+    return context;
+}
+
+void network_infer(CNN *self, CNNContext *context, ndarray *input, ndarray *output){
+    // input : (1, 20, 20) or (batch, 1, 20, 20)
+    // output: (10, batch)
+    int batch = input->ndim == 4 ? input->shape[0] : 1;
+    if (nda_ensure_shape(&context->c1_output, 4, (int[]){batch, 32, 18, 18})) {
+        if (context->f1_output != NULL) nda_free(context->f1_output);
+        context->f1_output = nda_reshape(context->c1_output, 2, (int[]){batch, 32*18*18});
+        nda_T(context->f1_output);
     }
+    nda_ensure_shape(&context->d1_output, 2, (int[]){128, batch});
+    arena_reset(context->workspace);
+    Arena *previous = nda_set_workspace(context->workspace);
+    infer_conv_layer(self->conv1, input, context->c1_output);
+    infer_dense_layer(self->dense1, context->f1_output, context->d1_output);
+    infer_dense_layer(self->dense2, context->d1_output, output);
+    nda_set_workspace(previous);
+}
 
-    // Save parameters for each layer
-    save_dense_layer(network->dense1, file);
-    save_dense_layer(network->dense2, file);
-    
-    save_conv_layer(network->conv1, file);
+void free_network_context(CNNContext *context){
+    if (context->f1_output != NULL) nda_free(context->f1_output);
+    if (context->c1_output != NULL) nda_free(context->c1_output);
+    if (context->d1_output != NULL) nda_free(context->d1_output);
+    free_arena(context->workspace);
+    nda_dealloc(context);
+}
 
-    fclose(file);
+typedef struct
+{
+    CNN *network;
+    ndarray **data;
+    int num;
+    int batch_size;
+    int *predictions;
+    atomic_int next; // first sample of the next batch to predict
+} PredictArgs;
+
+// Each task runs batches in its own context until none is left.
+static void predict_batches(void *arg, int begin, int end){
+    PredictArgs *p = arg;
+    for (int task = begin; task < end; task++) {
+        CNNContext *context = create_network_context();
+        ndarray *inputs = nda_zero(4, (int[]){p->batch_size, 1, 20, 20});
+        ndarray *outputs = nda_zero(2, (int[]){10, p->batch_size});
+        int start;
+        while ((start = atomic_fetch_add(&p->next, p->batch_size)) < p->num) {
+            int n = p->num - start < p->batch_size ? p->num - start : p->batch_size;
+            ndarray *x = nda_slice(inputs, 0, 0, n);
+            ndarray *y = nda_slice(outputs, 1, 0, n);
+            data_batch(p->data, NULL, start, x, NULL);
+            network_infer(p->network, context, x, y);
+            nda_argmax_cols(y, p->predictions + start);
+            nda_free(x), nda_free(y);
+        }
+        nda_free(inputs), nda_free(outputs);
+        free_network_context(context);
+    }
 }
 
-void load_network(CNN *network, const char *filename) {
+void network_predict(CNN *self, ndarray *data[], int num, int batch_size, int predictions[]){
+    // Training leaves the filter transforms stale, inference needs them.
+    prepare_conv_layer(self->conv1, 1, 20, 20);
+    int batches = (num + batch_size - 1) / batch_size;
+    int tasks = nda_num_threads() < batches ? nda_num_threads() : batches;
+    PredictArgs p = {self, data, num, batch_size, predictions, 0};
+    nda_parallel_for(tasks, 1, predict_batches, &p);
+}
+
+void save_network(CNN *network, const char *filename) {
+    ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS], *tensors[NUM_PARAMS];
+    network_tensors(network, params, grads);
+    for (int i = 0; i < NUM_PARAMS; i++) {
+        tensors[i] = *params[i];
+    }
+    save_model(filename, network->params, tensors, layer_types, NUM_PARAMS);
+}
+
+// Text format of older versions, the weights are parsed one by one.
+static void load_network_text(CNN *network, const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         printf("Error opening file!\n");
@@ -111,14 +399,53 @@ void load_network(CNN *network, const char *filename) {
     load_dense_layer(network->dense2, file);
     
     load_conv_layer(network->conv1, file);
+    fclose(file);
+    network_pack(network);
+}
 
+// The activations are sized for the 32 3x3 filters of create_network, over a
+// single channel: a model can only change the layout of the bias.
+static void check_conv_shape(ConvLayer *conv, const char *filename){
+    ndarray *w = conv->weights;
+    if (w->shape[0] != 32 || w->shape[1] != 1 || w->shape[2] != 3 || w->shape[3] != 3) {
+        fprintf(stderr, "model %s does not match the network: %d filters of %dx%dx%d, expected 32 of 1x3x3\n",
+                filename, w->shape[0], w->shape[1], w->shape[2], w->shape[3]);
+        exit(1);
+    }
+}
+
+void load_network(CNN *network, const char *filename) {
+    ModelFile *previous = network->model;
+    if (is_model_file(filename)) {
+        ModelFile *model = open_model(filename);
+        ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS];
+        network_tensors(network, params, grads);
+        if (ensure_model_shapes(model, params, NUM_PARAMS)) {
+            // Layers saved with other sizes, e.g. a bias per output position.
+            ConvLayer *conv = network->conv1;
+            check_conv_shape(conv, filename);
+            conv->channel_bias = conv->bias->shape[1] == 1 && conv->bias->shape[2] == 1;
+            network_pack(network);
+            network_tensors(network, params, grads);
+        }
+        bind_model(model, &network->params, params, layer_types, NUM_PARAMS);
+        network->model = model;
+    } else {
+        load_network_text(network, filename);
+        check_conv_shape(network->conv1, filename);
+        network->model = NULL;
+    }
+    if (previous != NULL) close_model(previous);
+    network->conv1->transform_stale = 1;
+    prepare_conv_layer(network->conv1, 1, 20, 20);
     printf("Loaded network from %s\n", filename);
-    fclose(file);
 }
 
 void copy_network(CNN *dst, CNN *src){
-    copy_dense_layer(dst->dense1, src->dense1);
-    copy_dense_layer(dst->dense2, src->dense2);
-    
-    copy_conv_layer(dst->conv1, src->conv1);
+    nda_copy(src->params, dst->params);
+    // The replicas convolve with their own filter transforms.
+    dst->conv1->transform_stale = 1;
+    for (int r = 1; r < dst->num_replicas; r++) {
+        dst->replicas[r]->conv1->transform_stale = 1;
+    }
 }
\ No newline at end of file
@@ -0,0 +1,199 @@
+#include "dataset.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN_UP(n) (((n) + NDA_ALIGN - 1) / NDA_ALIGN * NDA_ALIGN)
+
+static void write_or_die(const void *data, size_t size, FILE *file, const char *filename){
+    if (fwrite(data, 1, size, file) != size) {
+        fprintf(stderr, "Error writing dataset %s\n", filename);
+        exit(1);
+    }
+}
+
+static void seek_or_die(FILE *file, long offset, const char *filename){
+    if (fseek(file, offset, SEEK_SET) != 0) {
+        fprintf(stderr, "Error writing dataset %s\n", filename);
+        exit(1);
+    }
+}
+
+int pack_dataset(const char *index_file, int ndim, int *shape, const char *filename){
+    FILE *index = fopen(index_file, "r");
+    if (index == NULL) {
+        printf("Cannot open file %s\n", index_file);
+        exit(1);
+    }
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        exit(1);
+    }
+    DatasetHeader header = {
+        .magic = DATASET_MAGIC,
+        .version = DATASET_VERSION,
+        .ndim = ndim,
+    };
+    int sample_size = 1;
+    for (int d = 0; d < ndim; d++) {
+        header.shape[d] = shape[d];
+        sample_size *= shape[d];
+    }
+    header.labels_offset = ALIGN_UP(sizeof(DatasetHeader));
+
+    // The index is streamed twice, nothing is kept per sample: the labels
+    // are written as they are read, then the samples after them. The header
+    // is written again once the number of samples is known.
+    static const char padding[NDA_ALIGN];
+    char path[255];
+    int32_t label;
+    int num = 0;
+    seek_or_die(file, header.labels_offset, filename);
+    while (fscanf(index, "%254s %d", path, &label) == 2) {
+        write_or_die(&label, sizeof(label), file, filename);
+        num++;
+    }
+    header.num = num;
+    header.samples_offset = ALIGN_UP(header.labels_offset + num * sizeof(int32_t));
+    write_or_die(padding, header.samples_offset - header.labels_offset - num * sizeof(int32_t), file, filename);
+
+    rewind(index);
+    uint8_t *sample = malloc(sample_size);
+    for (int i = 0; i < num; i++) {
+        if (fscanf(index, "%254s %d", path, &label) != 2) {
+            fprintf(stderr, "%s changed while packing it\n", index_file);
+            exit(1);
+        }
+        FILE *sample_file = fopen(path, "r");
+        if (sample_file == NULL) {
+            printf("Cannot open file %s\n", path);
+            exit(1);
+        }
+        for (int j = 0; j < sample_size; j++) {
+            int value;
+            if (fscanf(sample_file, "%d", &value) != 1 || value < 0 || value > 255) {
+                fprintf(stderr, "%s: expected %d values in [0, 255]\n", path, sample_size);
+                exit(1);
+            }
+            sample[j] = value;
+        }
+        fclose(sample_file);
+        write_or_die(sample, sample_size, file, filename);
+    }
+    fclose(index);
+    free(sample);
+
+    seek_or_die(file, 0, filename);
+    write_or_die(&header, sizeof(header), file, filename);
+    write_or_die(padding, header.labels_offset - sizeof(header), file, filename);
+    if (fclose(file) != 0) {
+        fprintf(stderr, "Error writing dataset %s\n", filename);
+        exit(1);
+    }
+    return num;
+}
+
+static void dataset_error(const char *filename, const char *reason){
+    fprintf(stderr, "Invalid dataset file %s: %s\n", filename, reason);
+    exit(1);
+}
+
+Dataset *open_dataset(const char *filename){
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        exit(1);
+    }
+    size_t length = st.st_size;
+    if (length < sizeof(DatasetHeader)) {
+        dataset_error(filename, "truncated header");
+    }
+    void *map = mmap(NULL, length, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping file %s\n", filename);
+        exit(1);
+    }
+
+    const DatasetHeader *header = map;
+    if (memcmp(header->magic, DATASET_MAGIC, sizeof(header->magic)) != 0) {
+        dataset_error(filename, "bad magic");
+    }
+    if (header->version != DATASET_VERSION) {
+        dataset_error(filename, "unsupported version");
+    }
+    if (header->ndim < 1 || header->ndim > NDA_MAX_DIM) {
+        dataset_error(filename, "bad sample shape");
+    }
+    uint64_t sample_size = 1;
+    for (uint32_t d = 0; d < header->ndim; d++) {
+        sample_size *= header->shape[d];
+    }
+    if (sample_size == 0 || sample_size > INT32_MAX) {
+        dataset_error(filename, "bad sample shape");
+    }
+    if (header->labels_offset < sizeof(DatasetHeader) || header->labels_offset % sizeof(int32_t) != 0
+        || header->labels_offset + header->num * sizeof(int32_t) > header->samples_offset
+        || header->samples_offset > length || header->num * sample_size > length - header->samples_offset) {
+        dataset_error(filename, "truncated or misplaced arrays");
+    }
+
+    Dataset *dataset = nda_alloc(sizeof(Dataset));
+    dataset->map = map;
+    dataset->length = length;
+    dataset->block = NULL;
+    dataset->scale = 1;
+    dataset->num = header->num;
+    dataset->ndim = header->ndim;
+    for (uint32_t d = 0; d < header->ndim; d++) {
+        dataset->shape[d] = header->shape[d];
+    }
+    dataset->sample_size = sample_size;
+    dataset->labels = (const int32_t *)((const char *)map + header->labels_offset);
+    dataset->samples = (const uint8_t *)map + header->samples_offset;
+    return dataset;
+}
+
+void close_dataset(Dataset *dataset){
+    if (dataset->map != NULL) munmap(dataset->map, dataset->length);
+    nda_dealloc(dataset->block);
+    nda_dealloc(dataset);
+}
+
+const uint8_t *dataset_sample(Dataset *dataset, int i){
+    return dataset->samples + (size_t)i * dataset->sample_size;
+}
+
+void dataset_batch(Dataset *dataset, const int order[], int start, ndarray *inputs, ndarray *targets){
+    // Samples are the columns of a matrix, or contiguous along the first axis.
+    int axis = inputs->ndim == 2 ? 1 : 0;
+    int step = axis == 1 ? inputs->strides[0] : 1;
+    if (inputs->size / inputs->shape[axis] != dataset->sample_size || (axis == 0 && !nda_is_contiguous(inputs))) {
+        fprintf(stderr, "dataset batch: samples of %d values do not fit the inputs\n", dataset->sample_size);
+        exit(1);
+    }
+    for (int i = 0; i < inputs->shape[axis]; i++) {
+        int s = order != NULL ? order[start + i] : start + i;
+        if (s < 0 || s >= dataset->num) {
+            fprintf(stderr, "dataset batch: sample %d out of %d\n", s, dataset->num);
+            exit(1);
+        }
+        const uint8_t *x = dataset_sample(dataset, s);
+        float *dst = inputs->data + i * inputs->strides[axis];
+        for (int j = 0; j < dataset->sample_size; j++) {
+            dst[j * step] = dataset->scale * x[j];
+        }
+        if (targets != NULL) {
+            for (int j = 0; j < targets->shape[0]; j++) {
+                targets->data[j * targets->strides[0] + i * targets->strides[1]] = j == dataset->labels[s];
+            }
+        }
+    }
+}
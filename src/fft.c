@@ -0,0 +1,240 @@
+#include "ndarray.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+// Twiddle factors e^{-2 pi i k / n}, one table per power of two n. Tables are
+// built on first use under the mutex and kept; once published, a table is
+// looked up without locking.
+static _Atomic(float *) twiddles[32];
+static pthread_mutex_t twiddles_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static const float *fft_twiddles(int n){
+    int log_n = 0;
+    while ((1 << log_n) < n) {
+        log_n++;
+    }
+    float *table = atomic_load_explicit(&twiddles[log_n], memory_order_acquire);
+    if (table != NULL) {
+        return table;
+    }
+    pthread_mutex_lock(&twiddles_mutex);
+    table = atomic_load_explicit(&twiddles[log_n], memory_order_relaxed);
+    if (table == NULL) {
+        table = nda_alloc(n * sizeof(float));
+        for (int k = 0; k < n / 2; k++) {
+            table[2 * k] = cos(2 * M_PI * k / n);
+            table[2 * k + 1] = -sin(2 * M_PI * k / n);
+        }
+        atomic_store_explicit(&twiddles[log_n], table, memory_order_release);
+    }
+    pthread_mutex_unlock(&twiddles_mutex);
+    return table;
+}
+
+int nda_fft_length(int n){
+    int len = 1;
+    while (len < n) {
+        len *= 2;
+    }
+    return len;
+}
+
+// In-place iterative radix-2 transform of n interleaved complex values, tw
+// being the twiddle table of size n.
+static void fft(float *x, int n, int inverse, const float *tw){
+    for (int i = 1, j = 0; i < n; i++) {
+        int bit = n >> 1;
+        for (; j & bit; bit >>= 1) {
+            j ^= bit;
+        }
+        j ^= bit;
+        if (i < j) {
+            float re = x[2 * i], im = x[2 * i + 1];
+            x[2 * i] = x[2 * j];
+            x[2 * i + 1] = x[2 * j + 1];
+            x[2 * j] = re;
+            x[2 * j + 1] = im;
+        }
+    }
+    for (int len = 2; len <= n; len *= 2) {
+        int step = n / len;
+        for (int i = 0; i < n; i += len) {
+            for (int j = 0; j < len / 2; j++) {
+                float wr = tw[2 * j * step];
+                float wi = inverse ? -tw[2 * j * step + 1] : tw[2 * j * step + 1];
+                float *u = x + 2 * (i + j);
+                float *v = x + 2 * (i + j + len / 2);
+                float tr = v[0] * wr - v[1] * wi;
+                float ti = v[0] * wi + v[1] * wr;
+                v[0] = u[0] - tr;
+                v[1] = u[1] - ti;
+                u[0] += tr;
+                u[1] += ti;
+            }
+        }
+    }
+}
+
+// 2D transform of a (rows, cols) complex grid, rows then columns.
+static void fft2d(float *x, int rows, int cols, int inverse, float *line){
+    const float *row_tw = fft_twiddles(cols), *col_tw = fft_twiddles(rows);
+    for (int i = 0; i < rows; i++) {
+        fft(x + 2 * i * cols, cols, inverse, row_tw);
+    }
+    for (int j = 0; j < cols; j++) {
+        for (int i = 0; i < rows; i++) {
+            line[2 * i] = x[2 * (i * cols + j)];
+            line[2 * i + 1] = x[2 * (i * cols + j) + 1];
+        }
+        fft(line, rows, inverse, col_tw);
+        for (int i = 0; i < rows; i++) {
+            x[2 * (i * cols + j)] = line[2 * i];
+            x[2 * (i * cols + j) + 1] = line[2 * i + 1];
+        }
+    }
+}
+
+// Zero pad a (h, w) real plane with the given strides into a complex grid.
+static void load_plane(const float *src, int h, int w, int rs, int cs, float *x, int rows, int cols){
+    memset(x, 0, 2 * rows * cols * sizeof(float));
+    for (int i = 0; i < h; i++) {
+        for (int j = 0; j < w; j++) {
+            x[2 * (i * cols + j)] = src[i * rs + j * cs];
+        }
+    }
+}
+
+void nda_fft_filter(ndarray *b, ndarray *spectra){
+    /* b : 4D, (filter_num, in_depth, filter_height, filter_width)
+       spectra : 4D, (filter_num, in_depth, rows, 2 * cols), conjugated filter spectra
+    */
+    int rows = spectra->shape[2], cols = spectra->shape[3] / 2;
+    if (b->ndim != 4 || spectra->ndim != 4
+        || spectra->shape[0] != b->shape[0] || spectra->shape[1] != b->shape[1]
+        || rows != nda_fft_length(rows) || cols != nda_fft_length(cols)
+        || spectra->shape[3] != 2 * cols || rows < b->shape[2] || cols < b->shape[3]) {
+        fprintf(stderr, "ndarray shape mismatch for fft filter\n");
+        exit(1);
+    }
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    float *line = arena_alloc(ws, 2 * rows * sizeof(float));
+    for (int n = 0; n < b->shape[0]; n++) {
+        for (int c = 0; c < b->shape[1]; c++) {
+            float *x = spectra->data + n * spectra->strides[0] + c * spectra->strides[1];
+            load_plane(b->data + n * b->strides[0] + c * b->strides[1], b->shape[2], b->shape[3],
+                       b->strides[2], b->strides[3], x, rows, cols);
+            fft2d(x, rows, cols, 0, line);
+            // Correlation multiplies by the conjugate spectrum.
+            for (int i = 0; i < rows * cols; i++) {
+                x[2 * i + 1] = -x[2 * i + 1];
+            }
+        }
+    }
+    arena_release(ws, mark);
+}
+
+// The input spectra are computed in parallel over the channels, then the
+// outputs over the filters; each task takes its buffers from the workspace
+// of its thread.
+typedef struct
+{
+    ndarray *a;
+    ndarray *spectra;
+    ndarray *out;
+    int rows, cols;
+    float *x;
+} FFTArgs;
+
+static void input_spectra(void *arg, int begin, int end){
+    FFTArgs *f = arg;
+    ndarray *a = f->a;
+    int grid = 2 * f->rows * f->cols;
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    float *line = arena_alloc(ws, 2 * f->rows * sizeof(float));
+    for (int c = begin; c < end; c++) {
+        load_plane(a->data + c * a->strides[0], a->shape[1], a->shape[2],
+                   a->strides[1], a->strides[2], f->x + c * grid, f->rows, f->cols);
+        fft2d(f->x + c * grid, f->rows, f->cols, 0, line);
+    }
+    arena_release(ws, mark);
+}
+
+static void filter_outputs(void *arg, int begin, int end){
+    FFTArgs *f = arg;
+    ndarray *spectra = f->spectra, *out = f->out;
+    int rows = f->rows, cols = f->cols, grid = 2 * rows * cols;
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    float *acc = arena_alloc(ws, (grid + 2 * rows) * sizeof(float));
+    float *line = acc + grid;
+    // The circular correlation does not wrap around for the valid outputs
+    // because the grid is at least as large as the input.
+    float scale = 1.0f / (rows * cols);
+    for (int n = begin; n < end; n++) {
+        memset(acc, 0, grid * sizeof(float));
+        for (int c = 0; c < spectra->shape[1]; c++) {
+            const float *s = spectra->data + n * spectra->strides[0] + c * spectra->strides[1];
+            const float *xc = f->x + c * grid;
+            for (int i = 0; i < rows * cols; i++) {
+                acc[2 * i] += xc[2 * i] * s[2 * i] - xc[2 * i + 1] * s[2 * i + 1];
+                acc[2 * i + 1] += xc[2 * i] * s[2 * i + 1] + xc[2 * i + 1] * s[2 * i];
+            }
+        }
+        fft2d(acc, rows, cols, 1, line);
+        for (int i = 0; i < out->shape[1]; i++) {
+            for (int j = 0; j < out->shape[2]; j++) {
+                out->data[n * out->strides[0] + i * out->strides[1] + j * out->strides[2]] = acc[2 * (i * cols + j)] * scale;
+            }
+        }
+    }
+    arena_release(ws, mark);
+}
+
+void nda_conv3d_fft(ndarray *a, ndarray *spectra, int kernel_size, ndarray *out){
+    int depth = a->shape[0], filter_num = spectra->shape[0];
+    int rows = spectra->shape[2], cols = spectra->shape[3] / 2;
+    if (a->ndim != 3 || spectra->ndim != 4 || out->ndim != 3
+        || spectra->shape[1] != depth || out->shape[0] != filter_num
+        || rows < a->shape[1] || cols < a->shape[2] || kernel_size < 1
+        || out->shape[1] != a->shape[1] - kernel_size + 1
+        || out->shape[2] != a->shape[2] - kernel_size + 1) {
+        fprintf(stderr, "ndarray shape mismatch for fft conv3d\n");
+        exit(1);
+    }
+    // Input spectra for every channel.
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    FFTArgs f = {a, spectra, out, rows, cols, arena_alloc(ws, depth * 2 * rows * cols * sizeof(float))};
+    nda_parallel_for(depth, 1, input_spectra, &f);
+    nda_parallel_for(filter_num, 1, filter_outputs, &f);
+    arena_release(ws, mark);
+}
+
+ConvAlgorithm nda_conv_select(int in_depth, int h, int w, int filter_num, int kernel_size){
+    // 3x3 filters go to Winograd; otherwise compare multiply-add estimates
+    // of the im2col GEMM with the FFT path, whose filter spectra are cached.
+    if (kernel_size == 3) {
+        return CONV_WINOGRAD;
+    }
+    double out_size = (double)(h - kernel_size + 1) * (w - kernel_size + 1);
+    double gemm = (double)filter_num * in_depth * kernel_size * kernel_size * out_size;
+
+    int rows = nda_fft_length(h), cols = nda_fft_length(w);
+    double grid = (double)rows * cols;
+    double transform = 2.5 * grid * log2(grid); // butterflies of one 2D transform
+    double fft_cost = (in_depth + filter_num) * transform + 4.0 * filter_num * in_depth * grid;
+    // The butterflies are scalar and strided, the GEMM is register tiled.
+    return 2 * fft_cost < gemm ? CONV_FFT : CONV_IM2COL;
+}
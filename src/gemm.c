@@ -0,0 +1,414 @@
+#include "gemm.h"
+#include "arena.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include <immintrin.h>
+
+// Register tile computed by the micro-kernel (MR x NR) and cache blocks:
+// a KC x NR sliver of packed B stays in L1, a MC x KC block of packed A in
+// L2 and a KC x NC panel of packed B in L3.
+#define MR 6
+#define NR 16
+#define MC 72
+#define KC 256
+#define NC 1024
+
+// Products of at least PARALLEL_FLOPS multiply-adds are split into tiles of
+// C of TILE_M x TILE_N, computed by the threads of the pool.
+#define TILE_M MC
+#define TILE_N 256
+#define PARALLEL_FLOPS (1 << 18)
+
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+
+typedef void (*MicroKernel)(int kc, const float *a, const float *b, float *ab);
+typedef void (*GemvKernel)(int m, int k, const float *a, int lda, const float *x,
+                           const float *bias, int relu, float *y);
+
+static MicroKernel micro_kernel = NULL;
+static GemvKernel gemv_kernel = NULL;
+static pthread_once_t gemm_once = PTHREAD_ONCE_INIT;
+
+// Micro-kernels: ab (MR x NR, row-major) = sum over p of a[p] * b[p]^T, where
+// a is a packed MR wide sliver of A and b a packed NR wide sliver of B.
+static void kernel_scalar(int kc, const float *a, const float *b, float *ab){
+    float acc[MR][NR] = {{0}};
+    for (int p = 0; p < kc; p++) {
+        for (int i = 0; i < MR; i++) {
+            for (int j = 0; j < NR; j++) {
+                acc[i][j] += a[i] * b[j];
+            }
+        }
+        a += MR;
+        b += NR;
+    }
+    memcpy(ab, acc, sizeof(acc));
+}
+
+__attribute__((target("avx2,fma")))
+static void kernel_avx2(int kc, const float *a, const float *b, float *ab){
+    __m256 c00 = _mm256_setzero_ps(), c01 = _mm256_setzero_ps();
+    __m256 c10 = _mm256_setzero_ps(), c11 = _mm256_setzero_ps();
+    __m256 c20 = _mm256_setzero_ps(), c21 = _mm256_setzero_ps();
+    __m256 c30 = _mm256_setzero_ps(), c31 = _mm256_setzero_ps();
+    __m256 c40 = _mm256_setzero_ps(), c41 = _mm256_setzero_ps();
+    __m256 c50 = _mm256_setzero_ps(), c51 = _mm256_setzero_ps();
+
+    for (int p = 0; p < kc; p++) {
+        __m256 b0 = _mm256_load_ps(b);
+        __m256 b1 = _mm256_load_ps(b + 8);
+        __m256 ai;
+        ai = _mm256_broadcast_ss(a + 0);
+        c00 = _mm256_fmadd_ps(ai, b0, c00); c01 = _mm256_fmadd_ps(ai, b1, c01);
+        ai = _mm256_broadcast_ss(a + 1);
+        c10 = _mm256_fmadd_ps(ai, b0, c10); c11 = _mm256_fmadd_ps(ai, b1, c11);
+        ai = _mm256_broadcast_ss(a + 2);
+        c20 = _mm256_fmadd_ps(ai, b0, c20); c21 = _mm256_fmadd_ps(ai, b1, c21);
+        ai = _mm256_broadcast_ss(a + 3);
+        c30 = _mm256_fmadd_ps(ai, b0, c30); c31 = _mm256_fmadd_ps(ai, b1, c31);
+        ai = _mm256_broadcast_ss(a + 4);
+        c40 = _mm256_fmadd_ps(ai, b0, c40); c41 = _mm256_fmadd_ps(ai, b1, c41);
+        ai = _mm256_broadcast_ss(a + 5);
+        c50 = _mm256_fmadd_ps(ai, b0, c50); c51 = _mm256_fmadd_ps(ai, b1, c51);
+        a += MR;
+        b += NR;
+    }
+
+    _mm256_store_ps(ab + 0 * NR, c00); _mm256_store_ps(ab + 0 * NR + 8, c01);
+    _mm256_store_ps(ab + 1 * NR, c10); _mm256_store_ps(ab + 1 * NR + 8, c11);
+    _mm256_store_ps(ab + 2 * NR, c20); _mm256_store_ps(ab + 2 * NR + 8, c21);
+    _mm256_store_ps(ab + 3 * NR, c30); _mm256_store_ps(ab + 3 * NR + 8, c31);
+    _mm256_store_ps(ab + 4 * NR, c40); _mm256_store_ps(ab + 4 * NR + 8, c41);
+    _mm256_store_ps(ab + 5 * NR, c50); _mm256_store_ps(ab + 5 * NR + 8, c51);
+}
+
+static void gemv_bias_scalar(int m, int k, const float *a, int lda, const float *x,
+                             const float *bias, int relu, float *y){
+    for (int i = 0; i < m; i++) {
+        const float *row = a + i * lda;
+        float sum = 0;
+        for (int p = 0; p < k; p++) {
+            sum += row[p] * x[p];
+        }
+        sum += bias[i];
+        y[i] = relu && sum < 0 ? 0 : sum;
+    }
+}
+
+__attribute__((target("avx2,fma")))
+static float hsum_avx2(__m256 v){
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_movehdup_ps(s));
+    return _mm_cvtss_f32(s);
+}
+
+// Four rows at a time share the loads of x.
+__attribute__((target("avx2,fma")))
+static void gemv_bias_avx2(int m, int k, const float *a, int lda, const float *x,
+                           const float *bias, int relu, float *y){
+    int i = 0;
+    for (; i + 4 <= m; i += 4) {
+        const float *a0 = a + i * lda, *a1 = a0 + lda, *a2 = a1 + lda, *a3 = a2 + lda;
+        __m256 s0 = _mm256_setzero_ps(), s1 = _mm256_setzero_ps();
+        __m256 s2 = _mm256_setzero_ps(), s3 = _mm256_setzero_ps();
+        int p = 0;
+        for (; p + 8 <= k; p += 8) {
+            __m256 xp = _mm256_loadu_ps(x + p);
+            s0 = _mm256_fmadd_ps(_mm256_loadu_ps(a0 + p), xp, s0);
+            s1 = _mm256_fmadd_ps(_mm256_loadu_ps(a1 + p), xp, s1);
+            s2 = _mm256_fmadd_ps(_mm256_loadu_ps(a2 + p), xp, s2);
+            s3 = _mm256_fmadd_ps(_mm256_loadu_ps(a3 + p), xp, s3);
+        }
+        float sum[4] = {hsum_avx2(s0), hsum_avx2(s1), hsum_avx2(s2), hsum_avx2(s3)};
+        for (; p < k; p++) {
+            sum[0] += a0[p] * x[p];
+            sum[1] += a1[p] * x[p];
+            sum[2] += a2[p] * x[p];
+            sum[3] += a3[p] * x[p];
+        }
+        for (int r = 0; r < 4; r++) {
+            float v = sum[r] + bias[i + r];
+            y[i + r] = relu && v < 0 ? 0 : v;
+        }
+    }
+    if (i < m) {
+        gemv_bias_scalar(m - i, k, a + i * lda, lda, x, bias + i, relu, y + i);
+    }
+}
+
+static void gemm_init(){
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) {
+        micro_kernel = kernel_avx2;
+        gemv_kernel = gemv_bias_avx2;
+    } else {
+        micro_kernel = kernel_scalar;
+        gemv_kernel = gemv_bias_scalar;
+    }
+}
+
+// Copy a mc x kc block of A into MR row slivers, zero padding the last one.
+static void pack_a(int mc, int kc, const float *a, int rs, int cs, float *buf){
+    for (int ir = 0; ir < mc; ir += MR) {
+        int mr = MIN(MR, mc - ir);
+        for (int p = 0; p < kc; p++) {
+            for (int i = 0; i < mr; i++) {
+                buf[i] = a[(ir + i) * rs + p * cs];
+            }
+            for (int i = mr; i < MR; i++) {
+                buf[i] = 0;
+            }
+            buf += MR;
+        }
+    }
+}
+
+// Copy a kc x nc panel of B into NR column slivers, zero padding the last one.
+static void pack_b(int kc, int nc, const float *b, int rs, int cs, float *buf){
+    for (int jr = 0; jr < nc; jr += NR) {
+        int nr = MIN(NR, nc - jr);
+        for (int p = 0; p < kc; p++) {
+            const float *row = b + p * rs + jr * cs;
+            if (cs == 1 && nr == NR) {
+                memcpy(buf, row, NR * sizeof(float));
+            } else {
+                for (int j = 0; j < nr; j++) {
+                    buf[j] = row[j * cs];
+                }
+                for (int j = nr; j < NR; j++) {
+                    buf[j] = 0;
+                }
+            }
+            buf += NR;
+        }
+    }
+}
+
+// Same for a B of bytes, converted and scaled as they are copied.
+static void pack_b_u8(int kc, int nc, const uint8_t *b, int rs, int cs, float scale, float *buf){
+    for (int jr = 0; jr < nc; jr += NR) {
+        int nr = MIN(NR, nc - jr);
+        for (int p = 0; p < kc; p++) {
+            const uint8_t *row = b + p * rs + jr * cs;
+            for (int j = 0; j < nr; j++) {
+                buf[j] = scale * row[j * cs];
+            }
+            for (int j = nr; j < NR; j++) {
+                buf[j] = 0;
+            }
+            buf += NR;
+        }
+    }
+}
+
+// Write back a mr x nr corner of the micro tile into C, adding bias (one
+// per row) unless NULL and applying the ReLU if relu is set.
+static void update_c(int mr, int nr, float alpha, const float *ab, float beta, float *c, int rs_c, int cs_c,
+                     const float *bias, int relu){
+    for (int i = 0; i < mr; i++) {
+        float b = bias != NULL ? bias[i] : 0;
+        for (int j = 0; j < nr; j++) {
+            float *cij = c + i * rs_c + j * cs_c;
+            float v = alpha * ab[i * NR + j] + b;
+            if (beta != 0) {
+                v += beta * *cij;
+            }
+            *cij = relu && v < 0 ? 0 : v;
+        }
+    }
+}
+
+// Bias and ReLU as a separate pass, for the paths that do not go through
+// update_c.
+static void epilogue(int m, int n, const float *bias, int relu, float *c, int rs_c, int cs_c){
+    if (bias == NULL && !relu) {
+        return;
+    }
+    for (int i = 0; i < m; i++) {
+        float b = bias != NULL ? bias[i] : 0;
+        for (int j = 0; j < n; j++) {
+            float *cij = c + i * rs_c + j * cs_c;
+            *cij = relu && *cij + b < 0 ? 0 : *cij + b;
+        }
+    }
+}
+
+// Matrix-vector product, used when C has a single column so that packing B
+// into NR wide slivers would waste most of the micro-kernel.
+static void gemv(int m, int k, float alpha, const float *a, int rs_a, int cs_a,
+                 const float *x, int inc_x, float beta, float *y, int inc_y){
+    for (int i = 0; i < m; i++) {
+        y[i * inc_y] = beta == 0 ? 0 : beta * y[i * inc_y];
+    }
+    if (cs_a == 1) {
+        // Rows of A are contiguous: one dot product per output.
+        for (int i = 0; i < m; i++) {
+            const float *row = a + i * rs_a;
+            float sum = 0;
+            for (int p = 0; p < k; p++) {
+                sum += row[p] * x[p * inc_x];
+            }
+            y[i * inc_y] += alpha * sum;
+        }
+    } else {
+        // Columns of A are contiguous (transposed operand): axpy per input.
+        for (int p = 0; p < k; p++) {
+            const float *col = a + p * cs_a;
+            float xp = alpha * x[p * inc_x];
+            for (int i = 0; i < m; i++) {
+                y[i * inc_y] += xp * col[i * rs_a];
+            }
+        }
+    }
+}
+
+// B is b, or the bytes b_u8 times b_scale when b_u8 is not NULL.
+static void gemm_serial(int m, int n, int k, float alpha,
+                        const float *a, int rs_a, int cs_a,
+                        const float *b, const uint8_t *b_u8, float b_scale, int rs_b, int cs_b,
+                        float beta, float *c, int rs_c, int cs_c,
+                        const float *bias, int relu){
+    if (k <= 0 || alpha == 0) {
+        for (int i = 0; i < m; i++) {
+            for (int j = 0; j < n; j++) {
+                float *cij = c + i * rs_c + j * cs_c;
+                *cij = beta == 0 ? 0 : beta * *cij;
+            }
+        }
+        epilogue(m, n, bias, relu, c, rs_c, cs_c);
+        return;
+    }
+    if (n == 1 && b_u8 == NULL) {
+        gemv(m, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c);
+        epilogue(m, n, bias, relu, c, rs_c, cs_c);
+        return;
+    }
+    if (m == 1 && b_u8 == NULL) {
+        // C^T = B^T * A^T
+        gemv(n, k, alpha, b, cs_b, rs_b, a, cs_a, beta, c, cs_c);
+        epilogue(m, n, bias, relu, c, rs_c, cs_c);
+        return;
+    }
+    pthread_once(&gemm_once, gemm_init);
+
+    // Packed panels are scratch from the workspace of the thread.
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    int mc_max = (MIN(MC, m) + MR - 1) / MR * MR;
+    int nc_max = (MIN(NC, n) + NR - 1) / NR * NR;
+    float *packed_a = arena_alloc(ws, mc_max * MIN(KC, k) * sizeof(float));
+    float *packed_b = arena_alloc(ws, MIN(KC, k) * nc_max * sizeof(float));
+    float ab[MR * NR] __attribute__((aligned(64)));
+    for (int jc = 0; jc < n; jc += NC) {
+        int nc = MIN(NC, n - jc);
+        for (int pc = 0; pc < k; pc += KC) {
+            int kc = MIN(KC, k - pc);
+            // Only the first pass over K scales the previous content of C,
+            // only the last one applies the bias and the activation.
+            float beta_pc = pc == 0 ? beta : 1;
+            int last = pc + kc == k;
+            if (b_u8 != NULL) {
+                pack_b_u8(kc, nc, b_u8 + pc * rs_b + jc * cs_b, rs_b, cs_b, b_scale, packed_b);
+            } else {
+                pack_b(kc, nc, b + pc * rs_b + jc * cs_b, rs_b, cs_b, packed_b);
+            }
+            for (int ic = 0; ic < m; ic += MC) {
+                int mc = MIN(MC, m - ic);
+                pack_a(mc, kc, a + ic * rs_a + pc * cs_a, rs_a, cs_a, packed_a);
+                for (int jr = 0; jr < nc; jr += NR) {
+                    for (int ir = 0; ir < mc; ir += MR) {
+                        micro_kernel(kc, packed_a + ir * kc, packed_b + jr * kc, ab);
+                        update_c(MIN(MR, mc - ir), MIN(NR, nc - jr), alpha, ab, beta_pc,
+                                 c + (ic + ir) * rs_c + (jc + jr) * cs_c, rs_c, cs_c,
+                                 last && bias != NULL ? bias + ic + ir : NULL, last && relu);
+                    }
+                }
+            }
+        }
+    }
+    arena_release(ws, mark);
+}
+
+typedef struct
+{
+    int m, n, k;
+    float alpha;
+    const float *a;
+    int rs_a, cs_a;
+    const float *b;
+    const uint8_t *b_u8;
+    float b_scale;
+    int rs_b, cs_b;
+    float beta;
+    float *c;
+    int rs_c, cs_c;
+    const float *bias;
+    int relu;
+    int tiles_n;
+} GemmArgs;
+
+static void gemm_tiles(void *arg, int begin, int end){
+    GemmArgs *g = arg;
+    for (int t = begin; t < end; t++) {
+        int i = t / g->tiles_n * TILE_M;
+        int j = t % g->tiles_n * TILE_N;
+        gemm_serial(MIN(TILE_M, g->m - i), MIN(TILE_N, g->n - j), g->k, g->alpha,
+                    g->a + i * g->rs_a, g->rs_a, g->cs_a,
+                    g->b_u8 == NULL ? g->b + j * g->cs_b : NULL,
+                    g->b_u8 != NULL ? g->b_u8 + j * g->cs_b : NULL, g->b_scale, g->rs_b, g->cs_b,
+                    g->beta, g->c + i * g->rs_c + j * g->cs_c, g->rs_c, g->cs_c,
+                    g->bias != NULL ? g->bias + i : NULL, g->relu);
+    }
+}
+
+static void gemm(int m, int n, int k, float alpha,
+                 const float *a, int rs_a, int cs_a,
+                 const float *b, const uint8_t *b_u8, float b_scale, int rs_b, int cs_b,
+                 float beta, float *c, int rs_c, int cs_c,
+                 const float *bias, int relu){
+    if (m <= 0 || n <= 0) {
+        return;
+    }
+    if ((double)m * n * k < PARALLEL_FLOPS) {
+        gemm_serial(m, n, k, alpha, a, rs_a, cs_a, b, b_u8, b_scale, rs_b, cs_b, beta, c, rs_c, cs_c, bias, relu);
+        return;
+    }
+    // The tiles of C are independent, each one packs its own panels.
+    GemmArgs g = {m, n, k, alpha, a, rs_a, cs_a, b, b_u8, b_scale, rs_b, cs_b, beta, c, rs_c, cs_c, bias, relu,
+                  (n + TILE_N - 1) / TILE_N};
+    int tiles = (m + TILE_M - 1) / TILE_M * g.tiles_n;
+    nda_parallel_for(tiles, 1, gemm_tiles, &g);
+}
+
+void sgemm(int m, int n, int k, float alpha,
+           const float *a, int rs_a, int cs_a,
+           const float *b, int rs_b, int cs_b,
+           float beta, float *c, int rs_c, int cs_c){
+    gemm(m, n, k, alpha, a, rs_a, cs_a, b, NULL, 0, rs_b, cs_b, beta, c, rs_c, cs_c, NULL, 0);
+}
+
+void sgemm_bias(int m, int n, int k,
+                const float *a, int rs_a, int cs_a,
+                const float *b, int rs_b, int cs_b,
+                const float *bias, int relu, float *c, int rs_c, int cs_c){
+    gemm(m, n, k, 1, a, rs_a, cs_a, b, NULL, 0, rs_b, cs_b, 0, c, rs_c, cs_c, bias, relu);
+}
+
+void sgemm_u8_bias(int m, int n, int k,
+                   const float *a, int rs_a, int cs_a,
+                   const uint8_t *b, int rs_b, int cs_b, float scale,
+                   const float *bias, int relu, float *c, int rs_c, int cs_c){
+    gemm(m, n, k, 1, a, rs_a, cs_a, NULL, b, scale, rs_b, cs_b, 0, c, rs_c, cs_c, bias, relu);
+}
+
+void sgemv_bias(int m, int k, const float *a, int lda, const float *x,
+                const float *bias, int relu, float *y){
+    pthread_once(&gemm_once, gemm_init);
+    gemv_kernel(m, k, a, lda, x, bias, relu, y);
+}
@@ -1,11 +1,14 @@
 #include "layer.h"
+#include "gemm.h"
+#include "threadpool.h"
+#include "simd.h"
 
 #include <string.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <math.h>
 
 typedef void (*ActivationFunc)(ndarray *a, ndarray *out);
-typedef void (*ActivationDFunc)(ndarray *a, ndarray *out);
 
 ActivationFunc activation_functions[] = {
     [NONE] = nda_identity,
@@ -14,59 +17,116 @@ ActivationFunc activation_functions[] = {
     // Add more activation functions here...
 };
 
-ActivationDFunc activation_function_derivatives[] = {
-    [NONE] = nda_identity_prime,
-    [RELU] = nda_relu_prime,
-    [SOFTMAX] = nda_identity_prime, // softmax must be used with cross entropy loss
-    // Add more activation function derivatives here...
-};
+void init_dense_layer(DenseLayer *self, int in_features, int out_features){
+    if (self->weights != NULL) nda_free(self->weights);
+    if (self->bias != NULL) nda_free(self->bias);
+    self->weights = nda_zero(2, (int[]){out_features, in_features});
+    self->bias = nda_zero(2, (int[]){out_features, 1});
+    initialize_weights(self->weights);
+    nda_init_rand(self->bias);
+    nda_div_scalar(self->weights, 100, self->weights);
+    nda_ensure_shape(&self->weights_grad, 2, self->weights->shape);
+    nda_ensure_shape(&self->bias_grad, 2, self->bias->shape);
+}
 
 static void dense_forward(DenseLayer *self, ndarray *input, ndarray *output){
-    // Initialize weights and bias.
+    // input : (in_features, batch), output : (out_features, batch)
     if (self->weights == NULL) {
         printf("Initializing weights and bias for dense layer\n");
-        self->weights = nda_zero(2, (int[]){output->shape[0], input->shape[0]});
-        self->bias = nda_zero(2, (int[]){output->shape[0], 1});
-        initialize_weights(self->weights);
-        nda_init_rand(self->bias);
-        nda_div_scalar(self->weights, 100, self->weights);
-
+        init_dense_layer(self, input->shape[0], output->shape[0]);
         printf("Weights shape : "); nda_print_shape(self->weights);
         printf("Bias shape : "); nda_print_shape(self->bias); printf("\n");
-
-        self->weights_grad = nda_zero(2, (int[]){output->shape[0], input->shape[0]});
-        self->bias_grad = nda_zero(2, (int[]){output->shape[0], 1});
-        self->linear_output = nda_zero(2, (int[]){output->shape[0], 1});
     }
+    nda_ensure_shape(&self->weights_grad, 2, self->weights->shape);
+    nda_ensure_shape(&self->bias_grad, 2, self->bias->shape);
+    nda_ensure_shape(&self->linear_output, 2, output->shape);
     self->input = input;
-    nda_dot(self->weights, input, self->linear_output);
-    nda_add(self->linear_output, self->bias, self->linear_output);
-    activation_functions[self->activation](self->linear_output, output);
+    self->output = output;
+    // The bias and the ReLU are applied as the product is written, the
+    // softmax needs whole columns and runs afterwards.
+    nda_dot_bias(self->weights, input, self->bias, self->activation == RELU, output);
+    if (self->activation == SOFTMAX) {
+        nda_softmax(output, output);
+    }
 }
 
 static void dense_backward(DenseLayer *self, ndarray *input_grad, ndarray *output_grad){
-    activation_function_derivatives[self->activation](self->linear_output, self->linear_output);
-    nda_mul(input_grad, self->linear_output, self->bias_grad);
-    
-    nda_T(self->input);  // Transpose in-place
-    nda_dot(input_grad, self->input, self->weights_grad);
-    nda_T(self->input);  // Transpose back
+    // The gradients are averaged over the batch. The error of each sample
+    // (delta) is the gradient masked by the ReLU output; the identity and the
+    // softmax (with cross entropy) pass the gradient through as is.
+    float scale = 1.0f / input_grad->shape[1];
+    ndarray *delta = input_grad;
+    if (self->activation == RELU) {
+        delta = self->linear_output;
+        nda_relu_grad(input_grad, self->output, delta);
+    }
+    nda_sum_cols(delta, scale, self->bias_grad);
+
+    nda_gemm(NO_TRANS, TRANS, scale, delta, self->input, 0, self->weights_grad);
 
     if (output_grad != NULL) {
-        nda_T(self->weights);  // Transpose in-place
-        nda_dot(self->weights, input_grad, output_grad);
-        nda_T(self->weights);  // Transpose back
+        nda_gemm(TRANS, NO_TRANS, 1, self->weights, delta, 0, output_grad);
+    }
+}
+
+void infer_dense_layer(DenseLayer *self, ndarray *input, ndarray *output){
+    nda_dot_bias(self->weights, input, self->bias, self->activation == RELU, output);
+    if (self->activation == SOFTMAX) {
+        nda_softmax(output, output);
+    }
+}
+
+void infer_dense_layer_u8(DenseLayer *self, const uint8_t *input, int stride, float scale, ndarray *output){
+    ndarray *w = self->weights, *b = self->bias;
+    if (output->ndim != 2 || output->shape[0] != w->shape[0] || b->size != w->shape[0] || !nda_is_contiguous(b)) {
+        fprintf(stderr, "ndarray shape mismatch for dense layer on bytes\n");
+        exit(1);
+    }
+    sgemm_u8_bias(w->shape[0], output->shape[1], w->shape[1],
+                  w->data, w->strides[0], w->strides[1],
+                  input, 1, stride, scale,
+                  b->data, self->activation == RELU, output->data, output->strides[0], output->strides[1]);
+    if (self->activation == SOFTMAX) {
+        nda_softmax(output, output);
+    }
+}
+
+// Softmax of a vector, without the checks of nda_softmax.
+static void softmax_sample(float *x, int n){
+    float max = x[0];
+    for (int i = 1; i < n; i++) {
+        max = x[i] > max ? x[i] : max;
+    }
+    float sum = 0;
+    for (int i = 0; i < n; i++) {
+        x[i] = expf(x[i] - max);
+        sum += x[i];
+    }
+    float scale = 1 / sum;
+    for (int i = 0; i < n; i++) {
+        x[i] *= scale;
+    }
+}
+
+void infer_dense_sample(DenseLayer *self, const float *input, float *output){
+    int n = self->weights->shape[0];
+    sgemv_bias(n, self->weights->shape[1], self->weights->data, self->weights->strides[0],
+               input, self->bias->data, self->activation == RELU, output);
+    if (self->activation == SOFTMAX) {
+        softmax_sample(output, n);
     }
 }
 
 DenseLayer *create_dense_layer(ActivationType activation){
-    DenseLayer *layer = malloc(sizeof(DenseLayer));
+    DenseLayer *layer = nda_alloc(sizeof(DenseLayer));
     layer->activation = activation;
     layer->input = NULL;
     layer->weights = NULL;
     layer->bias = NULL;
     layer->weights_grad = NULL;
     layer->bias_grad = NULL;
+    layer->linear_output = NULL;
+    layer->output = NULL;
     layer->forward = dense_forward;
     layer->backward = dense_backward;
     return layer;
@@ -78,90 +138,251 @@ void free_dense_layer(DenseLayer *layer){
     if (layer->weights_grad != NULL) nda_free(layer->weights_grad);
     if (layer->bias_grad != NULL) nda_free(layer->bias_grad);
     if (layer->linear_output != NULL) nda_free(layer->linear_output);
-    free(layer);
+    nda_dealloc(layer);
+}
+
+// Output tile size of the Winograd convolution, F(4x4, 3x3).
+#define WINOGRAD_TILE 4
+
+// Recompute the filter transforms of the layer algorithm from its weights.
+static void conv_prepare_filters(ConvLayer *self){
+    if (self->algorithm == CONV_WINOGRAD) {
+        nda_winograd_filter(self->weights, WINOGRAD_TILE, self->filter_transform);
+        nda_winograd_filter_grad(self->weights, WINOGRAD_TILE, self->filter_transform_grad);
+    } else if (self->algorithm == CONV_FFT) {
+        nda_fft_filter(self->weights, self->filter_transform);
+    }
+    self->transform_stale = 0;
+}
+
+// Sample b of a (batch, depth, height, width) ndarray, or a itself if it holds a single (depth, height, width) sample.
+static ndarray sample_of(ndarray *a, int b){
+    if (a->ndim == 3) {
+        return *a;
+    }
+    ndarray s = *a;
+    s.ndim = 3;
+    s.size = a->size / a->shape[0];
+    for (int i = 0; i < 3; i++) {
+        s.shape[i] = a->shape[i + 1];
+        s.strides[i] = a->strides[i + 1];
+    }
+    s.data = a->data + b * a->strides[0];
+    s.is_view = 1;
+    return s;
+}
+
+static int batch_of(ndarray *a){
+    return a->ndim == 4 ? a->shape[0] : 1;
+}
+
+// The samples of a batch go through the convolution in parallel, each
+// thread taking its scratch from its own workspace.
+typedef struct
+{
+    ConvLayer *layer;
+    ndarray *input;
+    ndarray *output_grad;
+    float *weights_grads; // one weights gradient per sample, summed in order afterwards
+    ndarray *output; // linear output forward, error of the samples (delta) backward
+    ConvAlgorithm algorithm;
+} ConvTask;
+
+static void conv_forward_samples(void *arg, int begin, int end){
+    ConvTask *t = arg;
+    ConvLayer *self = t->layer;
+    for (int b = begin; b < end; b++) {
+        ndarray x = sample_of(t->input, b);
+        ndarray z = sample_of(t->output, b);
+        if (t->algorithm == CONV_WINOGRAD) {
+            nda_conv3d_winograd(&x, self->filter_transform, WINOGRAD_TILE, 0, &z);
+        } else if (t->algorithm == CONV_FFT) {
+            nda_conv3d_fft(&x, self->filter_transform, self->kernel_size, &z);
+        } else {
+            nda_conv3d(&x, self->weights, &z);
+        }
+        nda_add(&z, self->bias, &z);
+    }
+}
+
+void init_conv_layer(ConvLayer *self, int depth, int out_height, int out_width){
+    if (self->weights != NULL) nda_free(self->weights);
+    if (self->bias != NULL) nda_free(self->bias);
+    self->weights = nda_zero(4, (int[]){self->kernel_num, depth, self->kernel_size, self->kernel_size});
+    self->bias = self->channel_bias ? nda_zero(3, (int[]){self->kernel_num, 1, 1})
+                                    : nda_zero(3, (int[]){self->kernel_num, out_height, out_width});
+    initialize_weights(self->weights);
+    nda_init_rand(self->bias);
+    nda_div_scalar(self->weights, 100, self->weights);
+    nda_ensure_shape(&self->weights_grad, 4, self->weights->shape);
+    nda_ensure_shape(&self->bias_grad, 3, self->bias->shape);
+    self->transform_stale = 1;
 }
 
 static void conv_forward(ConvLayer *self, ndarray *input, ndarray *output){
-    // Initialize weights and bias.
+    // input : (in_depth, height, width) or (batch, in_depth, height, width), output likewise.
+    ndarray x = sample_of(input, 0), y = sample_of(output, 0);
     if (self->weights == NULL) {
         printf("Initializing weights and bias for conv layer\n");
-        self->weights = nda_zero(4, (int[]){self->kernel_num, input->shape[0], self->kernel_size, self->kernel_size});
-        self->bias = nda_zero(3, (int[]){self->kernel_num, output->shape[1], output->shape[2]});
-        initialize_weights(self->weights);
-        nda_init_rand(self->bias);
-        nda_div_scalar(self->weights, 100, self->weights);
+        init_conv_layer(self, x.shape[0], y.shape[1], y.shape[2]);
         printf("Weights shape : "); nda_print_shape(self->weights);
         printf("Bias shape : "); nda_print_shape(self->bias); printf("\n");
-
-        self->weights_grad = nda_zero(4, (int[]){self->kernel_num, input->shape[0], self->kernel_size, self->kernel_size});
-        self->bias_grad = nda_zero(3, (int[]){self->kernel_num, output->shape[1], output->shape[2]});
-        self->linear_output = nda_zero(3, (int[]){self->kernel_num, output->shape[1], output->shape[2]});
     }
+    nda_ensure_shape(&self->weights_grad, 4, self->weights->shape);
+    nda_ensure_shape(&self->bias_grad, 3, self->bias->shape);
+    nda_ensure_shape(&self->linear_output, output->ndim, output->shape);
+    prepare_conv_layer(self, x.shape[0], x.shape[1], x.shape[2]);
     self->input = input;
-    nda_conv3d(input, self->weights, self->linear_output);
-    nda_add(self->linear_output, self->bias, self->linear_output);
+    ConvTask task = {self, input, NULL, NULL, self->linear_output, self->algorithm};
+    nda_parallel_for(batch_of(input), 1, conv_forward_samples, &task);
     activation_functions[self->activation](self->linear_output, output);
 }
 
-static void conv_backward(ConvLayer *self, ndarray *input_grad, ndarray *output_grad){
-    // Calculate bias gradient
-    activation_function_derivatives[self->activation](self->linear_output, self->linear_output);
-    nda_mul(input_grad, self->linear_output, self->bias_grad);
-    
-    // Calculate weights gradient
-    ndarray *X_c = nda_zero(2, (int[]){self->input->shape[1], self->input->shape[2]});
-    ndarray *W_n = nda_zero(2, (int[]){self->bias_grad->shape[1], self->bias_grad->shape[2]});
-    ndarray *K_nc = nda_zero(2, (int[]){self->weights->shape[2], self->weights->shape[3]});
-
-    for (int n = 0; n < self->kernel_num; n++) {
-        memcpy(W_n->data, self->bias_grad->data + n * W_n->size, W_n->size * sizeof(float));
-        for (int c = 0; c < self->input->shape[0]; c++) {
-            memcpy(X_c->data, self->input->data + c * X_c->size, X_c->size * sizeof(float));
-            nda_conv2d(X_c, W_n, K_nc);
-            memcpy(self->weights_grad->data + n * W_n->size + c * K_nc->size, K_nc->data, K_nc->size * sizeof(float));
+// The algorithm and filter transforms were set up for inputs of this size.
+static int conv_prepared_for(ConvLayer *self, int depth, int height, int width){
+    return self->algorithm_selected && self->prepared_shape[0] == depth
+        && self->prepared_shape[1] == height && self->prepared_shape[2] == width;
+}
+
+void prepare_conv_layer(ConvLayer *self, int depth, int height, int width){
+    if (self->algorithm_selected && !conv_prepared_for(self, depth, height, width)) {
+        // The FFT grid and the algorithm depend on the input size.
+        reset_conv_algorithm(self);
+    }
+    if (!self->algorithm_selected) {
+        self->algorithm = nda_conv_select(depth, height, width, self->kernel_num, self->kernel_size);
+        if (self->algorithm == CONV_WINOGRAD) {
+            int alpha = WINOGRAD_TILE + 2;
+            self->filter_transform = nda_zero(3, (int[]){alpha * alpha, self->kernel_num, depth});
+            self->filter_transform_grad = nda_zero(3, (int[]){alpha * alpha, depth, self->kernel_num});
+        } else if (self->algorithm == CONV_FFT) {
+            self->filter_transform = nda_zero(4, (int[]){self->kernel_num, depth,
+                                                        nda_fft_length(height), 2 * nda_fft_length(width)});
         }
+        self->algorithm_selected = 1;
+        self->prepared_shape[0] = depth;
+        self->prepared_shape[1] = height;
+        self->prepared_shape[2] = width;
+        self->transform_stale = 1;
     }
-    // If output_grad is not NULL, continue backpropagation
-    if (output_grad != NULL) {
-        ndarray *W_n_pad = nda_zero(2, (int[]){self->bias_grad->shape[1] + 2 * self->kernel_size - 2, 
-                                           self->bias_grad->shape[2] + 2 * self->kernel_size - 2});
-        ndarray *Output_c = nda_zero(2, (int[]){output_grad->shape[1], output_grad->shape[2]});
-
-        for (int n = 0; n < self->kernel_num; n++) {
-            memcpy(W_n->data, self->bias_grad->data + n * W_n->size, W_n->size * sizeof(float));
-            nda_pad(W_n, self->kernel_size - 1, W_n_pad);
-            for (int c = 0; c < self->input->shape[0]; c++) {
-                memcpy(K_nc->data, self->weights->data + n * W_n->size + c * K_nc->size, K_nc->size * sizeof(float));
-                nda_flip(K_nc);
-                nda_conv2d(W_n_pad, K_nc, Output_c);
-                for (int i = 0; i < output_grad->shape[1]; i++) {
-                    for (int j = 0; j < output_grad->shape[2]; j++) {
-                        output_grad->data[c * output_grad->strides[0] + i * output_grad->strides[1] + j] += 
-                            Output_c->data[i * Output_c->strides[0] + j];
-                    }
-                }
-                nda_flip(K_nc);
+    if (self->transform_stale) {
+        conv_prepare_filters(self);
+    }
+}
+
+void reset_conv_algorithm(ConvLayer *self){
+    if (self->filter_transform != NULL) nda_free(self->filter_transform);
+    if (self->filter_transform_grad != NULL) nda_free(self->filter_transform_grad);
+    self->filter_transform = NULL;
+    self->filter_transform_grad = NULL;
+    self->algorithm = CONV_IM2COL;
+    self->algorithm_selected = 0;
+    self->transform_stale = 1;
+}
+
+void infer_conv_layer(ConvLayer *self, ndarray *input, ndarray *output){
+    // The filter transforms are layer state, which inference does not write:
+    // until prepare_conv_layer computed them for inputs of this size,
+    // convolve the weights directly.
+    ndarray x = sample_of(input, 0);
+    ConvAlgorithm algorithm = conv_prepared_for(self, x.shape[0], x.shape[1], x.shape[2]) && !self->transform_stale
+        ? self->algorithm : CONV_IM2COL;
+    ConvTask task = {self, input, NULL, NULL, output, algorithm};
+    nda_parallel_for(batch_of(input), 1, conv_forward_samples, &task);
+    activation_functions[self->activation](output, output);
+}
+
+static void conv_backward_samples(void *arg, int begin, int end){
+    ConvTask *t = arg;
+    ConvLayer *self = t->layer;
+    int kk = self->kernel_size * self->kernel_size;
+    for (int b = begin; b < end; b++) {
+        ndarray x = sample_of(self->input, b), dz = sample_of(t->output, b);
+        Arena *ws = nda_workspace();
+        ArenaMark mark = arena_mark(ws);
+        // Weights gradient of the sample from the lowering of its input.
+        ndarray *col = nda_arena_zero(ws, 2, (int[]){x.shape[0] * kk, dz.shape[1] * dz.shape[2]});
+        ndarray dw = *self->weights_grad;
+        dw.data = t->weights_grads + (size_t)b * dw.size;
+        nda_im2col(&x, self->kernel_size, self->kernel_size, col);
+        nda_conv3d_grad_weights(1, &dz, col, 0, &dw);
+
+        // If output_grad is not NULL, continue backpropagation
+        if (t->output_grad != NULL) {
+            ndarray dx = sample_of(t->output_grad, b);
+            if (self->algorithm == CONV_WINOGRAD) {
+                nda_conv3d_winograd(&dz, self->filter_transform_grad, WINOGRAD_TILE, self->kernel_size - 1, &dx);
+            } else {
+                ndarray *col_grad = nda_arena_zero(ws, 2, (int[]){col->shape[0], col->shape[1]});
+                nda_conv3d_grad_input(&dz, self->weights, col_grad, &dx);
+            }
+        }
+        arena_release(ws, mark);
+    }
+}
+
+static void conv_backward(ConvLayer *self, ndarray *input_grad, ndarray *output_grad){
+    // The gradients are averaged over the batch. The error of each sample
+    // (delta) is the gradient masked by the ReLU, written over the linear
+    // output; without activation it is the gradient itself.
+    int batch = batch_of(self->input);
+    float scale = 1.0f / batch;
+    ndarray *delta = input_grad;
+    if (self->activation == RELU) {
+        delta = self->linear_output;
+        nda_relu_grad(input_grad, self->linear_output, delta);
+    }
+
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    int size = self->weights_grad->size;
+    ConvTask task = {self, self->input, output_grad, arena_alloc(ws, (size_t)batch * size * sizeof(float)),
+                     delta, self->algorithm};
+    nda_parallel_for(batch, 1, conv_backward_samples, &task);
+
+    // Reduce the per-sample gradients in sample order, so that the result
+    // does not depend on the number of threads.
+    for (int b = 0; b < batch; b++) {
+        ndarray dz = sample_of(delta, b);
+        const float *dw = task.weights_grads + (size_t)b * size;
+        for (int i = 0; i < size; i++) {
+            self->weights_grad->data[i] = (b == 0 ? 0 : self->weights_grad->data[i]) + scale * dw[i];
+        }
+        if (self->channel_bias) {
+            // Per-channel bias: the gradient sums the plane of its filter.
+            int plane = dz.shape[1] * dz.shape[2];
+            for (int c = 0; c < self->kernel_num; c++) {
+                float sum = simd_kernels()->sum(plane, dz.data + c * plane);
+                self->bias_grad->data[c] = (b == 0 ? 0 : self->bias_grad->data[c]) + scale * sum;
+            }
+        } else {
+            for (int i = 0; i < dz.size; i++) {
+                self->bias_grad->data[i] = (b == 0 ? 0 : self->bias_grad->data[i]) + scale * dz.data[i];
             }
         }
-        nda_free(W_n_pad);
-        nda_free(Output_c);
     }
-    nda_free(X_c);
-    nda_free(W_n);
-    nda_free(K_nc);
+    arena_release(ws, mark);
+    // The weights are updated from this gradient before the next forward pass.
+    self->transform_stale = 1;
 }
 
 ConvLayer *create_conv_layer(int kernel_num, int kernel_size, ActivationType activation){
-    ConvLayer *layer = malloc(sizeof(ConvLayer));
+    ConvLayer *layer = nda_alloc(sizeof(ConvLayer));
     layer->activation = activation;
     layer->kernel_num = kernel_num;
     layer->kernel_size = kernel_size;
+    layer->channel_bias = 1;
     layer->input = NULL;
     layer->weights = NULL;
     layer->bias = NULL;
     layer->weights_grad = NULL;
     layer->bias_grad = NULL;
     layer->linear_output = NULL;
+    layer->algorithm_selected = 0;
+    layer->algorithm = CONV_IM2COL;
+    layer->filter_transform = NULL;
+    layer->filter_transform_grad = NULL;
+    layer->transform_stale = 1;
     layer->forward = conv_forward;
     layer->backward = conv_backward;
     return layer;
@@ -173,21 +394,39 @@ void free_conv_layer(ConvLayer *layer){
     if (layer->weights_grad != NULL) nda_free(layer->weights_grad);
     if (layer->bias_grad != NULL) nda_free(layer->bias_grad);
     if (layer->linear_output != NULL) nda_free(layer->linear_output);
-    free(layer);
+    if (layer->filter_transform != NULL) nda_free(layer->filter_transform);
+    if (layer->filter_transform_grad != NULL) nda_free(layer->filter_transform_grad);
+    nda_dealloc(layer);
+}
+
+// The flat side of the layer is a (features, batch) matrix, the other side
+// holds the samples one after the other. A batch of one sample is the same
+// buffer either way, and a (features, batch) view of the sample-major side
+// is its transpose: in both cases there is nothing to copy.
+static ndarray *flat_view(ndarray *samples, ndarray *flat){
+    ndarray *view = nda_reshape(samples, 2, (int[]){flat->shape[1], flat->shape[0]});
+    nda_T(view);
+    return view;
 }
 
 static void flatten_forward(ndarray *input, ndarray *output){
-    memcpy(output->data, input->data, input->size * sizeof(float));
+    if (input->data != output->data) {
+        ndarray *view = flat_view(input, output);
+        nda_copy(view, output);
+        nda_free(view);
+    }
 }
 
 static void flatten_backward(ndarray *input_grad, ndarray *output_grad){
-    if (output_grad != NULL){
-        memcpy(input_grad->data, output_grad->data, output_grad->size * sizeof(float));
+    if (output_grad != NULL && input_grad->data != output_grad->data){
+        ndarray *view = flat_view(output_grad, input_grad);
+        nda_copy(input_grad, view);
+        nda_free(view);
     }
 }
 
 FlattenLayer *create_flatten_layer(){
-    FlattenLayer *layer = malloc(sizeof(FlattenLayer));
+    FlattenLayer *layer = nda_alloc(sizeof(FlattenLayer));
 
     layer->forward = flatten_forward;
     layer->backward = flatten_backward;
@@ -195,7 +434,7 @@ FlattenLayer *create_flatten_layer(){
 }
 
 void free_flatten_layer(FlattenLayer *layer){
-    free(layer);
+    nda_dealloc(layer);
 }
 
 void save_dense_layer(DenseLayer *layer, FILE *file){
@@ -251,9 +490,10 @@ void load_dense_layer(DenseLayer *layer, FILE *file) {
     fscanf(file, "%d %d", &bias_rows, &bias_cols);
     fscanf(file, "%d %d", &linear_output_rows, &linear_output_cols);
     
-    layer->weights = nda_zero(2, (int[]){weights_rows, weights_cols});
-    layer->bias = nda_zero(2, (int[]){bias_rows, bias_cols});
-    layer->linear_output = nda_zero(2, (int[]){linear_output_rows, linear_output_cols});
+    // Arrays of the right shape are read into in place.
+    nda_ensure_shape(&layer->weights, 2, (int[]){weights_rows, weights_cols});
+    nda_ensure_shape(&layer->bias, 2, (int[]){bias_rows, bias_cols});
+    nda_ensure_shape(&layer->linear_output, 2, (int[]){linear_output_rows, linear_output_cols});
 
     // Read weights
     for (int i = 0; i < layer->weights->size; i++) {
@@ -273,10 +513,16 @@ void load_conv_layer(ConvLayer *layer, FILE *file) {
     int bias_channels, bias_rows, bias_cols;
     fscanf(file, "%d %d %d %d", &kernel_num, &channels, &kernel_size1, &kernel_size2);
     fscanf(file, "%d %d %d", &bias_channels, &bias_rows, &bias_cols);
+    if (layer->kernel_num != kernel_num || layer->kernel_size != kernel_size1) {
+        reset_conv_algorithm(layer);
+    }
     layer->kernel_num = kernel_num;
     layer->kernel_size = kernel_size1;
-    layer->weights = nda_zero(4, (int[]){kernel_num, channels, kernel_size1, kernel_size2});
-    layer->bias = nda_zero(3, (int[]){bias_channels, bias_rows, bias_cols});
+    // Arrays of the right shape are read into in place.
+    nda_ensure_shape(&layer->weights, 4, (int[]){kernel_num, channels, kernel_size1, kernel_size2});
+    nda_ensure_shape(&layer->bias, 3, (int[]){bias_channels, bias_rows, bias_cols});
+    layer->channel_bias = bias_rows == 1 && bias_cols == 1;
+    layer->transform_stale = 1;
 
     char separator[5];
 
@@ -295,15 +541,39 @@ void load_conv_layer(ConvLayer *layer, FILE *file) {
 }
 
 void copy_dense_layer(DenseLayer *dst, DenseLayer *src){
-    dst->weights = nda_deepcopy(src->weights);
-    dst->bias = nda_deepcopy(src->bias);
-    dst->linear_output = nda_zero(2, (int[]){src->linear_output->shape[0], src->linear_output->shape[1]});
+    nda_ensure_shape(&dst->weights, 2, src->weights->shape);
+    nda_ensure_shape(&dst->bias, 2, src->bias->shape);
+    nda_copy(src->weights, dst->weights);
+    nda_copy(src->bias, dst->bias);
 }
 
 void copy_conv_layer(ConvLayer *dst, ConvLayer *src){
     dst->kernel_num = src->kernel_num;
     dst->kernel_size = src->kernel_size;
-    dst->weights = nda_deepcopy(src->weights);
-    dst->bias = nda_deepcopy(src->bias);
-    dst->linear_output = nda_zero(3, (int[]){src->linear_output->shape[0], src->linear_output->shape[1], src->linear_output->shape[2]});
-}
\ No newline at end of file
+    dst->channel_bias = src->channel_bias;
+    nda_ensure_shape(&dst->weights, 4, src->weights->shape);
+    nda_ensure_shape(&dst->bias, 3, src->bias->shape);
+    nda_copy(src->weights, dst->weights);
+    nda_copy(src->bias, dst->bias);
+    dst->transform_stale = 1;
+}
+
+// Views of the weights of src; dst keeps its own activations, gradients and,
+// for the convolution, its filter transforms.
+void share_dense_layer(DenseLayer *dst, DenseLayer *src){
+    if (dst->weights != NULL) nda_free(dst->weights);
+    if (dst->bias != NULL) nda_free(dst->bias);
+    dst->weights = nda_reshape(src->weights, src->weights->ndim, src->weights->shape);
+    dst->bias = nda_reshape(src->bias, src->bias->ndim, src->bias->shape);
+}
+
+void share_conv_layer(ConvLayer *dst, ConvLayer *src){
+    if (dst->weights != NULL) nda_free(dst->weights);
+    if (dst->bias != NULL) nda_free(dst->bias);
+    dst->kernel_num = src->kernel_num;
+    dst->kernel_size = src->kernel_size;
+    dst->channel_bias = src->channel_bias;
+    dst->weights = nda_reshape(src->weights, src->weights->ndim, src->weights->shape);
+    dst->bias = nda_reshape(src->bias, src->bias->ndim, src->bias->shape);
+    dst->transform_stale = 1;
+}
@@ -1,6 +1,13 @@
 #include "misc.h"
+#include "threadpool.h"
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 void data_shuffle(ndarray *data[], int label[], int size){
     if (size > 1) {
@@ -18,6 +25,51 @@ void data_shuffle(ndarray *data[], int label[], int size){
     }
 }
 
+void data_batch(ndarray *data[], int label[], int start, ndarray *inputs, ndarray *targets){
+    int axis = inputs->ndim == 2 ? 1 : 0;
+    for (int i = 0; i < inputs->shape[axis]; i++) {
+        ndarray *dst = nda_slice(inputs, axis, i, i + 1);
+        ndarray *src = nda_reshape(data[start + i], dst->ndim, dst->shape);
+        nda_copy(src, dst);
+        nda_free(src);
+        nda_free(dst);
+        if (targets != NULL) {
+            for (int j = 0; j < targets->shape[0]; j++) {
+                targets->data[j * targets->strides[0] + i * targets->strides[1]] = j == label[start + i];
+            }
+        }
+    }
+}
+
+float evaluate_predictions(int predictions[], const int label[], int num, ndarray *confusion){
+    int correct = 0;
+    if (confusion != NULL) {
+        nda_mul_scalar(confusion, 0, confusion);
+    }
+    for (int i = 0; i < num; i++) {
+        correct += predictions[i] == label[i];
+        if (confusion != NULL) {
+            confusion->data[label[i] * confusion->strides[0] + predictions[i] * confusion->strides[1]] += 1;
+        }
+    }
+    return (float)correct / num;
+}
+
+void print_confusion(ndarray *confusion){
+    printf("label \\ predicted");
+    for (int j = 0; j < confusion->shape[1]; j++) {
+        printf("%6d", j);
+    }
+    printf("\n");
+    for (int i = 0; i < confusion->shape[0]; i++) {
+        printf("%17d", i);
+        for (int j = 0; j < confusion->shape[1]; j++) {
+            printf("%6d", (int)confusion->data[i * confusion->strides[0] + j * confusion->strides[1]]);
+        }
+        printf("\n");
+    }
+}
+
 void read_data(const char* filename, ndarray** images, int* labels, int num, int image_size, int ndim, int* shape) {
     FILE* file = fopen(filename, "r");
     if (file == NULL) {
@@ -52,6 +104,151 @@ void read_data(const char* filename, ndarray** images, int* labels, int num, int
     fclose(file);
 }
 
+// Image files per chunk of the parallel loop.
+#define READ_GRAIN 8
+
+// The values of image i go to floats or bytes, at i * values.
+typedef struct
+{
+    char (*paths)[255];
+    int values;
+    float *floats;
+    uint8_t *bytes;
+} ReadArgs;
+
+// Parse the next integer of [*p, end) into *value, skipping whitespace;
+// returns 0 at the end of the buffer, on anything else, or once its
+// magnitude goes past max.
+static int scan_int(const char **p, const char *end, int max, int *value){
+    const char *c = *p;
+    while (c < end && (*c == ' ' || *c == '\n' || *c == '\t' || *c == '\r')) {
+        c++;
+    }
+    int negative = c < end && *c == '-';
+    c += negative;
+    if (c == end || *c < '0' || *c > '9') {
+        return 0;
+    }
+    int v = 0;
+    while (c < end && *c >= '0' && *c <= '9') {
+        int digit = *c++ - '0';
+        if (v > (max - digit) / 10) {
+            return 0;
+        }
+        v = v * 10 + digit;
+    }
+    *value = negative ? -v : v;
+    *p = c;
+    return 1;
+}
+
+static void read_files(void *arg, int begin, int end){
+    ReadArgs *r = arg;
+    int values = r->values;
+    Arena *ws = nda_workspace();
+    for (int i = begin; i < end; i++) {
+        int fd = open(r->paths[i], O_RDONLY);
+        struct stat st;
+        if (fd < 0 || fstat(fd, &st) != 0) {
+            printf("Cannot open file %s\n", r->paths[i]);
+            exit(1);
+        }
+        ArenaMark mark = arena_mark(ws);
+        char *buffer = arena_alloc(ws, st.st_size);
+        ssize_t size = 0, n;
+        while (size < st.st_size && (n = read(fd, buffer + size, st.st_size - size)) != 0) {
+            if (n < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                fprintf(stderr, "Error reading %s: %s\n", r->paths[i], strerror(errno));
+                exit(1);
+            }
+            size += n;
+        }
+        close(fd);
+        const char *p = buffer;
+        size_t offset = (size_t)i * values;
+        for (int j = 0; j < values; j++) {
+            int value;
+            if (!scan_int(&p, buffer + size, r->bytes != NULL ? 255 : INT_MAX, &value) || (r->bytes != NULL && value < 0)) {
+                fprintf(stderr, "%s: expected %d integers%s\n", r->paths[i], values, r->bytes != NULL ? " in [0, 255]" : "");
+                exit(1);
+            }
+            if (r->bytes != NULL) {
+                r->bytes[offset + j] = value;
+            } else {
+                r->floats[offset + j] = (float)value;
+            }
+        }
+        arena_release(ws, mark);
+    }
+}
+
+// Paths of the first num images of an index file, and their labels.
+static char (*read_index(const char *filename, int num, int *labels))[255] {
+    FILE* file = fopen(filename, "r");
+    if (file == NULL) {
+        printf("Cannot open file %s\n", filename);
+        exit(1);
+    }
+    char (*paths)[255] = nda_alloc(num * sizeof(*paths));
+    for (int i = 0; i < num; i++) {
+        if (fscanf(file, "%254s %d", paths[i], &labels[i]) != 2) {
+            fprintf(stderr, "%s: expected %d images\n", filename, num);
+            exit(1);
+        }
+    }
+    fclose(file);
+    return paths;
+}
+
+ndarray *read_data_parallel(const char* filename, ndarray** images, int* labels, int num, int image_size, int ndim, int* shape) {
+    int values = image_size * image_size, size = 1;
+    for (int d = 0; d < ndim; d++) {
+        size *= shape[d];
+    }
+    if (size != values) {
+        fprintf(stderr, "images of %d values do not fit the shape of %d values\n", values, size);
+        exit(1);
+    }
+    char (*paths)[255] = read_index(filename, num, labels);
+    ndarray *data = nda_zero(2, (int[]){num, values});
+    ReadArgs r = {paths, values, data->data, NULL};
+    nda_parallel_for(num, READ_GRAIN, read_files, &r);
+    for (int i = 0; i < num; i++) {
+        images[i] = nda_wrap(data->data + (size_t)i * values, ndim, shape);
+    }
+    nda_dealloc(paths);
+    return data;
+}
+
+Dataset *read_dataset(const char* filename, int num, int ndim, int* shape) {
+    Dataset *dataset = nda_alloc(sizeof(Dataset));
+    dataset->map = NULL;
+    dataset->length = 0;
+    dataset->num = num;
+    dataset->ndim = ndim;
+    dataset->sample_size = 1;
+    for (int d = 0; d < ndim; d++) {
+        dataset->shape[d] = shape[d];
+        dataset->sample_size *= shape[d];
+    }
+    dataset->scale = 1;
+    // One block: the labels, then the samples at an aligned offset.
+    size_t labels_size = ((size_t)num * sizeof(int32_t) + NDA_ALIGN - 1) / NDA_ALIGN * NDA_ALIGN;
+    dataset->block = nda_alloc(labels_size + (size_t)num * dataset->sample_size);
+    int32_t *labels = dataset->block;
+    uint8_t *samples = (uint8_t *)dataset->block + labels_size;
+    char (*paths)[255] = read_index(filename, num, labels);
+    ReadArgs r = {paths, dataset->sample_size, NULL, samples};
+    nda_parallel_for(num, READ_GRAIN, read_files, &r);
+    nda_dealloc(paths);
+    dataset->labels = labels;
+    dataset->samples = samples;
+    return dataset;
+}
+
 void read_image(const char* filename, ndarray* image, int image_size){
     FILE* image_file_handle = fopen(filename, "r");
     if (image_file_handle == NULL) {
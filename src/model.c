@@ -0,0 +1,197 @@
+#include "model.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define ALIGN_UP(n) (((n) + NDA_ALIGN - 1) / NDA_ALIGN * NDA_ALIGN)
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(){
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++) {
+            c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+// CRC-32 (IEEE 802.3, as zlib), continued from crc.
+static uint32_t crc32_update(uint32_t crc, const void *data, size_t size){
+    pthread_once(&crc_once, init_crc_table);
+    const unsigned char *p = data;
+    crc = ~crc;
+    for (size_t i = 0; i < size; i++) {
+        crc = crc_table[(crc ^ p[i]) & 0xff] ^ (crc >> 8);
+    }
+    return ~crc;
+}
+
+void save_model(const char *filename, ndarray *params, ndarray *tensors[], const ModelLayer layers[], int count){
+    ModelTensor table[count];
+    memset(table, 0, sizeof(table));
+    for (int i = 0; i < count; i++) {
+        table[i].layer = layers[i];
+        table[i].ndim = tensors[i]->ndim;
+        for (int d = 0; d < tensors[i]->ndim; d++) {
+            table[i].shape[d] = tensors[i]->shape[d];
+        }
+        table[i].offset = (tensors[i]->data - params->data) * sizeof(float);
+    }
+    ModelHeader header = {
+        .magic = MODEL_MAGIC,
+        .version = MODEL_VERSION,
+        .dtype = MODEL_FLOAT32,
+        .num_tensors = count,
+        .payload_offset = ALIGN_UP(sizeof(ModelHeader) + sizeof(table)),
+        .payload_size = params->size * sizeof(float),
+    };
+    header.checksum = crc32_update(crc32_update(0, table, sizeof(table)), params->data, header.payload_size);
+
+    FILE *file = fopen(filename, "wb");
+    if (file == NULL) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        exit(1);
+    }
+    static const char padding[NDA_ALIGN];
+    size_t padding_size = header.payload_offset - sizeof(ModelHeader) - sizeof(table);
+    if (fwrite(&header, sizeof(header), 1, file) != 1
+        || fwrite(table, sizeof(table), 1, file) != 1
+        || fwrite(padding, 1, padding_size, file) != padding_size
+        || fwrite(params->data, 1, header.payload_size, file) != header.payload_size
+        || fclose(file) != 0) {
+        fprintf(stderr, "Error writing model %s\n", filename);
+        exit(1);
+    }
+}
+
+int is_model_file(const char *filename){
+    char magic[sizeof(((ModelHeader *)0)->magic)];
+    FILE *file = fopen(filename, "rb");
+    if (file == NULL) {
+        return 0;
+    }
+    int is_model = fread(magic, sizeof(magic), 1, file) == 1 && memcmp(magic, MODEL_MAGIC, sizeof(magic)) == 0;
+    fclose(file);
+    return is_model;
+}
+
+static void model_error(const char *filename, const char *reason){
+    fprintf(stderr, "Invalid model file %s: %s\n", filename, reason);
+    exit(1);
+}
+
+ModelFile *open_model(const char *filename){
+    int fd = open(filename, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Error opening file %s\n", filename);
+        exit(1);
+    }
+    size_t length = st.st_size;
+    if (length < sizeof(ModelHeader)) {
+        model_error(filename, "truncated header");
+    }
+    void *map = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        fprintf(stderr, "Error mapping file %s\n", filename);
+        exit(1);
+    }
+
+    const ModelHeader *header = map;
+    if (memcmp(header->magic, MODEL_MAGIC, sizeof(header->magic)) != 0) {
+        model_error(filename, "bad magic");
+    }
+    if (header->version != MODEL_VERSION) {
+        model_error(filename, "unsupported version");
+    }
+    if (header->dtype != MODEL_FLOAT32) {
+        model_error(filename, "unsupported dtype");
+    }
+    size_t table_size = header->num_tensors * sizeof(ModelTensor);
+    if (header->payload_offset % NDA_ALIGN != 0 || header->payload_offset < sizeof(ModelHeader) + table_size
+        || header->payload_offset > length || header->payload_size > length - header->payload_offset) {
+        model_error(filename, "truncated or misplaced payload");
+    }
+    const ModelTensor *tensors = (const ModelTensor *)(header + 1);
+    for (uint32_t i = 0; i < header->num_tensors; i++) {
+        uint64_t size = tensors[i].ndim >= 1 && tensors[i].ndim <= NDA_MAX_DIM ? sizeof(float) : 0;
+        for (uint32_t d = 0; d < tensors[i].ndim && d < NDA_MAX_DIM; d++) {
+            size *= tensors[i].shape[d];
+        }
+        if (size == 0 || tensors[i].offset % NDA_ALIGN != 0 || tensors[i].offset > header->payload_size
+            || size > header->payload_size - tensors[i].offset) {
+            model_error(filename, "bad tensor table");
+        }
+    }
+    char *payload = (char *)map + header->payload_offset;
+    if (crc32_update(crc32_update(0, tensors, table_size), payload, header->payload_size) != header->checksum) {
+        model_error(filename, "checksum mismatch");
+    }
+
+    ModelFile *model = nda_alloc(sizeof(ModelFile));
+    model->map = map;
+    model->length = length;
+    model->header = header;
+    model->tensors = tensors;
+    model->payload = (float *)payload;
+    return model;
+}
+
+void close_model(ModelFile *model){
+    munmap(model->map, model->length);
+    nda_dealloc(model);
+}
+
+int ensure_model_shapes(ModelFile *model, ndarray **tensors[], int count){
+    if ((int)model->header->num_tensors != count) {
+        fprintf(stderr, "model does not match the network: %u tensors, expected %d\n", model->header->num_tensors, count);
+        exit(1);
+    }
+    int resized = 0;
+    for (int i = 0; i < count; i++) {
+        int shape[NDA_MAX_DIM];
+        for (uint32_t d = 0; d < model->tensors[i].ndim; d++) {
+            shape[d] = model->tensors[i].shape[d];
+        }
+        resized |= nda_ensure_shape(tensors[i], model->tensors[i].ndim, shape);
+    }
+    return resized;
+}
+
+void bind_model(ModelFile *model, ndarray **params, ndarray **tensors[], const ModelLayer layers[], int count){
+    if ((int)model->header->num_tensors != count || model->header->payload_size != (*params)->size * sizeof(float)) {
+        fprintf(stderr, "model does not match the network\n");
+        exit(1);
+    }
+    for (int i = 0; i < count; i++) {
+        const ModelTensor *t = &model->tensors[i];
+        ndarray *a = *tensors[i];
+        int match = t->layer == (uint32_t)layers[i] && t->ndim == (uint32_t)a->ndim
+            && t->offset == (a->data - (*params)->data) * sizeof(float);
+        for (int d = 0; match && d < a->ndim; d++) {
+            match = t->shape[d] == (uint32_t)a->shape[d];
+        }
+        if (!match) {
+            fprintf(stderr, "model does not match the network: tensor %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < count; i++) {
+        ndarray *a = *tensors[i];
+        *tensors[i] = nda_wrap(model->payload + model->tensors[i].offset / sizeof(float), a->ndim, a->shape);
+        nda_free(a);
+    }
+    ndarray *flat = nda_wrap(model->payload, 1, (*params)->shape);
+    nda_free(*params);
+    *params = flat;
+}
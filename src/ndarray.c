@@ -1,4 +1,7 @@
 #include "ndarray.h"
+#include "gemm.h"
+#include "threadpool.h"
+#include "simd.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -7,6 +10,8 @@
 #include <stdbool.h>
 
 #define M_PI 3.14159265358979323846
+#define MIN(x, y) (((x) < (y)) ? (x) : (y))
+#define MAX(x, y) (((x) > (y)) ? (x) : (y))
 
 // Check 2 ndarrays are compatible for an operation.
 #define CHECK_COMPATIBLE(a, b) \
@@ -24,37 +29,141 @@
         fprintf(stderr, "not a matrix\n"); exit(1); \
         } } while (0)
 
-#define CHECK_MALLOC(a) \
-    do { if ((a) == NULL) { \
-        fprintf(stderr, "malloc failed\n"); exit(1); \
+// Offset in data of the element with row-major index i of a strided ndarray.
+static int offset_of(ndarray *a, int i){
+    int offset = 0;
+    for (int d = a->ndim - 1; d >= 0; d--) {
+        offset += (i % a->shape[d]) * a->strides[d];
+        i /= a->shape[d];
+    }
+    return offset;
+}
+
+// Element with row-major index i, contiguous tells if a is packed in row-major order.
+#define ELEM(a, contiguous, i) ((a)->data[(contiguous) ? (i) : offset_of((a), (i))])
+
+int nda_is_contiguous(ndarray *a){
+    int stride = 1;
+    for (int d = a->ndim - 1; d >= 0; d--) {
+        if (a->shape[d] != 1 && a->strides[d] != stride) {
+            return 0;
+        }
+        stride *= a->shape[d];
+    }
+    return 1;
+}
+
+// Size of the header in front of the data of an owning ndarray.
+#define HEADER_SIZE ((sizeof(ndarray) + NDA_ALIGN - 1) / NDA_ALIGN * NDA_ALIGN)
+
+#define CHECK_NDIM(ndim) \
+    do { if ((ndim) < 1 || (ndim) > NDA_MAX_DIM) { \
+        fprintf(stderr, "ndarray ndim %d out of range [1, %d]\n", (ndim), NDA_MAX_DIM); exit(1); \
         } } while (0)
 
-// Create a new ndarray with the given shape.
-ndarray *nda_zero(int ndim, int *shape) {
-    ndarray *arr = malloc(sizeof(ndarray));
+// Fill in the shape, strides and size of a new ndarray.
+static void init_shape(ndarray *arr, int ndim, int *shape){
+    CHECK_NDIM(ndim);
     arr->ndim = ndim;
-    arr->shape = malloc(ndim * sizeof(int));
     memcpy(arr->shape, shape, ndim * sizeof(int));
-    arr->strides = malloc(ndim * sizeof(int));
     arr->strides[ndim - 1] = 1;
     arr->size = shape[ndim - 1];
     for (int i = ndim - 1; i > 0; i--) {
         arr->strides[i - 1] = arr->strides[i] * arr->shape[i];
         arr->size *= arr->shape[i - 1];
     }
-    arr->data = calloc(arr->size, sizeof(float));
-    CHECK_MALLOC(arr->data);
+}
+
+// Create a new ndarray with the given shape.
+ndarray *nda_zero(int ndim, int *shape) {
+    ndarray header;
+    init_shape(&header, ndim, shape);
+    ndarray *arr = nda_alloc(HEADER_SIZE + header.size * sizeof(float));
+    *arr = header;
+    arr->data = (float *)((char *)arr + HEADER_SIZE);
+    memset(arr->data, 0, arr->size * sizeof(float));
+    arr->is_view = 0;
+    return arr;
+}
+
+ndarray *nda_arena_zero(Arena *arena, int ndim, int *shape){
+    ndarray header;
+    init_shape(&header, ndim, shape);
+    ndarray *arr = arena_alloc(arena, HEADER_SIZE + header.size * sizeof(float));
+    *arr = header;
+    arr->data = (float *)((char *)arr + HEADER_SIZE);
+    memset(arr->data, 0, arr->size * sizeof(float));
+    arr->is_view = 0;
     return arr;
 }
 
+ndarray *nda_view(ndarray *a, int ndim, int *shape, int *strides, int offset){
+    CHECK_NDIM(ndim);
+    ndarray *view = nda_alloc(sizeof(ndarray));
+    view->ndim = ndim;
+    view->size = 1;
+    for (int i = 0; i < ndim; i++) {
+        view->shape[i] = shape[i];
+        view->strides[i] = strides[i];
+        view->size *= shape[i];
+    }
+    view->data = a->data + offset;
+    view->is_view = 1;
+    return view;
+}
+
+ndarray *nda_wrap(float *data, int ndim, int *shape){
+    CHECK_NDIM(ndim);
+    int strides[NDA_MAX_DIM];
+    strides[ndim - 1] = 1;
+    for (int i = ndim - 1; i > 0; i--) {
+        strides[i - 1] = strides[i] * shape[i];
+    }
+    ndarray owner = {.data = data};
+    return nda_view(&owner, ndim, shape, strides, 0);
+}
+
+int nda_ensure_shape(ndarray **a, int ndim, int *shape){
+    if (*a != NULL && (*a)->ndim == ndim && memcmp((*a)->shape, shape, ndim * sizeof(int)) == 0) {
+        return 0;
+    }
+    if (*a != NULL) {
+        nda_free(*a);
+    }
+    *a = nda_zero(ndim, shape);
+    return 1;
+}
+
+ndarray nda_slice_of(ndarray *a, int axis, int start, int end){
+    if (axis < 0 || axis >= a->ndim || start < 0 || end > a->shape[axis] || start >= end) {
+        fprintf(stderr, "invalid slice [%d, %d) of axis %d\n", start, end, axis);
+        exit(1);
+    }
+    ndarray view = *a;
+    view.shape[axis] = end - start;
+    view.size = a->size / a->shape[axis] * (end - start);
+    view.data = a->data + start * a->strides[axis];
+    view.is_view = 1;
+    return view;
+}
+
+ndarray *nda_slice(ndarray *a, int axis, int start, int end){
+    ndarray view = nda_slice_of(a, axis, start, end);
+    return nda_view(&view, view.ndim, view.shape, view.strides, 0);
+}
+
 void nda_init_data(ndarray *arr, float *data){
-    memcpy(arr->data, data, arr->size * sizeof(float));
+    int c = nda_is_contiguous(arr);
+    for (int i = 0; i < arr->size; i++) {
+        ELEM(arr, c, i) = data[i];
+    }
 }
 
 void nda_init_rand(ndarray *arr){
     // Initialize the random number generator, range [0, 1]
+    int c = nda_is_contiguous(arr);
     for (int i = 0; i < arr->size; i++) {
-        arr->data[i] = (float)rand() / (float)RAND_MAX;
+        ELEM(arr, c, i) = (float)rand() / (float)RAND_MAX;
     }
 }
 
@@ -106,77 +215,232 @@ void initialize_weights(ndarray *arr) {
         fprintf(stderr, "ndarray ndim mismatch, ndim : %d\n", arr->ndim); exit(1);
     }
 
+    int c = nda_is_contiguous(arr);
     for (int i = 0; i < arr->size; i++) {
-        arr->data[i] = scale * randn();
+        ELEM(arr, c, i) = scale * randn();
     }
 }
 
-// Free the memory allocated for the ndarray.
+// Free the memory allocated for the ndarray, a view leaves the data to its parent.
 void nda_free(ndarray *arr) {
-    free(arr->shape);
-    free(arr->strides);
-    free(arr->data);
-    free(arr);
+    nda_dealloc(arr);
 }
 
 // Basic calculations.
-#define DEFINE_OP(OP_NAME, OP) \
+// Operands of an elementwise loop, with their contiguity. Loops over more
+// than PARALLEL_GRAIN elements are split across the threads of the pool.
+typedef struct
+{
+    ndarray *a;
+    ndarray *b;
+    ndarray *out;
+    float s;
+    int ca, cb, co;
+} ElemArgs;
+
+#define PARALLEL_GRAIN (1 << 15)
+
+static ElemArgs elem_args(ndarray *a, ndarray *b, ndarray *out, float s){
+    return (ElemArgs){a, b, out, s,
+                      nda_is_contiguous(a), b == NULL || nda_is_contiguous(b), nda_is_contiguous(out)};
+}
+
+static int same_shape(ndarray *a, ndarray *b){
+    if (a->ndim != b->ndim) {
+        return 0;
+    }
+    for (int i = 0; i < a->ndim; i++) {
+        if (a->shape[i] != b->shape[i]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// Operands of a broadcast binary op with their strides over the axes of out,
+// 0 along the axes they are repeated on. out is walked one row (last axis)
+// at a time.
+typedef struct
+{
+    ndarray *a;
+    ndarray *b;
+    ndarray *out;
+    int sa[NDA_MAX_DIM];
+    int sb[NDA_MAX_DIM];
+} BroadcastArgs;
+
+// Strides of a broadcast to the shape of out, following NumPy: the shapes
+// are aligned on their last axis and each axis of a is 1 or that of out.
+static int broadcast_strides(ndarray *a, ndarray *out, int strides[]){
+    int offset = out->ndim - a->ndim;
+    if (offset < 0) {
+        return 0;
+    }
+    for (int i = 0; i < out->ndim; i++) {
+        int dim = i < offset ? 1 : a->shape[i - offset];
+        if (dim != 1 && dim != out->shape[i]) {
+            return 0;
+        }
+        strides[i] = dim == 1 ? 0 : a->strides[i - offset];
+    }
+    return 1;
+}
+
+static BroadcastArgs broadcast_args(ndarray *a, ndarray *b, ndarray *out){
+    BroadcastArgs e = {a, b, out, {0}, {0}};
+    if (!broadcast_strides(a, out, e.sa) || !broadcast_strides(b, out, e.sb)) {
+        fprintf(stderr, "ndarray shapes cannot be broadcast to the output, ndim : %d, %d -> %d\n",
+                a->ndim, b->ndim, out->ndim);
+        exit(1);
+    }
+    return e;
+}
+
+// Offsets in a, b and out of the first element of row r of out.
+static void row_offsets(BroadcastArgs *e, int r, int *oa, int *ob, int *oo){
+    *oa = *ob = *oo = 0;
+    for (int i = e->out->ndim - 2; i >= 0; i--) {
+        int index = r % e->out->shape[i];
+        r /= e->out->shape[i];
+        *oa += index * e->sa[i];
+        *ob += index * e->sb[i];
+        *oo += index * e->out->strides[i];
+    }
+}
+
+// Contiguous operands go through the vector kernels of simd.h. Operands of
+// different shapes are broadcast: rows of a scalar of b use the scalar
+// kernel, the broadcast operand is never materialized.
+#define DEFINE_OP(OP_NAME, OP, KERNEL) \
+    static void OP_NAME##_range(void *arg, int begin, int end) { \
+        ElemArgs *e = arg; \
+        if (e->ca && e->cb && e->co) { \
+            simd_kernels()->KERNEL(end - begin, e->a->data + begin, e->b->data + begin, e->out->data + begin); \
+        } else { \
+            for (int i = begin; i < end; i++) { \
+                ELEM(e->out, e->co, i) = ELEM(e->a, e->ca, i) OP ELEM(e->b, e->cb, i); \
+            } \
+        } \
+    } \
+    static void OP_NAME##_broadcast_range(void *arg, int begin, int end) { \
+        BroadcastArgs *e = arg; \
+        int d = e->out->ndim - 1, n = e->out->shape[d]; \
+        int sa = e->sa[d], sb = e->sb[d], so = e->out->strides[d]; \
+        for (int r = begin; r < end; r++) { \
+            int oa, ob, oo; \
+            row_offsets(e, r, &oa, &ob, &oo); \
+            const float *x = e->a->data + oa, *y = e->b->data + ob; \
+            float *z = e->out->data + oo; \
+            if (sa == 1 && sb == 1 && so == 1) { \
+                simd_kernels()->KERNEL(n, x, y, z); \
+            } else if (sa == 1 && sb == 0 && so == 1) { \
+                simd_kernels()->KERNEL##_scalar(n, x, *y, z); \
+            } else { \
+                for (int j = 0; j < n; j++) { \
+                    z[j * so] = x[j * sa] OP y[j * sb]; \
+                } \
+            } \
+        } \
+    } \
     void OP_NAME(ndarray *a, ndarray *b, ndarray *out) { \
-        CHECK_COMPATIBLE(a, b); \
-        CHECK_COMPATIBLE(a, out); \
-        for (int i = 0; i < a->size; i++) { \
-            out->data[i] = a->data[i] OP b->data[i]; \
+        if (same_shape(a, b) && same_shape(a, out)) { \
+            ElemArgs e = elem_args(a, b, out, 0); \
+            nda_parallel_for(a->size, PARALLEL_GRAIN, OP_NAME##_range, &e); \
+            return; \
         } \
+        BroadcastArgs e = broadcast_args(a, b, out); \
+        int n = out->shape[out->ndim - 1]; \
+        nda_parallel_for(out->size / n, MAX(1, PARALLEL_GRAIN / n), OP_NAME##_broadcast_range, &e); \
     }
 
-DEFINE_OP(nda_add, +)
-DEFINE_OP(nda_sub, -)
-DEFINE_OP(nda_mul, *)
-DEFINE_OP(nda_div, /)
+DEFINE_OP(nda_add, +, add)
+DEFINE_OP(nda_sub, -, sub)
+DEFINE_OP(nda_mul, *, mul)
+DEFINE_OP(nda_div, /, div)
 
-#define DEFINE_SCA_OP(OP_NAME, OP) \
+#define DEFINE_SCA_OP(OP_NAME, OP, KERNEL) \
+    static void OP_NAME##_range(void *arg, int begin, int end) { \
+        ElemArgs *e = arg; \
+        if (e->ca && e->co) { \
+            simd_kernels()->KERNEL(end - begin, e->a->data + begin, e->s, e->out->data + begin); \
+        } else { \
+            for (int i = begin; i < end; i++) { \
+                ELEM(e->out, e->co, i) = ELEM(e->a, e->ca, i) OP e->s; \
+            } \
+        } \
+    } \
     void OP_NAME(ndarray *a, float b, ndarray *out) { \
         CHECK_COMPATIBLE(a, out); \
-        for (int i = 0; i < a->size; i++) { \
-            out->data[i] = a->data[i] OP b; \
-        } \
+        ElemArgs e = elem_args(a, NULL, out, b); \
+        nda_parallel_for(a->size, PARALLEL_GRAIN, OP_NAME##_range, &e); \
     }
 
-DEFINE_SCA_OP(nda_add_scalar, +)
-DEFINE_SCA_OP(nda_sub_scalar, -)
-DEFINE_SCA_OP(nda_mul_scalar, *)
-DEFINE_SCA_OP(nda_div_scalar, /)
+DEFINE_SCA_OP(nda_add_scalar, +, add_scalar)
+DEFINE_SCA_OP(nda_sub_scalar, -, sub_scalar)
+DEFINE_SCA_OP(nda_mul_scalar, *, mul_scalar)
+DEFINE_SCA_OP(nda_div_scalar, /, div_scalar)
 
-float nda_sum(ndarray *a){
+static float sum_range(void *arg, int begin, int end){
+    ElemArgs *e = arg;
+    if (e->ca) {
+        return simd_kernels()->sum(end - begin, e->a->data + begin);
+    }
     float sum = 0;
-    for (int i = 0; i < a->size; i++) {
-        sum += a->data[i];
+    for (int i = begin; i < end; i++) {
+        sum += ELEM(e->a, e->ca, i);
     }
     return sum;
 }
 
+float nda_sum(ndarray *a){
+    ElemArgs e = elem_args(a, NULL, a, 0);
+    return nda_parallel_reduce(a->size, PARALLEL_GRAIN, sum_range, &e);
+}
+
 float nda_max(ndarray *a){
+    int c = nda_is_contiguous(a);
+    if (c) {
+        return simd_kernels()->max(a->size, a->data);
+    }
     float max = a->data[0];
     for (int i = 1; i < a->size; i++) {
-        if (a->data[i] > max) {
-            max = a->data[i];
+        if (ELEM(a, c, i) > max) {
+            max = ELEM(a, c, i);
         }
     }
     return max;
 }
 
 int nda_argmax(ndarray *a){
+    int c = nda_is_contiguous(a);
+    if (c) {
+        return simd_kernels()->argmax(a->size, a->data);
+    }
     float max = a->data[0];
     int argmax = 0;
     for (int i = 1; i < a->size; i++) {
-        if (a->data[i] > max) {
-            max = a->data[i];
+        if (ELEM(a, c, i) > max) {
+            max = ELEM(a, c, i);
             argmax = i;
         }
     }
     return argmax;
 }
 
+void nda_argmax_cols(ndarray *a, int out[]){
+    CHECK_MATRIX(a);
+    for (int j = 0; j < a->shape[1]; j++) {
+        const float *col = a->data + j * a->strides[1];
+        int argmax = 0;
+        for (int i = 1; i < a->shape[0]; i++) {
+            if (col[i * a->strides[0]] > col[argmax * a->strides[0]]) {
+                argmax = i;
+            }
+        }
+        out[j] = argmax;
+    }
+}
+
 void nda_normalize(ndarray *a, ndarray *out){
     CHECK_COMPATIBLE(a, out);
     float sum = nda_sum(a) + 1e-7;
@@ -186,34 +450,82 @@ void nda_normalize(ndarray *a, ndarray *out){
         exit(1);
     }
 
+    int ca = nda_is_contiguous(a), co = nda_is_contiguous(out);
     for (int i = 0; i < a->size; i++) {
-        out->data[i] = a->data[i] / sum;
-        if (isnan(out->data[i])) {
+        ELEM(out, co, i) = ELEM(a, ca, i) / sum;
+        if (isnan(ELEM(out, co, i))) {
             fprintf(stderr, "nan in ndarray\n");
             exit(1);
         }
     }
 }
 
+void nda_add_cols(ndarray *a, ndarray *col, ndarray *out){
+    CHECK_MATRIX(a);
+    CHECK_COMPATIBLE(a, out);
+    if (col->ndim != 2 || col->shape[0] != a->shape[0] || col->shape[1] != 1) {
+        fprintf(stderr, "ndarray shape mismatch for column broadcast\n");
+        exit(1);
+    }
+    nda_add(a, col, out);
+}
+
+void nda_sum_cols(ndarray *a, float alpha, ndarray *out){
+    CHECK_MATRIX(a);
+    if (out->ndim != 2 || out->shape[0] != a->shape[0] || out->shape[1] != 1) {
+        fprintf(stderr, "ndarray shape mismatch for column sum\n");
+        exit(1);
+    }
+    for (int i = 0; i < a->shape[0]; i++) {
+        float sum = 0;
+        for (int j = 0; j < a->shape[1]; j++) {
+            sum += a->data[i * a->strides[0] + j * a->strides[1]];
+        }
+        out->data[i * out->strides[0]] = alpha * sum;
+    }
+}
+
 // Matrix operations.
 void nda_dot(ndarray *a, ndarray *b, ndarray *out){
+    nda_gemm(NO_TRANS, NO_TRANS, 1, a, b, 0, out);
+}
+
+void nda_gemm(TransposeType trans_a, TransposeType trans_b, float alpha, ndarray *a, ndarray *b, float beta, ndarray *out){
     CHECK_MATRIX(a);
     CHECK_MATRIX(b);
+    CHECK_MATRIX(out);
+    // Shape and strides of op(a) and op(b).
+    int ta = trans_a == TRANS, tb = trans_b == TRANS;
+    int m = a->shape[ta], k = a->shape[!ta];
+    int kb = b->shape[tb], n = b->shape[!tb];
     // Check shapes.
-    if (a->shape[1] != b->shape[0] || out->shape[0] != a->shape[0] || out->shape[1] != b->shape[1]) {
+    if (k != kb || out->shape[0] != m || out->shape[1] != n) {
         fprintf(stderr, "ndarray shape mismatch for dot product\n");
         exit(1);
     }
 
-    for (int i = 0; i < a->shape[0]; i++) {
-        for (int j = 0; j < b->shape[1]; j++) {
-            float sum = 0;
-            for (int k = 0; k < a->shape[1]; k++) {
-                sum += a->data[i * a->strides[0] + k * a->strides[1]] * b->data[k * b->strides[0] + j * b->strides[1]];
-            }
-            out->data[i * out->strides[0] + j * out->strides[1]] = sum;
-        }
+    sgemm(m, n, k, alpha,
+          a->data, a->strides[ta], a->strides[!ta],
+          b->data, b->strides[tb], b->strides[!tb],
+          beta, out->data, out->strides[0], out->strides[1]);
+}
+
+void nda_dot_bias(ndarray *a, ndarray *b, ndarray *bias, int relu, ndarray *out){
+    CHECK_MATRIX(a);
+    CHECK_MATRIX(b);
+    CHECK_MATRIX(out);
+    if (a->shape[1] != b->shape[0] || out->shape[0] != a->shape[0] || out->shape[1] != b->shape[1]) {
+        fprintf(stderr, "ndarray shape mismatch for dot product\n");
+        exit(1);
+    }
+    if (bias->ndim != 2 || bias->shape[0] != a->shape[0] || bias->shape[1] != 1 || bias->strides[0] != 1) {
+        fprintf(stderr, "ndarray shape mismatch for dot product bias\n");
+        exit(1);
     }
+    sgemm_bias(a->shape[0], b->shape[1], a->shape[1],
+               a->data, a->strides[0], a->strides[1],
+               b->data, b->strides[0], b->strides[1],
+               bias->data, relu, out->data, out->strides[0], out->strides[1]);
 }
 
 void nda_T(ndarray *a){
@@ -227,17 +539,18 @@ void nda_T(ndarray *a){
 }
 
 void nda_flip(ndarray *mat) {
-    // This flip does not consider srtides
     CHECK_MATRIX(mat);
 
     int rows = mat->shape[0];
     int cols = mat->shape[1];
+    int rs = mat->strides[0];
+    int cs = mat->strides[1];
 
     for (int i = 0; i < rows / 2; i++){
         for (int j = 0; j < cols; j++){
-            float temp = mat->data[i * cols + j];
-            mat->data[i * cols + j] = mat->data[(rows - i - 1) * cols + (cols - j - 1)];
-            mat->data[(rows - i - 1) * cols + (cols - j - 1)] = temp;
+            float temp = mat->data[i * rs + j * cs];
+            mat->data[i * rs + j * cs] = mat->data[(rows - i - 1) * rs + (cols - j - 1) * cs];
+            mat->data[(rows - i - 1) * rs + (cols - j - 1) * cs] = temp;
         }
     }
 
@@ -245,9 +558,9 @@ void nda_flip(ndarray *mat) {
     if (rows % 2 == 1) {
         int i = rows / 2;
         for (int j = 0; j < cols / 2; j++) {
-            float temp = mat->data[i * cols + j];
-            mat->data[i * cols + j] = mat->data[i * cols + (cols - j - 1)];
-            mat->data[i * cols + (cols - j - 1)] = temp;
+            float temp = mat->data[i * rs + j * cs];
+            mat->data[i * rs + j * cs] = mat->data[i * rs + (cols - j - 1) * cs];
+            mat->data[i * rs + (cols - j - 1) * cs] = temp;
         }
     }
 }
@@ -262,49 +575,66 @@ void nda_pad(ndarray *a, int pad, ndarray *out){
     }
     
     for (int i = 0; i < a->shape[0]; ++i) {
-        memcpy(out->data + (i+pad)*out->strides[0] + pad*out->strides[1], 
-               a->data + i*a->strides[0], 
-               a->shape[1] * sizeof(float));
+        for (int j = 0; j < a->shape[1]; ++j) {
+            out->data[(i+pad)*out->strides[0] + (j+pad)*out->strides[1]] = a->data[i*a->strides[0] + j*a->strides[1]];
+        }
     }
 }
 
 // Ndarray operations.
-void nda_reshape(ndarray *a, int ndim, int *shape){
-    int* new_stride = malloc(ndim * sizeof(int));
-    int* new_shape = malloc(ndim * sizeof(int));
-    new_stride[ndim - 1] = 1;
+ndarray *nda_reshape(ndarray *a, int ndim, int *shape){
+    if (!nda_is_contiguous(a)) {
+        fprintf(stderr, "reshape of a non contiguous ndarray\n");
+        exit(1);
+    }
+    int strides[ndim];
+    strides[ndim - 1] = 1;
     for (int i = ndim - 1; i > 0; i--) {
-        new_stride[i - 1] = new_stride[i] * shape[i];
+        strides[i - 1] = strides[i] * shape[i];
     }
-    if (new_stride[0] * shape[0] != a->strides[0] * a->shape[0]) {
-        fprintf(stderr, "ndarray shape mismatch for reshape, size = %d, new size = %d\n", new_stride[0] * shape[0], a->strides[0] * a->shape[0]);
+    if (strides[0] * shape[0] != a->size) {
+        fprintf(stderr, "ndarray shape mismatch for reshape, size = %d, new size = %d\n", a->size, strides[0] * shape[0]);
         exit(1);
     }
-
-    a->ndim = ndim;
-    free(a->shape);
-    free(a->strides);
-    a->shape = new_shape;
-    memcpy(a->shape, shape, ndim * sizeof(int));
-    a->strides = new_stride;
+    return nda_view(a, ndim, shape, strides, 0);
 }
 
 ndarray* nda_deepcopy(ndarray *a){
-    ndarray* out = malloc(sizeof(ndarray));
-    out->ndim = a->ndim;
-    out->size = a->size;
-    out->shape = malloc(a->ndim * sizeof(int));
-    out->strides = malloc(a->ndim * sizeof(int));
-    memcpy(out->shape, a->shape, a->ndim * sizeof(int));
-    memcpy(out->strides, a->strides, a->ndim * sizeof(int));
-    out->data = malloc(a->size * sizeof(float));
-    memcpy(out->data, a->data, a->size * sizeof(float));
+    ndarray* out = nda_zero(a->ndim, a->shape);
+    nda_copy(a, out);
     return out;
 }
 
 void nda_copy(ndarray *a, ndarray *out){
     CHECK_COMPATIBLE(a, out);
-    memcpy(out->data, a->data, a->size * sizeof(float));
+    if (nda_is_contiguous(a) && nda_is_contiguous(out)) {
+        memcpy(out->data, a->data, a->size * sizeof(float));
+    } else {
+        for (int i = 0; i < a->size; i++) {
+            out->data[offset_of(out, i)] = a->data[offset_of(a, i)];
+        }
+    }
+}
+
+ndarray *nda_pack(ndarray **arrays[], int count){
+    // Offsets in floats, rounded up to NDA_ALIGN bytes.
+    int align = NDA_ALIGN / sizeof(float);
+    int offsets[count], size = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = size;
+        size += ((*arrays[i])->size + align - 1) / align * align;
+    }
+    ndarray *flat = nda_zero(1, (int[]){size});
+    for (int i = 0; i < count; i++) {
+        ndarray *a = *arrays[i];
+        ndarray *view = nda_view(flat, 1, (int[]){a->size}, (int[]){1}, offsets[i]);
+        ndarray *shaped = nda_reshape(view, a->ndim, a->shape);
+        nda_free(view);
+        nda_copy(a, shaped);
+        nda_free(a);
+        *arrays[i] = shaped;
+    }
+    return flat;
 }
 
 void nda_stack(ndarray *a[], int n, ndarray *out){
@@ -344,96 +674,326 @@ void nda_conv2d(ndarray *a, ndarray *b, ndarray *out){
     }
 }
 
+#define CHECK_CONV3D(a, b, out) \
+    do { if ((a)->ndim != 3 || (b)->ndim != 4 || (out)->ndim != 3 \
+        || (a)->shape[0] != (b)->shape[1] || (out)->shape[0] != (b)->shape[0] \
+        || (out)->shape[1] != (a)->shape[1] - (b)->shape[2] + 1 \
+        || (out)->shape[2] != (a)->shape[2] - (b)->shape[3] + 1) { \
+        fprintf(stderr, "ndarray shape mismatch for conv3d\n"); exit(1); \
+        } } while (0)
+
+// The 4D filter bank is used as a (filter_num, in_depth * kh * kw) matrix,
+// which requires its last three axes to be packed.
+#define CHECK_FILTER_MATRIX(b) \
+    do { if ((b)->ndim != 4 || (b)->strides[3] != 1 || (b)->strides[2] != (b)->shape[3] \
+        || (b)->strides[1] != (b)->shape[2] * (b)->shape[3] \
+        || (b)->strides[0] < (b)->shape[1] * (b)->strides[1]) { \
+        fprintf(stderr, "filter strides do not describe a matrix\n"); exit(1); \
+        } } while (0)
+
+// Each (height, width) plane of a 3D ndarray is used as one row of a matrix.
+#define CHECK_PACKED_PLANES(a) \
+    do { if ((a)->strides[2] != 1 || (a)->strides[1] != (a)->shape[2]) { \
+        fprintf(stderr, "ndarray planes are not packed\n"); exit(1); \
+        } } while (0)
+
+static void im2col(ndarray *a, int kh, int kw, float *col){
+    int out_h = a->shape[1] - kh + 1;
+    int out_w = a->shape[2] - kw + 1;
+    // Row (c, i, j) of col holds the input pixels seen by kernel tap (i, j) of channel c.
+    for (int c = 0; c < a->shape[0]; c++) {
+        for (int i = 0; i < kh; i++) {
+            for (int j = 0; j < kw; j++) {
+                for (int y = 0; y < out_h; y++) {
+                    float *src = a->data + c * a->strides[0] + (y + i) * a->strides[1] + j * a->strides[2];
+                    if (a->strides[2] == 1) {
+                        memcpy(col, src, out_w * sizeof(float));
+                    } else {
+                        for (int x = 0; x < out_w; x++) {
+                            col[x] = src[x * a->strides[2]];
+                        }
+                    }
+                    col += out_w;
+                }
+            }
+        }
+    }
+}
+
+static void conv3d_gemm(ndarray *a, ndarray *b, float *col, ndarray *out){
+    CHECK_FILTER_MATRIX(b);
+    CHECK_PACKED_PLANES(out);
+    int rows = b->shape[1] * b->shape[2] * b->shape[3];
+    int cols = out->shape[1] * out->shape[2];
+    im2col(a, b->shape[2], b->shape[3], col);
+    // (filter_num, rows) x (rows, out_height * out_width)
+    sgemm(b->shape[0], cols, rows, 1,
+          b->data, b->strides[0], 1,
+          col, cols, 1,
+          0, out->data, out->strides[0], 1);
+}
+
 void nda_conv3d(ndarray *a, ndarray *b, ndarray *out){
     /* a : 3D, (in_depth, in_height, in_width)
        b : 4D, (filter_num, in_depth, filter_height, filter_width)
        out : 3D, (filter_num, out_height, out_width)
     */
-    // Check shapes.
-    if (a->ndim != 3 || b->ndim != 4 || out->ndim != 3
-        || a->shape[0] != b->shape[1] || out->shape[0] != b->shape[0]
-        || out->shape[1] != a->shape[1] - b->shape[2] + 1 
-        || out->shape[2] != a->shape[2] - b->shape[3] + 1) {
-        fprintf(stderr, "ndarray shape mismatch for conv3d\n");
+    CHECK_CONV3D(a, b, out);
+    // The column matrix is scratch from the workspace of the thread.
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    int size = b->shape[1] * b->shape[2] * b->shape[3] * out->shape[1] * out->shape[2];
+    conv3d_gemm(a, b, arena_alloc(ws, size * sizeof(float)), out);
+    arena_release(ws, mark);
+}
+
+void nda_im2col(ndarray *a, int kh, int kw, ndarray *col){
+    if (a->ndim != 3 || col->ndim != 2
+        || col->shape[0] != a->shape[0] * kh * kw
+        || col->shape[1] != (a->shape[1] - kh + 1) * (a->shape[2] - kw + 1)) {
+        fprintf(stderr, "ndarray shape mismatch for im2col\n");
         exit(1);
     }
-    // temp matrix for 2d convolution
-    ndarray *mat = nda_zero(2, (int[]){a->shape[1], a->shape[2]});
-    ndarray *filter = nda_zero(3, (int[]){b->shape[1], b->shape[2], b->shape[3]});
-    ndarray *filter_mat = nda_zero(2, (int[]){b->shape[2], b->shape[3]});
-    ndarray *tmp = nda_zero(2, (int[]){out->shape[1], out->shape[2]});
-    ndarray *tmp_out = nda_zero(2, (int[]){out->shape[1], out->shape[2]});
-    
-    for (int i = 0; i < b->shape[0]; i++){
-        memcpy(filter->data, b->data + i * b->strides[0], b->strides[0] * sizeof(float));
-        for (int j = 0; j < a->shape[0]; j++){
-            memcpy(mat->data, a->data + j * a->strides[0], a->strides[0] * sizeof(float));
-            memcpy(filter_mat->data, filter->data + j * filter->strides[0], filter->strides[0] * sizeof(float));
-            nda_conv2d(mat, filter_mat, tmp);
-            nda_add(tmp_out, tmp, tmp_out);
-            // printf("---tmp_out---\n");
-            // nda_print(tmp_out);
-            // printf("------\n");
+    im2col(a, kh, kw, col->data);
+}
+
+void nda_conv3d_gemm(ndarray *a, ndarray *b, ndarray *col, ndarray *out){
+    CHECK_CONV3D(a, b, out);
+    if (col->ndim != 2
+        || col->shape[0] != b->shape[1] * b->shape[2] * b->shape[3]
+        || col->shape[1] != out->shape[1] * out->shape[2]) {
+        fprintf(stderr, "ndarray shape mismatch for im2col\n");
+        exit(1);
+    }
+    conv3d_gemm(a, b, col->data, out);
+}
+
+static void col2im(float *col, int kh, int kw, ndarray *out){
+    int out_h = out->shape[1] - kh + 1;
+    int out_w = out->shape[2] - kw + 1;
+    for (int c = 0; c < out->shape[0]; c++) {
+        for (int y = 0; y < out->shape[1]; y++) {
+            float *dst = out->data + c * out->strides[0] + y * out->strides[1];
+            for (int x = 0; x < out->shape[2]; x++) {
+                dst[x * out->strides[2]] = 0;
+            }
         }
-        memcpy(out->data + i * out->strides[0], tmp_out->data, tmp_out->size * sizeof(float));
     }
+    for (int c = 0; c < out->shape[0]; c++) {
+        for (int i = 0; i < kh; i++) {
+            for (int j = 0; j < kw; j++) {
+                for (int y = 0; y < out_h; y++) {
+                    float *dst = out->data + c * out->strides[0] + (y + i) * out->strides[1] + j * out->strides[2];
+                    for (int x = 0; x < out_w; x++) {
+                        dst[x * out->strides[2]] += col[x];
+                    }
+                    col += out_w;
+                }
+            }
+        }
+    }
+}
+
+void nda_col2im(ndarray *col, int kh, int kw, ndarray *out){
+    if (out->ndim != 3 || col->ndim != 2
+        || col->shape[0] != out->shape[0] * kh * kw
+        || col->shape[1] != (out->shape[1] - kh + 1) * (out->shape[2] - kw + 1)) {
+        fprintf(stderr, "ndarray shape mismatch for col2im\n");
+        exit(1);
+    }
+    col2im(col->data, kh, kw, out);
+}
+
+void nda_conv3d_grad_weights(float alpha, ndarray *dy, ndarray *col, float beta, ndarray *db){
+    CHECK_FILTER_MATRIX(db);
+    int rows = db->shape[1] * db->shape[2] * db->shape[3];
+    int cols = dy->shape[1] * dy->shape[2];
+    if (dy->ndim != 3 || col->ndim != 2 || dy->shape[0] != db->shape[0]
+        || col->shape[0] != rows || col->shape[1] != cols) {
+        fprintf(stderr, "ndarray shape mismatch for conv3d weights gradient\n");
+        exit(1);
+    }
+    CHECK_PACKED_PLANES(dy);
+    // (filter_num, cols) x (cols, rows)
+    sgemm(db->shape[0], rows, cols, alpha,
+          dy->data, dy->strides[0], 1,
+          col->data, 1, col->strides[0],
+          beta, db->data, db->strides[0], 1);
+}
 
-    nda_free(mat);
-    nda_free(filter);
-    nda_free(filter_mat);
-    nda_free(tmp);
-    nda_free(tmp_out);
+void nda_conv3d_grad_input(ndarray *dy, ndarray *b, ndarray *col_grad, ndarray *da){
+    CHECK_FILTER_MATRIX(b);
+    CHECK_CONV3D(da, b, dy);
+    int rows = b->shape[1] * b->shape[2] * b->shape[3];
+    int cols = dy->shape[1] * dy->shape[2];
+    if (col_grad->ndim != 2 || col_grad->shape[0] != rows || col_grad->shape[1] != cols) {
+        fprintf(stderr, "ndarray shape mismatch for col2im\n");
+        exit(1);
+    }
+    CHECK_PACKED_PLANES(dy);
+    // (rows, filter_num) x (filter_num, cols)
+    sgemm(rows, cols, b->shape[0], 1,
+          b->data, 1, b->strides[0],
+          dy->data, dy->strides[0], 1,
+          0, col_grad->data, col_grad->strides[0], 1);
+    col2im(col_grad->data, b->shape[2], b->shape[3], da);
 }
 
 // Activation functions.
+static void relu_range(void *arg, int begin, int end){
+    ElemArgs *e = arg;
+    if (e->ca && e->co) {
+        simd_kernels()->relu(end - begin, e->a->data + begin, e->out->data + begin);
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        float x = ELEM(e->a, e->ca, i);
+        ELEM(e->out, e->co, i) = x > 0 ? x : 0;
+    }
+}
+
 void nda_relu(ndarray *a, ndarray *out){
     CHECK_COMPATIBLE(a, out);
-    for (int i = 0; i < a->size; i++) {
-        out->data[i] = a->data[i] > 0 ? a->data[i] : 0;
-    }
+    ElemArgs e = elem_args(a, NULL, out, 0);
+    nda_parallel_for(a->size, PARALLEL_GRAIN, relu_range, &e);
 }
 
 void nda_identity(ndarray *a, ndarray *out){
-    CHECK_COMPATIBLE(a, out);
-    memcpy(out->data, a->data, a->size * sizeof(float));
+    nda_copy(a, out);
 }
 
-void nda_softmax(ndarray *a, ndarray *out) {
-    CHECK_COMPATIBLE(a, out);
-    float max = nda_max(a);
+// The columns of a matrix are softmaxed SOFTMAX_BLOCK at a time, a row of a
+// block at once, so that the exponentials run along contiguous rows.
+#define SOFTMAX_BLOCK 64
 
-    for (int i = 0; i < a->size; i++) {
-        out->data[i] = exp(a->data[i] - max);
-        if (isnan(out->data[i])) {
-            fprintf(stderr, "nan in ndarray softmax, a->data[%d] = %f, max = %f\n", i, a->data[i], max);
-            exit(1);
+typedef struct
+{
+    ndarray *a;
+    ndarray *out;
+} SoftmaxArgs;
+
+static void softmax_range(void *arg, int begin, int end){
+    SoftmaxArgs *s = arg;
+    ndarray *a = s->a, *out = s->out;
+    int rows = a->shape[0];
+    float max[SOFTMAX_BLOCK], sum[SOFTMAX_BLOCK], row[SOFTMAX_BLOCK];
+    for (int block = begin; block < end; block++) {
+        int j0 = block * SOFTMAX_BLOCK, n = MIN(SOFTMAX_BLOCK, a->shape[1] - j0);
+        const float *x = a->data + j0 * a->strides[1];
+        float *y = out->data + j0 * out->strides[1];
+        int ca = a->strides[1], co = out->strides[1];
+        for (int j = 0; j < n; j++) {
+            max[j] = x[j * ca];
+            sum[j] = 0;
+        }
+        for (int i = 1; i < rows; i++) {
+            for (int j = 0; j < n; j++) {
+                max[j] = fmaxf(max[j], x[i * a->strides[0] + j * ca]);
+            }
+        }
+        for (int i = 0; i < rows; i++) {
+            const float *xi = x + i * a->strides[0];
+            float *yi = y + i * out->strides[0];
+            if (ca == 1 && co == 1) {
+                simd_kernels()->exp_row(n, xi, max, yi, sum);
+                continue;
+            }
+            for (int j = 0; j < n; j++) {
+                row[j] = xi[j * ca];
+            }
+            simd_kernels()->exp_row(n, row, max, row, sum);
+            for (int j = 0; j < n; j++) {
+                yi[j * co] = row[j];
+            }
+        }
+        for (int j = 0; j < n; j++) {
+            sum[j] = 1 / sum[j];
+        }
+        for (int i = 0; i < rows; i++) {
+            float *yi = y + i * out->strides[0];
+            for (int j = 0; j < n; j++) {
+                yi[j * co] *= sum[j];
+            }
         }
     }
+}
 
-    nda_normalize(out, out);
+void nda_softmax(ndarray *a, ndarray *out) {
+    CHECK_COMPATIBLE(a, out);
+    if (a->ndim != 2) {
+        // Any other array is a single distribution, seen as one column.
+        if (!nda_is_contiguous(a) || !nda_is_contiguous(out)) {
+            ndarray *tmp = nda_deepcopy(a);
+            nda_softmax(tmp, tmp);
+            nda_copy(tmp, out);
+            nda_free(tmp);
+            return;
+        }
+        ndarray a_col = *a, out_col = *out;
+        a_col.ndim = out_col.ndim = 2;
+        a_col.shape[0] = out_col.shape[0] = a->size;
+        a_col.shape[1] = out_col.shape[1] = 1;
+        a_col.strides[0] = a_col.strides[1] = out_col.strides[0] = out_col.strides[1] = 1;
+        nda_softmax(&a_col, &out_col);
+        return;
+    }
+    // The columns of a matrix are the samples of a batch, normalized separately.
+    SoftmaxArgs s = {a, out};
+    int blocks = (a->shape[1] + SOFTMAX_BLOCK - 1) / SOFTMAX_BLOCK;
+    nda_parallel_for(blocks, MAX(1, PARALLEL_GRAIN / (a->shape[0] * SOFTMAX_BLOCK)), softmax_range, &s);
 }
 
 // Activation function derivatives.
+static void relu_prime_range(void *arg, int begin, int end){
+    ElemArgs *e = arg;
+    if (e->ca && e->co) {
+        simd_kernels()->relu_prime(end - begin, e->a->data + begin, e->out->data + begin);
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        ELEM(e->out, e->co, i) = ELEM(e->a, e->ca, i) > 0 ? 1 : 0;
+    }
+}
+
 void nda_relu_prime(ndarray *a, ndarray *out){
     CHECK_COMPATIBLE(a, out);
-    for (int i = 0; i < a->size; i++) {
-        out->data[i] = a->data[i] > 0 ? 1 : 0;
+    ElemArgs e = elem_args(a, NULL, out, 0);
+    nda_parallel_for(a->size, PARALLEL_GRAIN, relu_prime_range, &e);
+}
+
+static void relu_grad_range(void *arg, int begin, int end){
+    ElemArgs *e = arg;
+    if (e->ca && e->cb && e->co) {
+        simd_kernels()->relu_grad(end - begin, e->a->data + begin, e->b->data + begin, e->out->data + begin);
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        ELEM(e->out, e->co, i) = ELEM(e->b, e->cb, i) > 0 ? ELEM(e->a, e->ca, i) : 0;
     }
 }
 
+void nda_relu_grad(ndarray *grad, ndarray *output, ndarray *out){
+    CHECK_COMPATIBLE(grad, output);
+    CHECK_COMPATIBLE(grad, out);
+    ElemArgs e = elem_args(grad, output, out, 0);
+    nda_parallel_for(grad->size, PARALLEL_GRAIN, relu_grad_range, &e);
+}
+
 void nda_identity_prime(ndarray *a, ndarray *out){
     CHECK_COMPATIBLE(a, out);
+    int co = nda_is_contiguous(out);
     for (int i = 0; i < a->size; i++) {
-        out->data[i] = 1;
+        ELEM(out, co, i) = 1;
     }
 }
 
 // Loss functions.
 float mse(ndarray *pr, ndarray *tr){
     CHECK_COMPATIBLE(pr, tr);
+    int cp = nda_is_contiguous(pr), ct = nda_is_contiguous(tr);
     float sum = 0;
     for (int i = 0; i < pr->size; i++) {
-        sum += pow(pr->data[i] - tr->data[i], 2);
+        sum += pow(ELEM(pr, cp, i) - ELEM(tr, ct, i), 2);
     }
     return sum / pr->size;
 }
@@ -441,22 +1001,25 @@ float mse(ndarray *pr, ndarray *tr){
 void mse_prime(ndarray *pr, ndarray *tr, ndarray *out){
     CHECK_COMPATIBLE(pr, tr);
     CHECK_COMPATIBLE(pr, out);
+    int cp = nda_is_contiguous(pr), ct = nda_is_contiguous(tr), co = nda_is_contiguous(out);
     for (int i = 0; i < pr->size; i++) {
-        out->data[i] = 2 * (pr->data[i] - tr->data[i]);
+        ELEM(out, co, i) = 2 * (ELEM(pr, cp, i) - ELEM(tr, ct, i));
     }
 }
 
 // Cross-entropy loss function
 float cross_entropy(ndarray *pr, ndarray *tr){
     CHECK_COMPATIBLE(pr, tr);
+    int cp = nda_is_contiguous(pr), ct = nda_is_contiguous(tr);
     float sum = 0;
     for (int i = 0; i < pr->size; i++) {
-        if (pr->data[i] <= 1e-8) {
-            sum -= tr->data[i] * log(1e-8);
-        } else if (pr->data[i] >= 1 - 1e-8) {
-            sum -= tr->data[i] * log(1 - 1e-8);
+        float p = ELEM(pr, cp, i), t = ELEM(tr, ct, i);
+        if (p <= 1e-8) {
+            sum -= t * log(1e-8);
+        } else if (p >= 1 - 1e-8) {
+            sum -= t * log(1 - 1e-8);
         } else {
-            sum -= tr->data[i] * log(pr->data[i]);
+            sum -= t * log(p);
         }
     }
     return sum / pr->size;
@@ -465,15 +1028,97 @@ float cross_entropy(ndarray *pr, ndarray *tr){
 void cross_entropy_prime(ndarray *pr, ndarray *tr, ndarray *out){
     CHECK_COMPATIBLE(pr, tr);
     CHECK_COMPATIBLE(pr, out);
+    int cp = nda_is_contiguous(pr), ct = nda_is_contiguous(tr), co = nda_is_contiguous(out);
     for (int i = 0; i < pr->size; i++) {
-        out->data[i] = pr->data[i] - tr->data[i];
+        ELEM(out, co, i) = ELEM(pr, cp, i) - ELEM(tr, ct, i);
+    }
+}
+
+typedef struct
+{
+    ndarray *pr;
+    ndarray *tr;
+    ndarray *grad;
+} XentArgs;
+
+static float xent_range(void *arg, int begin, int end){
+    XentArgs *x = arg;
+    return simd_kernels()->xent(end - begin, x->pr->data + begin, x->tr->data + begin, x->grad->data + begin);
+}
+
+float nda_softmax_cross_entropy(ndarray *pr, ndarray *tr, ndarray *grad){
+    CHECK_COMPATIBLE(pr, tr);
+    CHECK_COMPATIBLE(pr, grad);
+    if (!nda_is_contiguous(pr) || !nda_is_contiguous(tr) || !nda_is_contiguous(grad)) {
+        cross_entropy_prime(pr, tr, grad);
+        return cross_entropy(pr, tr);
     }
+    XentArgs x = {pr, tr, grad};
+    return nda_parallel_reduce(pr->size, PARALLEL_GRAIN, xent_range, &x) / pr->size;
 }
 
 // Optimizers.
+static void sgd_range(void *arg, int begin, int end){
+    ElemArgs *e = arg;
+    if (e->ca && e->co) {
+        simd_kernels()->axpy(end - begin, -e->s, e->a->data + begin, e->out->data + begin);
+        return;
+    }
+    for (int i = begin; i < end; i++) {
+        ELEM(e->out, e->co, i) -= e->s * ELEM(e->a, e->ca, i);
+    }
+}
+
 void sgd(ndarray *w, ndarray *dw, float lr){
     CHECK_COMPATIBLE(w, dw);
-    for (int i = 0; i < w->size; i++) {
-        w->data[i] -= lr * dw->data[i];
+    ElemArgs e = elem_args(dw, NULL, w, lr);
+    nda_parallel_for(w->size, PARALLEL_GRAIN, sgd_range, &e);
+}
+
+// Chunks of the gradients reduced at once, small enough that the chunks of
+// all the replicas stay in cache through the tree.
+#define TREE_GRAIN 4096
+
+typedef struct
+{
+    ndarray **grads;
+    const float *scale;
+    int replicas;
+    int count;
+    int g; // gradient reduced
+} TreeArgs;
+
+// The whole tree on the elements [begin, end) of gradient g: the threads
+// split the elements, and each element sees the same additions in the same
+// order whatever the split.
+static void tree_range(void *arg, int begin, int end){
+    TreeArgs *t = arg;
+    const SimdKernels *k = simd_kernels();
+    int n = end - begin;
+    for (int r = 0; r < t->replicas; r++) {
+        float *x = t->grads[r * t->count + t->g]->data + begin;
+        k->mul_scalar(n, x, t->scale[r], x);
+    }
+    for (int stride = 1; stride < t->replicas; stride *= 2) {
+        for (int r = 0; r + stride < t->replicas; r += 2 * stride) {
+            float *dst = t->grads[r * t->count + t->g]->data + begin;
+            k->add(n, dst, t->grads[(r + stride) * t->count + t->g]->data + begin, dst);
+        }
+    }
+}
+
+void nda_tree_reduce(ndarray *grads[], const float scale[], int replicas, int count){
+    for (int r = 0; r < replicas; r++) {
+        for (int g = 0; g < count; g++) {
+            CHECK_COMPATIBLE(grads[g], grads[r * count + g]);
+            if (!nda_is_contiguous(grads[r * count + g])) {
+                fprintf(stderr, "tree reduce of a non contiguous gradient\n");
+                exit(1);
+            }
+        }
+    }
+    TreeArgs t = {grads, scale, replicas, count, 0};
+    for (t.g = 0; t.g < count; t.g++) {
+        nda_parallel_for(grads[t.g]->size, TREE_GRAIN, tree_range, &t);
     }
 }
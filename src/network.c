@@ -1,23 +1,79 @@
 #include "network.h"
+#include "threadpool.h"
+#include "misc.h"
+#include "model.h"
 
 #include <stdlib.h>
 #include <stdio.h>
 #include <math.h>
+#include <stdatomic.h>
+
+// Size the activations and their gradients for a batch, they are only
+// reallocated when the batch size changes.
+static void network_resize(Network *self, int batch){
+    nda_ensure_shape(&self->d1_output, 2, (int[]){256, batch});
+    nda_ensure_shape(&self->d1_input_grad, 2, (int[]){256, batch});
+    nda_ensure_shape(&self->d2_output, 2, (int[]){128, batch});
+    nda_ensure_shape(&self->d2_input_grad, 2, (int[]){128, batch});
+    nda_ensure_shape(&self->d3_input_grad, 2, (int[]){10, batch});
+}
+
+#define NUM_PARAMS 6
+
+static void network_tensors(Network *self, ndarray **params[], ndarray **grads[]){
+    DenseLayer *layers[] = {self->dense1, self->dense2, self->dense3};
+    for (int l = 0; l < 3; l++) {
+        params[2 * l] = &layers[l]->weights;
+        params[2 * l + 1] = &layers[l]->bias;
+        grads[2 * l] = &layers[l]->weights_grad;
+        grads[2 * l + 1] = &layers[l]->bias_grad;
+    }
+}
+
+static const ModelLayer layer_types[NUM_PARAMS] = {MODEL_DENSE, MODEL_DENSE, MODEL_DENSE, MODEL_DENSE, MODEL_DENSE, MODEL_DENSE};
+
+// Move the weights and biases of the layers into params and their gradients
+// into grads, once they were created or replaced.
+static void network_pack(Network *self){
+    ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS];
+    network_tensors(self, params, grads);
+    for (int i = 0; i < NUM_PARAMS; i++) {
+        nda_ensure_shape(grads[i], (*params[i])->ndim, (*params[i])->shape);
+    }
+    ndarray *packed_params = nda_pack(params, NUM_PARAMS), *packed_grads = nda_pack(grads, NUM_PARAMS);
+    if (self->params != NULL) nda_free(self->params);
+    if (self->grads != NULL) nda_free(self->grads);
+    self->params = packed_params;
+    self->grads = packed_grads;
+}
 
 Network *create_network(float learning_rate){
-    Network *network = malloc(sizeof(Network));
+    Network *network = nda_alloc(sizeof(Network));
     network->dense1 = create_dense_layer(RELU);
     network->dense2 = create_dense_layer(RELU);
     network->dense3 = create_dense_layer(SOFTMAX);
+    init_dense_layer(network->dense1, 400, 256);
+    init_dense_layer(network->dense2, 256, 128);
+    init_dense_layer(network->dense3, 128, 10);
+    network->params = NULL;
+    network->grads = NULL;
+    network->model = NULL;
+    network_pack(network);
+
+    network->d1_output = NULL;
+    network->d1_input_grad = NULL;
+
+    network->d2_output = NULL;
+    network->d2_input_grad = NULL;
 
-    network->d1_output = nda_zero(2, (int[]){256, 1});
-    network->d1_input_grad = nda_zero(2, (int[]){256, 1});
+    network->d3_output = NULL;
+    network->d3_input_grad = NULL;
+    network_resize(network, 1);
 
-    network->d2_output = nda_zero(2, (int[]){128, 1});
-    network->d2_input_grad = nda_zero(2, (int[]){128, 1});
+    network->workspace = create_arena(0);
 
-    network->d3_output = nda_zero(2, (int[]){10, 1});
-    network->d3_input_grad = nda_zero(2, (int[]){10, 1});
+    network->num_replicas = 0;
+    network->replicas = NULL;
 
     network->loss = 0;
     network->learning_rate = learning_rate;
@@ -25,36 +81,176 @@ Network *create_network(float learning_rate){
 }
 
 void network_forward(Network *self, ndarray *input, ndarray *output){
-    // input : (400, 1)
-    // output: (10, 1)
+    // input : (400, batch)
+    // output: (10, batch)
+    network_resize(self, input->shape[1]);
+    // A step starts with the forward pass, its scratch memory is recycled.
+    arena_reset(self->workspace);
+    Arena *previous = nda_set_workspace(self->workspace);
     self->dense1->forward(self->dense1, input, self->d1_output);
     self->dense2->forward(self->dense2, self->d1_output, self->d2_output);
+    // The last layer writes straight into the caller's output, which the
+    // backward pass reads back.
+    self->d3_output = output;
     self->dense3->forward(self->dense3, self->d2_output, self->d3_output);
-    nda_copy(self->d3_output, output);
+    nda_set_workspace(previous);
 }
 
 void network_backward(Network *self, ndarray *target){
-    // target: (10, 1)
-    self->loss = cross_entropy(self->d3_output, target);
-    cross_entropy_prime(self->d3_output, target, self->d3_input_grad);
+    // target: (10, batch), the gradients are averaged over the batch
+    Arena *previous = nda_set_workspace(self->workspace);
+    self->loss = nda_softmax_cross_entropy(self->d3_output, target, self->d3_input_grad);
     self->dense3->backward(self->dense3, self->d3_input_grad, self->d2_input_grad);
     self->dense2->backward(self->dense2, self->d2_input_grad, self->d1_input_grad);
     self->dense1->backward(self->dense1, self->d1_input_grad, NULL);
+    nda_set_workspace(previous);
 }
 
 void network_update(Network *self){
-    sgd(self->dense1->bias, self->dense1->bias_grad, self->learning_rate);
-    sgd(self->dense1->weights, self->dense1->weights_grad, self->learning_rate);
-    sgd(self->dense2->bias, self->dense2->bias_grad, self->learning_rate);
-    sgd(self->dense2->weights, self->dense2->weights_grad, self->learning_rate);
-    sgd(self->dense3->bias, self->dense3->bias_grad, self->learning_rate);
-    sgd(self->dense3->weights, self->dense3->weights_grad, self->learning_rate);
+    sgd(self->params, self->grads, self->learning_rate);
+}
+
+static void free_replicas(Network *self){
+    for (int r = 1; r < self->num_replicas; r++) {
+        free_network(self->replicas[r]);
+    }
+    if (self->replicas != NULL) nda_dealloc(self->replicas);
+    self->replicas = NULL;
+    self->num_replicas = 0;
+}
+
+// One replica per thread, rebuilt when the number of threads changes or the
+// weights of the network were packed anew (load_network).
+static void network_replicate(Network *self){
+    int num = nda_num_threads();
+    int current = self->num_replicas == num;
+    for (int r = 1; current && r < num; r++) {
+        current = self->replicas[r]->params->data == self->params->data;
+    }
+    if (current) {
+        return;
+    }
+    free_replicas(self);
+    self->replicas = nda_alloc(num * sizeof(Network *));
+    self->replicas[0] = self;
+    for (int r = 1; r < num; r++) {
+        Network *replica = create_network(self->learning_rate);
+        share_dense_layer(replica->dense1, self->dense1);
+        share_dense_layer(replica->dense2, self->dense2);
+        share_dense_layer(replica->dense3, self->dense3);
+        nda_free(replica->params);
+        replica->params = nda_reshape(self->params, 1, self->params->shape);
+        self->replicas[r] = replica;
+    }
+    self->num_replicas = num;
+}
+
+typedef struct
+{
+    Network *network;
+    ndarray *input;
+    ndarray *target;
+    ndarray *output;
+    int shards;
+} TrainArgs;
+
+static void train_shards(void *arg, int begin, int end){
+    TrainArgs *t = arg;
+    int batch = t->input->shape[1];
+    for (int r = begin; r < end; r++) {
+        int start = batch * r / t->shards, stop = batch * (r + 1) / t->shards;
+        Network *replica = t->network->replicas[r];
+        ndarray x = nda_slice_of(t->input, 1, start, stop);
+        ndarray y = nda_slice_of(t->output, 1, start, stop);
+        ndarray target = nda_slice_of(t->target, 1, start, stop);
+        network_forward(replica, &x, &y);
+        network_backward(replica, &target);
+    }
+}
+
+void network_train_batch(Network *self, ndarray *input, ndarray *target, ndarray *output){
+    int batch = input->shape[1];
+    network_replicate(self);
+    int shards = self->num_replicas < batch ? self->num_replicas : batch;
+    TrainArgs t = {self, input, target, output, shards};
+    nda_parallel_for(shards, 1, train_shards, &t);
+
+    // The batch gradient is the mean of the shard gradients weighted by
+    // their sizes, and so is the loss.
+    ndarray *grads[shards];
+    float scale[shards];
+    float loss = 0;
+    for (int r = 0; r < shards; r++) {
+        scale[r] = (float)(batch * (r + 1) / shards - batch * r / shards) / batch;
+        loss += scale[r] * self->replicas[r]->loss;
+        grads[r] = self->replicas[r]->grads;
+    }
+    if (shards > 1) {
+        nda_tree_reduce(grads, scale, shards, 1);
+    }
+    self->loss = loss;
+    self->d3_output = output;
+    network_update(self);
+}
+
+typedef struct
+{
+    Network *network;
+    ndarray *inputs;
+    ndarray *targets;
+    ndarray *outputs;
+    int batch_size;
+    atomic_int next; // first sample of the next batch to train on
+    float *losses; // loss summed over the samples of each replica
+} HogwildArgs;
+
+static void hogwild_replicas(void *arg, int begin, int end){
+    HogwildArgs *h = arg;
+    int num = h->inputs->shape[1];
+    for (int r = begin; r < end; r++) {
+        Network *replica = h->network->replicas[r];
+        replica->learning_rate = h->network->learning_rate;
+        int start;
+        while ((start = atomic_fetch_add(&h->next, h->batch_size)) < num) {
+            int stop = start + h->batch_size < num ? start + h->batch_size : num;
+            ndarray x = nda_slice_of(h->inputs, 1, start, stop);
+            ndarray y = nda_slice_of(h->outputs, 1, start, stop);
+            ndarray target = nda_slice_of(h->targets, 1, start, stop);
+            network_forward(replica, &x, &y);
+            network_backward(replica, &target);
+            // The weights are shared: the update races with the other
+            // replicas on purpose, without locks.
+            network_update(replica);
+            h->losses[r] += replica->loss * (stop - start);
+        }
+    }
+}
+
+float network_train_hogwild(Network *self, ndarray *inputs, ndarray *targets, ndarray *outputs, int batch_size){
+    int num = inputs->shape[1];
+    network_replicate(self);
+    float losses[self->num_replicas];
+    for (int r = 0; r < self->num_replicas; r++) {
+        losses[r] = 0;
+    }
+    HogwildArgs h = {self, inputs, targets, outputs, batch_size, 0, losses};
+    nda_parallel_for(self->num_replicas, 1, hogwild_replicas, &h);
+    float loss = 0;
+    for (int r = 0; r < self->num_replicas; r++) {
+        loss += losses[r];
+    }
+    self->loss = loss / num;
+    return self->loss;
 }
 
 void free_network(Network *self){
+    free_replicas(self);
     free_dense_layer(self->dense1);
     free_dense_layer(self->dense2);
     free_dense_layer(self->dense3);
+    nda_free(self->params);
+    nda_free(self->grads);
+    if (self->model != NULL) close_model(self->model);
 
     nda_free(self->d1_output);
     nda_free(self->d1_input_grad);
@@ -62,27 +258,143 @@ void free_network(Network *self){
     nda_free(self->d2_output);
     nda_free(self->d2_input_grad);
     
-    nda_free(self->d3_output);
     nda_free(self->d3_input_grad);
-    free(self);
+    free_arena(self->workspace);
+    nda_dealloc(self);
 }
 
-void save_network(Network *network, const char *filename) {
-    FILE *file = fopen(filename, "w");
-    if (file == NULL) {
-        printf("Error opening file!\n");
-        exit(1);
+NetworkContext *create_network_context(){
+    NetworkContext *context = nda_alloc(sizeof(NetworkContext));
+    context->workspace = create_arena(0);
+    context->d1_output = NULL;
+    context->d2_output = NULL;
+    return context;
+}
+
+void network_infer(Network *self, NetworkContext *context, ndarray *input, ndarray *output){
+    // input : (400, batch)
+    // output: (10, batch)
+    int batch = input->shape[1];
+    nda_ensure_shape(&context->d1_output, 2, (int[]){256, batch});
+    nda_ensure_shape(&context->d2_output, 2, (int[]){128, batch});
+    arena_reset(context->workspace);
+    Arena *previous = nda_set_workspace(context->workspace);
+    infer_dense_layer(self->dense1, input, context->d1_output);
+    infer_dense_layer(self->dense2, context->d1_output, context->d2_output);
+    infer_dense_layer(self->dense3, context->d2_output, output);
+    nda_set_workspace(previous);
+}
+
+void network_prepare_sample(Network *self, NetworkContext *context){
+    DenseLayer *layers[3] = {self->dense1, self->dense2, self->dense3};
+    int sizes[4] = {400, 256, 128, 10};
+    for (int i = 0; i < 3; i++) {
+        ndarray *w = layers[i]->weights, *b = layers[i]->bias;
+        if (w == NULL || w->ndim != 2 || w->shape[0] != sizes[i + 1] || w->shape[1] != sizes[i]
+            || w->strides[1] != 1 || b == NULL || b->size != sizes[i + 1] || !nda_is_contiguous(b)) {
+            fprintf(stderr, "dense layer %d can not run prepared inference\n", i + 1);
+            exit(1);
+        }
     }
+    nda_ensure_shape(&context->d1_output, 2, (int[]){256, 1});
+    nda_ensure_shape(&context->d2_output, 2, (int[]){128, 1});
+}
 
-    // Save parameters for each layer
-    save_dense_layer(network->dense1, file);
-    save_dense_layer(network->dense2, file);
-    save_dense_layer(network->dense3, file);
+void network_infer_sample(Network *self, NetworkContext *context, const float *input, float *output){
+    infer_dense_sample(self->dense1, input, context->d1_output->data);
+    infer_dense_sample(self->dense2, context->d1_output->data, context->d2_output->data);
+    infer_dense_sample(self->dense3, context->d2_output->data, output);
+}
 
-    fclose(file);
+void free_network_context(NetworkContext *context){
+    if (context->d1_output != NULL) nda_free(context->d1_output);
+    if (context->d2_output != NULL) nda_free(context->d2_output);
+    free_arena(context->workspace);
+    nda_dealloc(context);
 }
 
-void load_network(Network *network, const char *filename) {
+typedef struct
+{
+    Network *network;
+    ndarray **data;
+    int num;
+    int batch_size;
+    Dataset *dataset; // samples read as bytes instead of data, if not NULL
+    int *predictions;
+    atomic_int next; // first sample of the next batch to predict
+} PredictArgs;
+
+// network_infer on samples start, start + 1, ... of a dataset; the first
+// layer reads their bytes and scales them as it packs them for its GEMM.
+static void infer_dataset(Network *self, NetworkContext *context, Dataset *dataset, int start, ndarray *output){
+    int batch = output->shape[1];
+    nda_ensure_shape(&context->d1_output, 2, (int[]){256, batch});
+    nda_ensure_shape(&context->d2_output, 2, (int[]){128, batch});
+    arena_reset(context->workspace);
+    Arena *previous = nda_set_workspace(context->workspace);
+    infer_dense_layer_u8(self->dense1, dataset_sample(dataset, start), dataset->sample_size, dataset->scale, context->d1_output);
+    infer_dense_layer(self->dense2, context->d1_output, context->d2_output);
+    infer_dense_layer(self->dense3, context->d2_output, output);
+    nda_set_workspace(previous);
+}
+
+// Each task runs batches in its own context until none is left.
+static void predict_batches(void *arg, int begin, int end){
+    PredictArgs *p = arg;
+    for (int task = begin; task < end; task++) {
+        NetworkContext *context = create_network_context();
+        ndarray *inputs = p->dataset == NULL ? nda_zero(2, (int[]){p->data[0]->size, p->batch_size}) : NULL;
+        ndarray *outputs = nda_zero(2, (int[]){10, p->batch_size});
+        int start;
+        while ((start = atomic_fetch_add(&p->next, p->batch_size)) < p->num) {
+            int n = p->num - start < p->batch_size ? p->num - start : p->batch_size;
+            ndarray *y = nda_slice(outputs, 1, 0, n);
+            if (p->dataset != NULL) {
+                infer_dataset(p->network, context, p->dataset, start, y);
+            } else {
+                ndarray *x = nda_slice(inputs, 1, 0, n);
+                data_batch(p->data, NULL, start, x, NULL);
+                network_infer(p->network, context, x, y);
+                nda_free(x);
+            }
+            nda_argmax_cols(y, p->predictions + start);
+            nda_free(y);
+        }
+        if (inputs != NULL) nda_free(inputs);
+        nda_free(outputs);
+        free_network_context(context);
+    }
+}
+
+void network_predict(Network *self, ndarray *data[], int num, int batch_size, int predictions[]){
+    int batches = (num + batch_size - 1) / batch_size;
+    int tasks = nda_num_threads() < batches ? nda_num_threads() : batches;
+    PredictArgs p = {self, data, num, batch_size, NULL, predictions, 0};
+    nda_parallel_for(tasks, 1, predict_batches, &p);
+}
+
+void network_predict_dataset(Network *self, Dataset *dataset, int batch_size, int predictions[]){
+    if (dataset->sample_size != self->dense1->weights->shape[1]) {
+        fprintf(stderr, "dataset samples of %d values, the network takes %d\n", dataset->sample_size, self->dense1->weights->shape[1]);
+        exit(1);
+    }
+    int batches = (dataset->num + batch_size - 1) / batch_size;
+    int tasks = nda_num_threads() < batches ? nda_num_threads() : batches;
+    PredictArgs p = {self, NULL, dataset->num, batch_size, dataset, predictions, 0};
+    nda_parallel_for(tasks, 1, predict_batches, &p);
+}
+
+void save_network(Network *network, const char *filename) {
+    ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS], *tensors[NUM_PARAMS];
+    network_tensors(network, params, grads);
+    for (int i = 0; i < NUM_PARAMS; i++) {
+        tensors[i] = *params[i];
+    }
+    save_model(filename, network->params, tensors, layer_types, NUM_PARAMS);
+}
+
+// Text format of older versions, the weights are parsed one by one.
+static void load_network_text(Network *network, const char *filename) {
     FILE *file = fopen(filename, "r");
     if (file == NULL) {
         printf("Error opening file!\n");
@@ -93,13 +405,31 @@ void load_network(Network *network, const char *filename) {
     load_dense_layer(network->dense1, file);
     load_dense_layer(network->dense2, file);
     load_dense_layer(network->dense3, file);
+    fclose(file);
+    network_pack(network);
+}
+
+void load_network(Network *network, const char *filename) {
+    ModelFile *previous = network->model;
+    if (is_model_file(filename)) {
+        ModelFile *model = open_model(filename);
+        ndarray **params[NUM_PARAMS], **grads[NUM_PARAMS];
+        network_tensors(network, params, grads);
+        if (ensure_model_shapes(model, params, NUM_PARAMS)) {
+            network_pack(network);
+            network_tensors(network, params, grads);
+        }
+        bind_model(model, &network->params, params, layer_types, NUM_PARAMS);
+        network->model = model;
+    } else {
+        load_network_text(network, filename);
+        network->model = NULL;
+    }
+    if (previous != NULL) close_model(previous);
 
     printf("Loaded network from %s\n", filename);
-    fclose(file);
 }
 
 void copy_network(Network *dst, Network *src){
-    copy_dense_layer(dst->dense1, src->dense1);
-    copy_dense_layer(dst->dense2, src->dense2);
-    copy_dense_layer(dst->dense3, src->dense3);
+    nda_copy(src->params, dst->params);
 }
\ No newline at end of file
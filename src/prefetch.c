@@ -0,0 +1,213 @@
+#include "prefetch.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+// Yields before a thread waiting on the ring goes to sleep.
+#define SPIN_WAIT 16
+
+struct prefetcher
+{
+    Dataset *dataset;
+    int ndim;
+    int shape[NDA_MAX_DIM];
+    int axis; // batch axis of the inputs
+    int classes;
+    int depth;
+    int shuffle;
+    unsigned seed;
+    int *order;
+
+    // Ring of depth buffers; each batch is a view of the first size samples
+    // of its buffers, with the view headers kept here by value.
+    ndarray **inputs;
+    ndarray **targets;
+    ndarray *input_views;
+    ndarray *target_views;
+    Batch *batches;
+
+    // Batches produced and consumed so far: the producer fills batch
+    // head % depth once head - tail < depth, the consumer reads batch
+    // tail % depth once tail < head. Only the waits for a full or an empty
+    // ring take the mutex.
+    atomic_ullong head;
+    atomic_ullong tail;
+    int holding; // the consumer holds batch tail
+    atomic_int waiters;
+    atomic_int stop;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    pthread_t thread;
+};
+
+// Wait until *counter moves past value; returns 0 if the prefetcher stops.
+static int ring_wait(Prefetcher *p, atomic_ullong *counter, unsigned long long value){
+    for (int spin = 0; spin < SPIN_WAIT; spin++) {
+        if (atomic_load_explicit(counter, memory_order_acquire) != value) {
+            return 1;
+        }
+        sched_yield();
+    }
+    // The other side only signals when it sees a waiter, and it stores the
+    // counter before it looks: one of the two sees the other.
+    atomic_fetch_add(&p->waiters, 1);
+    pthread_mutex_lock(&p->mutex);
+    while (atomic_load(counter) == value && !atomic_load(&p->stop)) {
+        pthread_cond_wait(&p->cond, &p->mutex);
+    }
+    pthread_mutex_unlock(&p->mutex);
+    atomic_fetch_sub(&p->waiters, 1);
+    return !atomic_load(&p->stop);
+}
+
+static void ring_publish(Prefetcher *p, atomic_ullong *counter, unsigned long long value){
+    atomic_store(counter, value);
+    if (atomic_load(&p->waiters) > 0) {
+        pthread_mutex_lock(&p->mutex);
+        pthread_cond_broadcast(&p->cond);
+        pthread_mutex_unlock(&p->mutex);
+    }
+}
+
+static void shuffle_order(Prefetcher *p){
+    int num = p->dataset->num;
+    for (int i = 0; i < num - 1; i++) {
+        int j = i + rand_r(&p->seed) % (num - i);
+        int t = p->order[j];
+        p->order[j] = p->order[i];
+        p->order[i] = t;
+    }
+}
+
+// Views of the first size samples of the buffers of slot s: only the batch
+// axis of the headers changes.
+static Batch *slot_batch(Prefetcher *p, int s, int size){
+    Batch *b = &p->batches[s];
+    if (b->size != size) {
+        b->inputs->shape[p->axis] = size;
+        b->inputs->size = p->inputs[s]->size / p->inputs[s]->shape[p->axis] * size;
+        b->targets->shape[1] = size;
+        b->targets->size = p->classes * size;
+        b->size = size;
+    }
+    return b;
+}
+
+static void *produce(void *arg){
+    Prefetcher *p = arg;
+    int num = p->dataset->num, batch_size = p->shape[p->axis];
+    int start = 0, epoch = 0;
+    for (unsigned long long head = 0;; head++) {
+        while (head - atomic_load_explicit(&p->tail, memory_order_acquire) == (unsigned long long)p->depth) {
+            if (!ring_wait(p, &p->tail, head - p->depth)) {
+                return NULL;
+            }
+        }
+        if (atomic_load_explicit(&p->stop, memory_order_relaxed)) {
+            return NULL;
+        }
+        if (start == 0 && p->shuffle) {
+            shuffle_order(p);
+        }
+        int size = num - start < batch_size ? num - start : batch_size;
+        Batch *b = slot_batch(p, head % p->depth, size);
+        dataset_batch(p->dataset, p->order, start, b->inputs, b->targets);
+        for (int i = 0; i < size; i++) {
+            b->labels[i] = p->dataset->labels[p->order[start + i]];
+        }
+        b->epoch = epoch;
+        ring_publish(p, &p->head, head + 1);
+        start += size;
+        if (start == num) {
+            start = 0;
+            epoch++;
+        }
+    }
+}
+
+Prefetcher *create_prefetcher(Dataset *dataset, int ndim, int *shape, int classes, int depth, int shuffle){
+    if (dataset->num == 0 || depth < 1) {
+        fprintf(stderr, "prefetcher needs samples and at least one buffer\n");
+        exit(1);
+    }
+    Prefetcher *p = nda_alloc(sizeof(Prefetcher));
+    p->dataset = dataset;
+    p->ndim = ndim;
+    for (int d = 0; d < ndim; d++) {
+        p->shape[d] = shape[d];
+    }
+    p->axis = ndim == 2 ? 1 : 0;
+    p->classes = classes;
+    p->depth = depth;
+    p->shuffle = shuffle;
+    p->seed = rand();
+    p->order = nda_alloc(dataset->num * sizeof(int));
+    for (int i = 0; i < dataset->num; i++) {
+        p->order[i] = i;
+    }
+
+    int batch_size = shape[p->axis];
+    p->inputs = nda_alloc(depth * sizeof(ndarray *));
+    p->targets = nda_alloc(depth * sizeof(ndarray *));
+    p->input_views = nda_alloc(depth * sizeof(ndarray));
+    p->target_views = nda_alloc(depth * sizeof(ndarray));
+    p->batches = nda_alloc(depth * sizeof(Batch));
+    for (int s = 0; s < depth; s++) {
+        p->inputs[s] = nda_zero(ndim, shape);
+        p->targets[s] = nda_zero(2, (int[]){classes, batch_size});
+        p->input_views[s] = nda_slice_of(p->inputs[s], p->axis, 0, batch_size);
+        p->target_views[s] = nda_slice_of(p->targets[s], 1, 0, batch_size);
+        p->batches[s] = (Batch){&p->input_views[s], &p->target_views[s], nda_alloc(batch_size * sizeof(int)), batch_size, 0};
+    }
+
+    atomic_init(&p->head, 0);
+    atomic_init(&p->tail, 0);
+    p->holding = 0;
+    atomic_init(&p->waiters, 0);
+    atomic_init(&p->stop, 0);
+    pthread_mutex_init(&p->mutex, NULL);
+    pthread_cond_init(&p->cond, NULL);
+    if (pthread_create(&p->thread, NULL, produce, p) != 0) {
+        fprintf(stderr, "failed to start the prefetch thread\n");
+        exit(1);
+    }
+    return p;
+}
+
+Batch *next_batch(Prefetcher *p){
+    unsigned long long tail = atomic_load_explicit(&p->tail, memory_order_relaxed);
+    if (p->holding) {
+        ring_publish(p, &p->tail, ++tail);
+    }
+    while (atomic_load_explicit(&p->head, memory_order_acquire) == tail) {
+        ring_wait(p, &p->head, tail);
+    }
+    p->holding = 1;
+    return &p->batches[tail % p->depth];
+}
+
+void free_prefetcher(Prefetcher *p){
+    atomic_store(&p->stop, 1);
+    pthread_mutex_lock(&p->mutex);
+    pthread_cond_broadcast(&p->cond);
+    pthread_mutex_unlock(&p->mutex);
+    pthread_join(p->thread, NULL);
+    pthread_mutex_destroy(&p->mutex);
+    pthread_cond_destroy(&p->cond);
+
+    for (int s = 0; s < p->depth; s++) {
+        nda_dealloc(p->batches[s].labels);
+        nda_free(p->inputs[s]);
+        nda_free(p->targets[s]);
+    }
+    nda_dealloc(p->batches);
+    nda_dealloc(p->input_views);
+    nda_dealloc(p->target_views);
+    nda_dealloc(p->inputs);
+    nda_dealloc(p->targets);
+    nda_dealloc(p->order);
+    nda_dealloc(p);
+}
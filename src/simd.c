@@ -0,0 +1,390 @@
+#include "simd.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <pthread.h>
+
+#include <immintrin.h>
+
+// Sums of up to SUM_BLOCK floats are accumulated in vectors, longer ones
+// are split in halves.
+#define SUM_BLOCK 256
+
+// Branch-free float exp and log (the Cephes polynomials, within a few ulp).
+// exp clamps its argument to the range of normal floats, log expects a
+// positive normal.
+#define EXP_MIN -87.3f
+#define EXP_MAX 88.3f
+#define LOG2E 1.44269504f
+#define LN2_HI 0.693359375f
+#define LN2_LO -2.12194440e-4f
+#define SQRT_HALF 0.707106781f
+// Smallest and largest probabilities whose log enters the cross entropy, as
+// cross_entropy clamps them (the largest rounds to 1 in single precision).
+#define PROB_MIN 1e-8f
+#define PROB_MAX (1 - 1e-8f)
+
+static inline float exp_scalar(float x){
+    x = fminf(fmaxf(x, EXP_MIN), EXP_MAX);
+    float n = rintf(x * LOG2E);
+    float r = x - n * LN2_HI - n * LN2_LO;
+    float p = 1.9875691500e-4f;
+    p = p * r + 1.3981999507e-3f;
+    p = p * r + 8.3334519073e-3f;
+    p = p * r + 4.1665795894e-2f;
+    p = p * r + 1.6666665459e-1f;
+    p = p * r + 5.0000001201e-1f;
+    p = p * r * r + r + 1;
+    union { int i; float f; } scale = {((int)n + 127) << 23};
+    return p * scale.f;
+}
+
+static inline float log_scalar(float x){
+    union { float f; int i; } u = {x};
+    float e = (float)((u.i >> 23) - 126);
+    u.i = (u.i & 0x007fffff) | 0x3f000000;
+    // Mantissa in [sqrt(1/2), sqrt(2)) - 1.
+    float m = u.f, small = m < SQRT_HALF;
+    e -= small;
+    m = m - 1 + small * m;
+    float z = m * m;
+    float y = 7.0376836292e-2f;
+    y = y * m - 1.1514610310e-1f;
+    y = y * m + 1.1676998740e-1f;
+    y = y * m - 1.2420140846e-1f;
+    y = y * m + 1.4249322787e-1f;
+    y = y * m - 1.6668057665e-1f;
+    y = y * m + 2.0000714765e-1f;
+    y = y * m - 2.4999993993e-1f;
+    y = y * m + 3.3333331174e-1f;
+    y = y * m * z + e * LN2_LO - 0.5f * z;
+    return m + y + e * LN2_HI;
+}
+
+// Portable kernels, also the tails of the vector ones.
+#define DEFINE_BINARY(NAME, OP) \
+    static void NAME##_generic(int n, const float *a, const float *b, float *out){ \
+        for (int i = 0; i < n; i++) { \
+            out[i] = a[i] OP b[i]; \
+        } \
+    } \
+    static void NAME##_scalar_generic(int n, const float *a, float s, float *out){ \
+        for (int i = 0; i < n; i++) { \
+            out[i] = a[i] OP s; \
+        } \
+    }
+
+DEFINE_BINARY(add, +)
+DEFINE_BINARY(sub, -)
+DEFINE_BINARY(mul, *)
+DEFINE_BINARY(div, /)
+
+#undef DEFINE_BINARY
+
+static float sum_generic(int n, const float *a){
+    if (n > SUM_BLOCK) {
+        int half = n / 2;
+        return sum_generic(half, a) + sum_generic(n - half, a + half);
+    }
+    float sum = 0;
+    for (int i = 0; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+static float max_generic(int n, const float *a){
+    float max = a[0];
+    for (int i = 1; i < n; i++) {
+        max = a[i] > max ? a[i] : max;
+    }
+    return max;
+}
+
+static int argmax_generic(int n, const float *a){
+    int argmax = 0;
+    for (int i = 1; i < n; i++) {
+        if (a[i] > a[argmax]) {
+            argmax = i;
+        }
+    }
+    return argmax;
+}
+
+static void relu_generic(int n, const float *a, float *out){
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] > 0 ? a[i] : 0;
+    }
+}
+
+static void relu_prime_generic(int n, const float *a, float *out){
+    for (int i = 0; i < n; i++) {
+        out[i] = a[i] > 0 ? 1 : 0;
+    }
+}
+
+static void relu_grad_generic(int n, const float *grad, const float *output, float *out){
+    for (int i = 0; i < n; i++) {
+        out[i] = output[i] > 0 ? grad[i] : 0;
+    }
+}
+
+static void axpy_generic(int n, float alpha, const float *x, float *y){
+    for (int i = 0; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+static void exp_row_scalar(int n, const float *x, const float *shift, float *y, float *sum){
+    for (int j = 0; j < n; j++) {
+        y[j] = exp_scalar(x[j] - shift[j]);
+        sum[j] += y[j];
+    }
+}
+
+static float xent_scalar(int n, const float *p, const float *t, float *g){
+    float loss = 0;
+    for (int i = 0; i < n; i++) {
+        loss -= t[i] * log_scalar(fminf(fmaxf(p[i], PROB_MIN), PROB_MAX));
+        g[i] = p[i] - t[i];
+    }
+    return loss;
+}
+
+static const SimdKernels scalar_kernels = {
+    .name = "scalar",
+    .add = add_generic, .sub = sub_generic, .mul = mul_generic, .div = div_generic,
+    .add_scalar = add_scalar_generic, .sub_scalar = sub_scalar_generic,
+    .mul_scalar = mul_scalar_generic, .div_scalar = div_scalar_generic,
+    .sum = sum_generic, .max = max_generic, .argmax = argmax_generic,
+    .relu = relu_generic, .relu_prime = relu_prime_generic, .relu_grad = relu_grad_generic,
+    .axpy = axpy_generic, .exp_row = exp_row_scalar, .xent = xent_scalar,
+};
+
+// SSE4.2: 4 lanes, no fused multiply-add.
+#define SUFFIX sse42
+#define TARGET "sse4.2"
+#define ISA_NAME "sse4.2"
+#define V __m128
+#define VI __m128i
+#define W 4
+#define LOAD(p) _mm_loadu_ps(p)
+#define STORE(p, v) _mm_storeu_ps(p, v)
+#define SET1(x) _mm_set1_ps(x)
+#define ZERO() _mm_setzero_ps()
+#define ADD(a, b) _mm_add_ps(a, b)
+#define SUB(a, b) _mm_sub_ps(a, b)
+#define MUL(a, b) _mm_mul_ps(a, b)
+#define DIV(a, b) _mm_div_ps(a, b)
+#define VMAX(a, b) _mm_max_ps(a, b)
+#define VMIN(a, b) _mm_min_ps(a, b)
+#define FMADD(a, b, c) _mm_add_ps(_mm_mul_ps(a, b), c)
+#define FNMADD(a, b, c) _mm_sub_ps(c, _mm_mul_ps(a, b))
+#define SELECT_GT(x, y, v) _mm_and_ps(_mm_cmpgt_ps(x, y), v)
+#define SELECT_LT(x, y, v) _mm_and_ps(_mm_cmplt_ps(x, y), v)
+#define EQ_MASK(a, b) _mm_movemask_ps(_mm_cmpeq_ps(a, b))
+#define ROUND(x) _mm_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define CVT_I(x) _mm_cvtps_epi32(x)
+#define I2F(x) _mm_cvtepi32_ps(x)
+#define CAST_I(x) _mm_castps_si128(x)
+#define CAST_F(x) _mm_castsi128_ps(x)
+#define I_SET1(x) _mm_set1_epi32(x)
+#define I_ADD(a, b) _mm_add_epi32(a, b)
+#define I_SUB(a, b) _mm_sub_epi32(a, b)
+#define I_AND(a, b) _mm_and_si128(a, b)
+#define I_OR(a, b) _mm_or_si128(a, b)
+#define I_SLLI(a, k) _mm_slli_epi32(a, k)
+#define I_SRLI(a, k) _mm_srli_epi32(a, k)
+#include "simd_template.h"
+#undef SUFFIX
+#undef TARGET
+#undef ISA_NAME
+#undef V
+#undef VI
+#undef W
+#undef LOAD
+#undef STORE
+#undef SET1
+#undef ZERO
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef VMAX
+#undef VMIN
+#undef FMADD
+#undef FNMADD
+#undef SELECT_GT
+#undef SELECT_LT
+#undef EQ_MASK
+#undef ROUND
+#undef CVT_I
+#undef I2F
+#undef CAST_I
+#undef CAST_F
+#undef I_SET1
+#undef I_ADD
+#undef I_SUB
+#undef I_AND
+#undef I_OR
+#undef I_SLLI
+#undef I_SRLI
+
+// AVX2 with FMA: 8 lanes.
+#define SUFFIX avx2
+#define TARGET "avx2,fma"
+#define ISA_NAME "avx2"
+#define V __m256
+#define VI __m256i
+#define W 8
+#define LOAD(p) _mm256_loadu_ps(p)
+#define STORE(p, v) _mm256_storeu_ps(p, v)
+#define SET1(x) _mm256_set1_ps(x)
+#define ZERO() _mm256_setzero_ps()
+#define ADD(a, b) _mm256_add_ps(a, b)
+#define SUB(a, b) _mm256_sub_ps(a, b)
+#define MUL(a, b) _mm256_mul_ps(a, b)
+#define DIV(a, b) _mm256_div_ps(a, b)
+#define VMAX(a, b) _mm256_max_ps(a, b)
+#define VMIN(a, b) _mm256_min_ps(a, b)
+#define FMADD(a, b, c) _mm256_fmadd_ps(a, b, c)
+#define FNMADD(a, b, c) _mm256_fnmadd_ps(a, b, c)
+#define SELECT_GT(x, y, v) _mm256_and_ps(_mm256_cmp_ps(x, y, _CMP_GT_OQ), v)
+#define SELECT_LT(x, y, v) _mm256_and_ps(_mm256_cmp_ps(x, y, _CMP_LT_OQ), v)
+#define EQ_MASK(a, b) _mm256_movemask_ps(_mm256_cmp_ps(a, b, _CMP_EQ_OQ))
+#define ROUND(x) _mm256_round_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define CVT_I(x) _mm256_cvtps_epi32(x)
+#define I2F(x) _mm256_cvtepi32_ps(x)
+#define CAST_I(x) _mm256_castps_si256(x)
+#define CAST_F(x) _mm256_castsi256_ps(x)
+#define I_SET1(x) _mm256_set1_epi32(x)
+#define I_ADD(a, b) _mm256_add_epi32(a, b)
+#define I_SUB(a, b) _mm256_sub_epi32(a, b)
+#define I_AND(a, b) _mm256_and_si256(a, b)
+#define I_OR(a, b) _mm256_or_si256(a, b)
+#define I_SLLI(a, k) _mm256_slli_epi32(a, k)
+#define I_SRLI(a, k) _mm256_srli_epi32(a, k)
+#include "simd_template.h"
+#undef SUFFIX
+#undef TARGET
+#undef ISA_NAME
+#undef V
+#undef VI
+#undef W
+#undef LOAD
+#undef STORE
+#undef SET1
+#undef ZERO
+#undef ADD
+#undef SUB
+#undef MUL
+#undef DIV
+#undef VMAX
+#undef VMIN
+#undef FMADD
+#undef FNMADD
+#undef SELECT_GT
+#undef SELECT_LT
+#undef EQ_MASK
+#undef ROUND
+#undef CVT_I
+#undef I2F
+#undef CAST_I
+#undef CAST_F
+#undef I_SET1
+#undef I_ADD
+#undef I_SUB
+#undef I_AND
+#undef I_OR
+#undef I_SLLI
+#undef I_SRLI
+
+// AVX-512F: 16 lanes, comparisons give bit masks.
+#define SUFFIX avx512
+#define TARGET "avx512f"
+#define ISA_NAME "avx512"
+#define V __m512
+#define VI __m512i
+#define W 16
+#define LOAD(p) _mm512_loadu_ps(p)
+#define STORE(p, v) _mm512_storeu_ps(p, v)
+#define SET1(x) _mm512_set1_ps(x)
+#define ZERO() _mm512_setzero_ps()
+#define ADD(a, b) _mm512_add_ps(a, b)
+#define SUB(a, b) _mm512_sub_ps(a, b)
+#define MUL(a, b) _mm512_mul_ps(a, b)
+#define DIV(a, b) _mm512_div_ps(a, b)
+#define VMAX(a, b) _mm512_max_ps(a, b)
+#define VMIN(a, b) _mm512_min_ps(a, b)
+#define FMADD(a, b, c) _mm512_fmadd_ps(a, b, c)
+#define FNMADD(a, b, c) _mm512_fnmadd_ps(a, b, c)
+#define SELECT_GT(x, y, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, y, _CMP_GT_OQ), v)
+#define SELECT_LT(x, y, v) _mm512_maskz_mov_ps(_mm512_cmp_ps_mask(x, y, _CMP_LT_OQ), v)
+#define EQ_MASK(a, b) ((int)_mm512_cmp_ps_mask(a, b, _CMP_EQ_OQ))
+#define ROUND(x) _mm512_roundscale_ps(x, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC)
+#define CVT_I(x) _mm512_cvtps_epi32(x)
+#define I2F(x) _mm512_cvtepi32_ps(x)
+#define CAST_I(x) _mm512_castps_si512(x)
+#define CAST_F(x) _mm512_castsi512_ps(x)
+#define I_SET1(x) _mm512_set1_epi32(x)
+#define I_ADD(a, b) _mm512_add_epi32(a, b)
+#define I_SUB(a, b) _mm512_sub_epi32(a, b)
+#define I_AND(a, b) _mm512_and_si512(a, b)
+#define I_OR(a, b) _mm512_or_si512(a, b)
+#define I_SLLI(a, k) _mm512_slli_epi32(a, k)
+#define I_SRLI(a, k) _mm512_srli_epi32(a, k)
+#include "simd_template.h"
+
+static const SimdKernels *bound = NULL;
+static pthread_once_t simd_once = PTHREAD_ONCE_INIT;
+
+const SimdKernels *simd_kernels_for(SimdIsa isa){
+    __builtin_cpu_init();
+    switch (isa) {
+    case SIMD_SCALAR:
+        return &scalar_kernels;
+    case SIMD_SSE42:
+        return __builtin_cpu_supports("sse4.2") ? &kernels_sse42 : NULL;
+    case SIMD_AVX2:
+        return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma") ? &kernels_avx2 : NULL;
+    case SIMD_AVX512:
+        return __builtin_cpu_supports("avx512f") ? &kernels_avx512 : NULL;
+    default:
+        return NULL;
+    }
+}
+
+static const char *isa_names[] = {
+    [SIMD_SCALAR] = "scalar",
+    [SIMD_SSE42] = "sse4.2",
+    [SIMD_AVX2] = "avx2",
+    [SIMD_AVX512] = "avx512",
+};
+
+static void simd_init(){
+    // The widest set supported, unless NDA_SIMD asks for another one.
+    SimdIsa isa = SIMD_ISA_COUNT - 1;
+    while (simd_kernels_for(isa) == NULL) {
+        isa--;
+    }
+    const char *env = getenv("NDA_SIMD");
+    if (env != NULL) {
+        SimdIsa requested = SIMD_SCALAR;
+        while (requested < SIMD_ISA_COUNT && strcmp(isa_names[requested], env) != 0) {
+            requested++;
+        }
+        if (requested == SIMD_ISA_COUNT || simd_kernels_for(requested) == NULL) {
+            fprintf(stderr, "NDA_SIMD=%s is not supported, using %s\n", env, isa_names[isa]);
+        } else {
+            isa = requested;
+        }
+    }
+    bound = simd_kernels_for(isa);
+}
+
+const SimdKernels *simd_kernels(){
+    pthread_once(&simd_once, simd_init);
+    return bound;
+}
@@ -0,0 +1,227 @@
+// Kernels of one instruction set, included by simd.c once per set after it
+// defined the vector type V (W lanes) and its operations, SUFFIX and TARGET.
+// The tails shorter than a vector run the scalar code.
+
+#define CAT_(a, b) a##_##b
+#define CAT(a, b) CAT_(a, b)
+#define K(name) CAT(name, SUFFIX)
+#define KERNEL static __attribute__((target(TARGET)))
+
+#define DEFINE_BINARY(NAME, VOP, OP) \
+    KERNEL void K(NAME)(int n, const float *a, const float *b, float *out){ \
+        int i = 0; \
+        for (; i + W <= n; i += W) { \
+            STORE(out + i, VOP(LOAD(a + i), LOAD(b + i))); \
+        } \
+        for (; i < n; i++) { \
+            out[i] = a[i] OP b[i]; \
+        } \
+    } \
+    KERNEL void K(NAME##_scalar)(int n, const float *a, float s, float *out){ \
+        V sv = SET1(s); \
+        int i = 0; \
+        for (; i + W <= n; i += W) { \
+            STORE(out + i, VOP(LOAD(a + i), sv)); \
+        } \
+        for (; i < n; i++) { \
+            out[i] = a[i] OP s; \
+        } \
+    }
+
+DEFINE_BINARY(add, ADD, +)
+DEFINE_BINARY(sub, SUB, -)
+DEFINE_BINARY(mul, MUL, *)
+DEFINE_BINARY(div, DIV, /)
+
+#undef DEFINE_BINARY
+
+KERNEL float K(hsum)(V v){
+    float lanes[W];
+    STORE(lanes, v);
+    float sum = 0;
+    for (int l = 0; l < W; l++) {
+        sum += lanes[l];
+    }
+    return sum;
+}
+
+KERNEL float K(sum)(int n, const float *a){
+    if (n > SUM_BLOCK) {
+        int half = n / 2;
+        return K(sum)(half, a) + K(sum)(n - half, a + half);
+    }
+    V s0 = ZERO(), s1 = ZERO();
+    int i = 0;
+    for (; i + 2 * W <= n; i += 2 * W) {
+        s0 = ADD(s0, LOAD(a + i));
+        s1 = ADD(s1, LOAD(a + i + W));
+    }
+    for (; i + W <= n; i += W) {
+        s0 = ADD(s0, LOAD(a + i));
+    }
+    float sum = K(hsum)(ADD(s0, s1));
+    for (; i < n; i++) {
+        sum += a[i];
+    }
+    return sum;
+}
+
+KERNEL float K(max)(int n, const float *a){
+    float max = a[0];
+    int i = 0;
+    if (n >= W) {
+        V m = LOAD(a);
+        for (i = W; i + W <= n; i += W) {
+            m = VMAX(m, LOAD(a + i));
+        }
+        float lanes[W];
+        STORE(lanes, m);
+        for (int l = 0; l < W; l++) {
+            max = lanes[l] > max ? lanes[l] : max;
+        }
+    }
+    for (; i < n; i++) {
+        max = a[i] > max ? a[i] : max;
+    }
+    return max;
+}
+
+KERNEL int K(argmax)(int n, const float *a){
+    // Find the maximum, then its first occurrence.
+    float max = K(max)(n, a);
+    V m = SET1(max);
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        int mask = EQ_MASK(LOAD(a + i), m);
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    for (; i < n; i++) {
+        if (a[i] == max) {
+            return i;
+        }
+    }
+    return 0;
+}
+
+KERNEL void K(relu)(int n, const float *a, float *out){
+    V zero = ZERO();
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        V x = LOAD(a + i);
+        STORE(out + i, SELECT_GT(x, zero, x));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] > 0 ? a[i] : 0;
+    }
+}
+
+KERNEL void K(relu_prime)(int n, const float *a, float *out){
+    V zero = ZERO(), one = SET1(1);
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        STORE(out + i, SELECT_GT(LOAD(a + i), zero, one));
+    }
+    for (; i < n; i++) {
+        out[i] = a[i] > 0 ? 1 : 0;
+    }
+}
+
+KERNEL void K(relu_grad)(int n, const float *grad, const float *output, float *out){
+    V zero = ZERO();
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        STORE(out + i, SELECT_GT(LOAD(output + i), zero, LOAD(grad + i)));
+    }
+    for (; i < n; i++) {
+        out[i] = output[i] > 0 ? grad[i] : 0;
+    }
+}
+
+KERNEL void K(axpy)(int n, float alpha, const float *x, float *y){
+    V av = SET1(alpha);
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        STORE(y + i, FMADD(av, LOAD(x + i), LOAD(y + i)));
+    }
+    for (; i < n; i++) {
+        y[i] += alpha * x[i];
+    }
+}
+
+KERNEL V K(exp)(V x){
+    x = VMIN(VMAX(x, SET1(EXP_MIN)), SET1(EXP_MAX));
+    V n = ROUND(MUL(x, SET1(LOG2E)));
+    V r = FNMADD(n, SET1(LN2_HI), x);
+    r = FNMADD(n, SET1(LN2_LO), r);
+    V p = SET1(1.9875691500e-4f);
+    p = FMADD(p, r, SET1(1.3981999507e-3f));
+    p = FMADD(p, r, SET1(8.3334519073e-3f));
+    p = FMADD(p, r, SET1(4.1665795894e-2f));
+    p = FMADD(p, r, SET1(1.6666665459e-1f));
+    p = FMADD(p, r, SET1(5.0000001201e-1f));
+    p = FMADD(p, MUL(r, r), ADD(r, SET1(1)));
+    VI scale = I_SLLI(I_ADD(CVT_I(n), I_SET1(127)), 23);
+    return MUL(p, CAST_F(scale));
+}
+
+KERNEL V K(log)(V x){
+    VI u = CAST_I(x);
+    V e = I2F(I_SUB(I_SRLI(u, 23), I_SET1(126)));
+    V m = CAST_F(I_OR(I_AND(u, I_SET1(0x007fffff)), I_SET1(0x3f000000)));
+    // Mantissa in [sqrt(1/2), sqrt(2)) - 1.
+    V half = SET1(SQRT_HALF);
+    e = SUB(e, SELECT_LT(m, half, SET1(1)));
+    m = ADD(SUB(m, SET1(1)), SELECT_LT(m, half, m));
+    V z = MUL(m, m);
+    V y = SET1(7.0376836292e-2f);
+    y = FMADD(y, m, SET1(-1.1514610310e-1f));
+    y = FMADD(y, m, SET1(1.1676998740e-1f));
+    y = FMADD(y, m, SET1(-1.2420140846e-1f));
+    y = FMADD(y, m, SET1(1.4249322787e-1f));
+    y = FMADD(y, m, SET1(-1.6668057665e-1f));
+    y = FMADD(y, m, SET1(2.0000714765e-1f));
+    y = FMADD(y, m, SET1(-2.4999993993e-1f));
+    y = FMADD(y, m, SET1(3.3333331174e-1f));
+    y = MUL(MUL(y, m), z);
+    y = FMADD(e, SET1(LN2_LO), y);
+    y = FNMADD(SET1(0.5f), z, y);
+    return FMADD(e, SET1(LN2_HI), ADD(m, y));
+}
+
+KERNEL void K(exp_row)(int n, const float *x, const float *shift, float *y, float *sum){
+    int j = 0;
+    for (; j + W <= n; j += W) {
+        V v = K(exp)(SUB(LOAD(x + j), LOAD(shift + j)));
+        STORE(y + j, v);
+        STORE(sum + j, ADD(LOAD(sum + j), v));
+    }
+    exp_row_scalar(n - j, x + j, shift + j, y + j, sum + j);
+}
+
+KERNEL float K(xent)(int n, const float *p, const float *t, float *g){
+    V acc = ZERO(), pmin = SET1(PROB_MIN), pmax = SET1(PROB_MAX);
+    int i = 0;
+    for (; i + W <= n; i += W) {
+        V pv = LOAD(p + i), tv = LOAD(t + i);
+        acc = FMADD(tv, K(log)(VMIN(VMAX(pv, pmin), pmax)), acc);
+        STORE(g + i, SUB(pv, tv));
+    }
+    return xent_scalar(n - i, p + i, t + i, g + i) - K(hsum)(acc);
+}
+
+static const SimdKernels K(kernels) = {
+    .name = ISA_NAME,
+    .add = K(add), .sub = K(sub), .mul = K(mul), .div = K(div),
+    .add_scalar = K(add_scalar), .sub_scalar = K(sub_scalar),
+    .mul_scalar = K(mul_scalar), .div_scalar = K(div_scalar),
+    .sum = K(sum), .max = K(max), .argmax = K(argmax),
+    .relu = K(relu), .relu_prime = K(relu_prime), .relu_grad = K(relu_grad),
+    .axpy = K(axpy), .exp_row = K(exp_row), .xent = K(xent),
+};
+
+#undef CAT_
+#undef CAT
+#undef K
+#undef KERNEL
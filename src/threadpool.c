@@ -0,0 +1,303 @@
+#define _GNU_SOURCE
+#include "threadpool.h"
+#include "arena.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+// Chunks [begin, end) still to run by one thread. The owner takes chunks at
+// begin, thieves take the upper half of what is left.
+typedef struct
+{
+    atomic_flag lock;
+    int begin;
+    int end;
+} __attribute__((aligned(NDA_ALIGN))) WorkRange;
+
+typedef struct
+{
+    RangeFunc fn;
+    void *arg;
+    int n;
+    int grain;
+    Arena *workspace; // of the thread that started the loop
+} Job;
+
+static int num_threads = 0;
+static int pin_threads = -1;
+static pthread_t *workers = NULL;
+static WorkRange *ranges = NULL;
+
+// The current job, published to the workers by bumping generation.
+static Job job;
+static pthread_mutex_t job_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t job_cond = PTHREAD_COND_INITIALIZER;
+static unsigned long generation = 0;
+// Generation when the pool started, the last job the new workers have seen.
+static unsigned long start_generation = 0;
+static int shutting_down = 0;
+// Workers still busy with the current job.
+static atomic_int active = 0;
+// Held by the thread running a parallel loop, others run theirs serially.
+static pthread_mutex_t submit_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Serializes starting and stopping the pool.
+static pthread_mutex_t pool_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static _Thread_local int in_parallel = 0;
+
+static void lock_range(WorkRange *range){
+    while (atomic_flag_test_and_set_explicit(&range->lock, memory_order_acquire)) {
+        sched_yield();
+    }
+}
+
+static void unlock_range(WorkRange *range){
+    atomic_flag_clear_explicit(&range->lock, memory_order_release);
+}
+
+// Take the next chunk of thread id, stealing from the others when it has none.
+static int next_chunk(int id){
+    WorkRange *own = &ranges[id];
+    lock_range(own);
+    if (own->begin < own->end) {
+        int chunk = own->begin++;
+        unlock_range(own);
+        return chunk;
+    }
+    unlock_range(own);
+
+    for (int i = 1; i < num_threads; i++) {
+        WorkRange *victim = &ranges[(id + i) % num_threads];
+        lock_range(victim);
+        int left = victim->end - victim->begin;
+        if (left > 0) {
+            int steal = (left + 1) / 2;
+            int begin = victim->end - steal;
+            victim->end = begin;
+            unlock_range(victim);
+            // Keep the first stolen chunk, queue the rest as our own.
+            lock_range(own);
+            own->begin = begin + 1;
+            own->end = begin + steal;
+            unlock_range(own);
+            return begin;
+        }
+        unlock_range(victim);
+    }
+    return -1;
+}
+
+static void run_job(int id){
+    in_parallel = 1;
+    Arena *previous = nda_set_workspace(arena_worker(job.workspace, id));
+    for (int chunk = next_chunk(id); chunk >= 0; chunk = next_chunk(id)) {
+        int begin = chunk * job.grain;
+        int end = begin + job.grain < job.n ? begin + job.grain : job.n;
+        job.fn(job.arg, begin, end);
+    }
+    nda_set_workspace(previous);
+    in_parallel = 0;
+}
+
+static void pin_to_core(pthread_t thread, int id){
+    int cores = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(id % (cores > 0 ? cores : 1), &set);
+    pthread_setaffinity_np(thread, sizeof(set), &set);
+}
+
+static void *worker_main(void *arg){
+    int id = (int)(size_t)arg;
+    unsigned long seen = start_generation;
+    for (;;) {
+        pthread_mutex_lock(&job_mutex);
+        while (generation == seen && !shutting_down) {
+            pthread_cond_wait(&job_cond, &job_mutex);
+        }
+        if (shutting_down) {
+            pthread_mutex_unlock(&job_mutex);
+            nda_free_default_workspace();
+            return NULL;
+        }
+        seen = generation;
+        pthread_mutex_unlock(&job_mutex);
+
+        run_job(id);
+        atomic_fetch_sub_explicit(&active, 1, memory_order_release);
+    }
+}
+
+static void stop_pool(){
+    if (workers == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&job_mutex);
+    shutting_down = 1;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+    for (int i = 1; i < num_threads; i++) {
+        pthread_join(workers[i], NULL);
+    }
+    nda_dealloc(workers);
+    nda_dealloc(ranges);
+    workers = NULL;
+    ranges = NULL;
+    shutting_down = 0;
+}
+
+static void start_pool(){
+    if (num_threads <= 0) {
+        const char *env = getenv("NDA_NUM_THREADS");
+        num_threads = env != NULL ? atoi(env) : sysconf(_SC_NPROCESSORS_ONLN);
+        if (num_threads <= 0) {
+            num_threads = 1;
+        }
+    }
+    if (pin_threads < 0) {
+        const char *env = getenv("NDA_PIN_THREADS");
+        pin_threads = env != NULL && atoi(env) != 0;
+    }
+    workers = nda_alloc(num_threads * sizeof(pthread_t));
+    ranges = nda_alloc(num_threads * sizeof(WorkRange));
+    for (int i = 0; i < num_threads; i++) {
+        atomic_flag_clear(&ranges[i].lock);
+        ranges[i].begin = ranges[i].end = 0;
+    }
+    workers[0] = pthread_self();
+    start_generation = generation;
+    for (int i = 1; i < num_threads; i++) {
+        if (pthread_create(&workers[i], NULL, worker_main, (void *)(size_t)i) != 0) {
+            fprintf(stderr, "failed to create thread %d of the pool\n", i);
+            exit(1);
+        }
+        if (pin_threads) {
+            pin_to_core(workers[i], i);
+        }
+    }
+    static int registered = 0;
+    if (!registered) {
+        atexit(stop_pool);
+        registered = 1;
+    }
+}
+
+// Stop the pool to change its settings. The caller waits for a parallel loop
+// running on another thread, which uses the workers and their ranges, to
+// finish first; a loop can not change the pool it runs on.
+static void lock_pool_settings(){
+    if (in_parallel) {
+        fprintf(stderr, "the thread pool can not be changed from inside a parallel loop\n");
+        exit(1);
+    }
+    pthread_mutex_lock(&submit_mutex);
+    pthread_mutex_lock(&pool_mutex);
+    stop_pool();
+}
+
+static void unlock_pool_settings(){
+    pthread_mutex_unlock(&pool_mutex);
+    pthread_mutex_unlock(&submit_mutex);
+}
+
+void nda_set_num_threads(int n){
+    lock_pool_settings();
+    num_threads = n;
+    unlock_pool_settings();
+}
+
+int nda_num_threads(){
+    pthread_mutex_lock(&pool_mutex);
+    if (workers == NULL) {
+        start_pool();
+    }
+    pthread_mutex_unlock(&pool_mutex);
+    return num_threads;
+}
+
+void nda_set_thread_pinning(int pin){
+    lock_pool_settings();
+    pin_threads = pin != 0;
+    unlock_pool_settings();
+}
+
+void nda_parallel_for(int n, int grain, RangeFunc fn, void *arg){
+    if (n <= 0) {
+        return;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    int chunks = (n + grain - 1) / grain;
+    if (chunks == 1 || in_parallel || pthread_mutex_trylock(&submit_mutex) != 0) {
+        fn(arg, 0, n);
+        return;
+    }
+    if (nda_num_threads() == 1) {
+        pthread_mutex_unlock(&submit_mutex);
+        fn(arg, 0, n);
+        return;
+    }
+
+    // The tasks take their scratch from worker arenas of the workspace of the
+    // caller, sized while the workers are idle.
+    Arena *ws = nda_workspace();
+    arena_prepare_workers(ws, num_threads);
+    job = (Job){fn, arg, n, grain, ws};
+    for (int i = 0; i < num_threads; i++) {
+        ranges[i].begin = (long)chunks * i / num_threads;
+        ranges[i].end = (long)chunks * (i + 1) / num_threads;
+    }
+    atomic_store(&active, num_threads - 1);
+    pthread_mutex_lock(&job_mutex);
+    generation++;
+    pthread_cond_broadcast(&job_cond);
+    pthread_mutex_unlock(&job_mutex);
+
+    run_job(0);
+    // Every worker leaves the job before the next one can reuse the ranges.
+    while (atomic_load_explicit(&active, memory_order_acquire) > 0) {
+        sched_yield();
+    }
+    pthread_mutex_unlock(&submit_mutex);
+}
+
+typedef struct
+{
+    ReduceFunc fn;
+    void *arg;
+    int grain;
+    float *partial;
+} ReduceJob;
+
+static void reduce_range(void *arg, int begin, int end){
+    ReduceJob *r = arg;
+    for (int chunk = begin / r->grain; chunk * r->grain < end; chunk++) {
+        int chunk_end = (chunk + 1) * r->grain < end ? (chunk + 1) * r->grain : end;
+        r->partial[chunk] = r->fn(r->arg, chunk * r->grain, chunk_end);
+    }
+}
+
+float nda_parallel_reduce(int n, int grain, ReduceFunc fn, void *arg){
+    if (n <= 0) {
+        return 0;
+    }
+    if (grain < 1) {
+        grain = 1;
+    }
+    int chunks = (n + grain - 1) / grain;
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    ReduceJob r = {fn, arg, grain, arena_alloc(ws, chunks * sizeof(float))};
+    nda_parallel_for(n, grain, reduce_range, &r);
+    float sum = 0;
+    for (int i = 0; i < chunks; i++) {
+        sum += r.partial[i];
+    }
+    arena_release(ws, mark);
+    return sum;
+}
@@ -0,0 +1,230 @@
+#include "ndarray.h"
+#include "gemm.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// Winograd minimal filtering F(m x m, 3 x 3): a (m + 2) x (m + 2) input tile d
+// and a 3 x 3 filter g give the m x m output tile A^T [(G g G^T) * (B^T d B)] A.
+// Transforms from Lavin & Gray, "Fast Algorithms for Convolutional Neural Networks".
+#define MAX_ALPHA 6
+
+static const float BT2[4 * 4] = {
+    1,  0, -1,  0,
+    0,  1,  1,  0,
+    0, -1,  1,  0,
+    0,  1,  0, -1,
+};
+static const float G2[4 * 3] = {
+    1,     0,    0,
+    0.5,  0.5, 0.5,
+    0.5, -0.5, 0.5,
+    0,     0,    1,
+};
+static const float AT2[2 * 4] = {
+    1, 1,  1,  0,
+    0, 1, -1, -1,
+};
+
+static const float BT4[6 * 6] = {
+    4,  0, -5,  0, 1, 0,
+    0, -4, -4,  1, 1, 0,
+    0,  4, -4, -1, 1, 0,
+    0, -2, -1,  2, 1, 0,
+    0,  2, -1, -2, 1, 0,
+    0,  4,  0, -5, 0, 1,
+};
+static const float G4[6 * 3] = {
+     1.0 / 4,        0,        0,
+    -1.0 / 6,  -1.0 / 6, -1.0 / 6,
+    -1.0 / 6,   1.0 / 6, -1.0 / 6,
+     1.0 / 24,  1.0 / 12, 1.0 / 6,
+     1.0 / 24, -1.0 / 12, 1.0 / 6,
+     0,              0,        1,
+};
+static const float AT4[4 * 6] = {
+    1, 1,  1, 1,  1, 0,
+    0, 1, -1, 2, -2, 0,
+    0, 1,  1, 4,  4, 0,
+    0, 1, -1, 8, -8, 1,
+};
+
+static void check_tile(int m){
+    if (m != 2 && m != 4) {
+        fprintf(stderr, "winograd tile size must be 2 or 4, got %d\n", m);
+        exit(1);
+    }
+}
+
+// out (p x r) = l (p x q) * x (q x q) * l^T (q x r), with l given row-major.
+static void sandwich(const float *l, int p, int q, const float *x, int r, const float *rt, float *out){
+    float tmp[MAX_ALPHA * MAX_ALPHA];
+    for (int i = 0; i < p; i++) {
+        for (int j = 0; j < q; j++) {
+            float sum = 0;
+            for (int k = 0; k < q; k++) {
+                sum += l[i * q + k] * x[k * q + j];
+            }
+            tmp[i * q + j] = sum;
+        }
+    }
+    for (int i = 0; i < p; i++) {
+        for (int j = 0; j < r; j++) {
+            float sum = 0;
+            for (int k = 0; k < q; k++) {
+                sum += tmp[i * q + k] * rt[j * q + k];
+            }
+            out[i * r + j] = sum;
+        }
+    }
+}
+
+static void filter_transform(ndarray *b, int m, int rotate, ndarray *u){
+    check_tile(m);
+    int alpha = m + 2;
+    int filter_num = b->shape[0], depth = b->shape[1];
+    int rows = rotate ? depth : filter_num, cols = rotate ? filter_num : depth;
+    if (b->ndim != 4 || b->shape[2] != 3 || b->shape[3] != 3
+        || u->ndim != 3 || u->shape[0] != alpha * alpha || u->shape[1] != rows || u->shape[2] != cols) {
+        fprintf(stderr, "ndarray shape mismatch for winograd filter transform\n");
+        exit(1);
+    }
+    const float *g_mat = m == 2 ? G2 : G4;
+    float g[9], v[MAX_ALPHA * MAX_ALPHA];
+    for (int n = 0; n < filter_num; n++) {
+        for (int c = 0; c < depth; c++) {
+            for (int i = 0; i < 3; i++) {
+                for (int j = 0; j < 3; j++) {
+                    float w = b->data[n * b->strides[0] + c * b->strides[1] + i * b->strides[2] + j * b->strides[3]];
+                    // The input gradient correlates with the filter rotated by 180 degrees.
+                    if (rotate) {
+                        g[(2 - i) * 3 + 2 - j] = w;
+                    } else {
+                        g[i * 3 + j] = w;
+                    }
+                }
+            }
+            sandwich(g_mat, alpha, 3, g, alpha, g_mat, v);
+            int row = rotate ? c : n, col = rotate ? n : c;
+            for (int xi = 0; xi < alpha * alpha; xi++) {
+                u->data[xi * u->strides[0] + row * u->strides[1] + col * u->strides[2]] = v[xi];
+            }
+        }
+    }
+}
+
+void nda_winograd_filter(ndarray *b, int m, ndarray *u){
+    filter_transform(b, m, 0, u);
+}
+
+void nda_winograd_filter_grad(ndarray *b, int m, ndarray *u){
+    filter_transform(b, m, 1, u);
+}
+
+// The stages of the convolution are split across the threads of the pool:
+// the input transform over (channel, tile row) pairs, the products over the
+// transform coordinates and the output transform over (filter, tile row) pairs.
+typedef struct
+{
+    ndarray *a;
+    ndarray *u;
+    ndarray *out;
+    int m, alpha, pad;
+    int depth, filter_num;
+    int tiles_h, tiles_w, tiles;
+    float *v;
+    float *p;
+} WinogradArgs;
+
+static void input_transform(void *arg, int begin, int end){
+    WinogradArgs *w = arg;
+    ndarray *a = w->a;
+    int m = w->m, alpha = w->alpha, pad = w->pad;
+    const float *bt = m == 2 ? BT2 : BT4;
+    float d[MAX_ALPHA * MAX_ALPHA], t[MAX_ALPHA * MAX_ALPHA];
+    for (int row = begin; row < end; row++) {
+        int c = row / w->tiles_h, ty = row % w->tiles_h;
+        for (int tx = 0; tx < w->tiles_w; tx++) {
+            // Gather the tile, zero outside of the (padded) input.
+            for (int i = 0; i < alpha; i++) {
+                int y = ty * m + i - pad;
+                for (int j = 0; j < alpha; j++) {
+                    int x = tx * m + j - pad;
+                    d[i * alpha + j] = (y >= 0 && y < a->shape[1] && x >= 0 && x < a->shape[2])
+                        ? a->data[c * a->strides[0] + y * a->strides[1] + x * a->strides[2]] : 0;
+                }
+            }
+            sandwich(bt, alpha, alpha, d, alpha, bt, t);
+            int tile = ty * w->tiles_w + tx;
+            for (int xi = 0; xi < alpha * alpha; xi++) {
+                w->v[(xi * w->depth + c) * w->tiles + tile] = t[xi];
+            }
+        }
+    }
+}
+
+static void transform_products(void *arg, int begin, int end){
+    WinogradArgs *w = arg;
+    ndarray *u = w->u;
+    // One (filter_num, depth) x (depth, tiles) product per transform coordinate.
+    for (int xi = begin; xi < end; xi++) {
+        sgemm(w->filter_num, w->tiles, w->depth, 1,
+              u->data + xi * u->strides[0], u->strides[1], u->strides[2],
+              w->v + xi * w->depth * w->tiles, w->tiles, 1,
+              0, w->p + xi * w->filter_num * w->tiles, w->tiles, 1);
+    }
+}
+
+static void output_transform(void *arg, int begin, int end){
+    WinogradArgs *w = arg;
+    ndarray *out = w->out;
+    int m = w->m, alpha = w->alpha;
+    const float *at = m == 2 ? AT2 : AT4;
+    float t[MAX_ALPHA * MAX_ALPHA], y_tile[MAX_ALPHA * MAX_ALPHA];
+    for (int row = begin; row < end; row++) {
+        int n = row / w->tiles_h, ty = row % w->tiles_h;
+        for (int tx = 0; tx < w->tiles_w; tx++) {
+            int tile = ty * w->tiles_w + tx;
+            for (int xi = 0; xi < alpha * alpha; xi++) {
+                t[xi] = w->p[(xi * w->filter_num + n) * w->tiles + tile];
+            }
+            sandwich(at, m, alpha, t, m, at, y_tile);
+            // Clip the last row and column of tiles to the output.
+            for (int i = 0; i < m && ty * m + i < out->shape[1]; i++) {
+                for (int j = 0; j < m && tx * m + j < out->shape[2]; j++) {
+                    out->data[n * out->strides[0] + (ty * m + i) * out->strides[1] + (tx * m + j) * out->strides[2]] = y_tile[i * m + j];
+                }
+            }
+        }
+    }
+}
+
+void nda_conv3d_winograd(ndarray *a, ndarray *u, int m, int pad, ndarray *out){
+    check_tile(m);
+    int alpha = m + 2;
+    int depth = a->shape[0], filter_num = u->shape[1];
+    if (a->ndim != 3 || u->ndim != 3 || out->ndim != 3
+        || u->shape[0] != alpha * alpha || u->shape[2] != depth || out->shape[0] != filter_num
+        || out->shape[1] != a->shape[1] + 2 * pad - 2
+        || out->shape[2] != a->shape[2] + 2 * pad - 2) {
+        fprintf(stderr, "ndarray shape mismatch for winograd conv3d\n");
+        exit(1);
+    }
+    int tiles_h = (out->shape[1] + m - 1) / m;
+    int tiles_w = (out->shape[2] + m - 1) / m;
+    int tiles = tiles_h * tiles_w;
+
+    Arena *ws = nda_workspace();
+    ArenaMark mark = arena_mark(ws);
+    // v : (alpha * alpha, depth, tiles), transformed input tiles.
+    // p : (alpha * alpha, filter_num, tiles), their products with the filters.
+    WinogradArgs w = {a, u, out, m, alpha, pad, depth, filter_num, tiles_h, tiles_w, tiles,
+                      arena_alloc(ws, alpha * alpha * depth * tiles * sizeof(float)),
+                      arena_alloc(ws, alpha * alpha * filter_num * tiles * sizeof(float))};
+    nda_parallel_for(depth * tiles_h, 1, input_transform, &w);
+    nda_parallel_for(alpha * alpha, 1, transform_products, &w);
+    nda_parallel_for(filter_num * tiles_h, 1, output_transform, &w);
+    arena_release(ws, mark);
+}
@@ -0,0 +1,72 @@
+#include "cnn.h"
+#include "layer.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+
+// Counting allocator installed through the library allocation hooks, called
+// from the pool workers too.
+static atomic_int alloc_count = 0;
+
+static void *counting_alloc(size_t alignment, size_t size){
+    alloc_count++;
+    return aligned_alloc(alignment, size);
+}
+
+static void train_step(CNN *network, ndarray *input, ndarray *target, ndarray *output, int sharded){
+    if (sharded) {
+        network_train_batch(network, input, target, output);
+    } else {
+        network_forward(network, input, output);
+        network_backward(network, target);
+        network_update(network);
+    }
+}
+
+// Heap allocations in 20 training steps on a batch of samples of class 4,
+// after the first steps have initialized the layers and sized the workspaces.
+static int steady_state_allocations(int batch, int sharded){
+    CNN *network = create_network(0.01);
+    ndarray *input = nda_zero(4, (int[]){batch, 1, 20, 20});
+    ndarray *target = nda_zero(2, (int[]){10, batch});
+    ndarray *output = nda_zero(2, (int[]){10, batch});
+    nda_init_rand(input);
+    for (int i = 0; i < batch; i++) {
+        target->data[4 * batch + i] = 1;
+    }
+
+    atomic_store(&alloc_count, 0);
+    for (int i = 0; i < 3; i++) {
+        train_step(network, input, target, output, sharded);
+    }
+    int warmup = atomic_load(&alloc_count);
+
+    atomic_store(&alloc_count, 0);
+    for (int i = 0; i < 20; i++) {
+        train_step(network, input, target, output, sharded);
+    }
+    int steady = atomic_load(&alloc_count);
+    printf("%s: %d allocations during warm-up, %d in 20 steady-state steps\n",
+           sharded ? "network_train_batch" : "forward/backward/update", warmup, steady);
+
+    free_network(network);
+    nda_free(input);
+    nda_free(target);
+    nda_free(output);
+    return steady;
+}
+
+int main(){
+    nda_set_allocator(counting_alloc, free);
+    // Several threads: the pool workers need their workspaces too.
+    nda_set_num_threads(4);
+
+    // A shard of 2 samples per replica for network_train_batch.
+    if (steady_state_allocations(4, 0) != 0 || steady_state_allocations(8, 1) != 0) {
+        fprintf(stderr, "heap allocations during steady-state training\n");
+        return 1;
+    }
+    return 0;
+}
@@ -4,15 +4,101 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <math.h>
+
+// Loss sum(output * weights) / batch of a conv layer on a batch.
+static float conv_loss(ConvLayer *layer, ndarray *input, ndarray *output, ndarray *weights){
+    layer->forward(layer, input, output);
+    float loss = 0;
+    for (int i = 0; i < output->size; i++) {
+        loss += output->data[i] * weights->data[i];
+    }
+    return loss / input->shape[0];
+}
+
+// The per-channel bias gradient of a conv layer agrees with finite
+// differences of the loss.
+static int check_conv_bias_grad(){
+    ConvLayer *layer = create_conv_layer(4, 3, NONE);
+    ndarray *input = nda_zero(4, (int[]){2, 1, 20, 20});
+    ndarray *output = nda_zero(4, (int[]){2, 4, 18, 18});
+    ndarray *output_grad = nda_zero(4, (int[]){2, 4, 18, 18});
+    nda_init_rand(input);
+    nda_init_rand(output_grad);
+    conv_loss(layer, input, output, output_grad);
+    layer->backward(layer, output_grad, NULL);
+
+    float eps = 1e-2f, max_err = 0;
+    for (int c = 0; c < layer->kernel_num; c++) {
+        float b = layer->bias->data[c];
+        layer->bias->data[c] = b + eps;
+        float plus = conv_loss(layer, input, output, output_grad);
+        layer->bias->data[c] = b - eps;
+        float minus = conv_loss(layer, input, output, output_grad);
+        layer->bias->data[c] = b;
+        float numeric = (plus - minus) / (2 * eps);
+        float err = fabsf(numeric - layer->bias_grad->data[c]) / fmaxf(1, fabsf(numeric));
+        max_err = err > max_err ? err : max_err;
+    }
+    printf("conv channel bias gradient: %d values, max relative error %g\n", layer->bias->size, max_err);
+
+    int ok = layer->channel_bias && layer->bias->size == layer->kernel_num && max_err < 1e-2f;
+    free_conv_layer(layer);
+    nda_free(input), nda_free(output), nda_free(output_grad);
+    return ok;
+}
+
+static float max_diff(ndarray *a, ndarray *b){
+    float err = 0;
+    for (int i = 0; i < a->size; i++) {
+        err = fmaxf(err, fabsf(a->data[i] - b->data[i]));
+    }
+    return err;
+}
+
+// A layer selects its algorithm again for inputs of another size: one that
+// picked the FFT for small inputs convolves larger ones like a layer that
+// only saw those, and still runs inference on the small ones.
+static int check_conv_resize(){
+    ConvLayer *layer = create_conv_layer(8, 11, NONE), *fresh = create_conv_layer(8, 11, NONE);
+    init_conv_layer(layer, 2, 22, 22);
+    share_conv_layer(fresh, layer);
+    ndarray *small = nda_zero(4, (int[]){1, 2, 32, 32}), *large = nda_zero(4, (int[]){1, 2, 40, 40});
+    ndarray *small_out = nda_zero(4, (int[]){1, 8, 22, 22}), *small_infer = nda_zero(4, (int[]){1, 8, 22, 22});
+    ndarray *large_out = nda_zero(4, (int[]){1, 8, 30, 30}), *expected = nda_zero(4, (int[]){1, 8, 30, 30});
+    nda_init_rand(small);
+    nda_init_rand(large);
+
+    layer->forward(layer, small, small_out);
+    int fft = layer->algorithm == CONV_FFT;
+    layer->forward(layer, large, large_out);
+    fresh->forward(fresh, large, expected);
+    infer_conv_layer(layer, small, small_infer);
+    float err = fmaxf(max_diff(large_out, expected), max_diff(small_infer, small_out));
+    printf("conv layer on a larger input: fft first %d, max error %g\n", fft, err);
+
+    free_conv_layer(layer), free_conv_layer(fresh);
+    nda_free(small), nda_free(large), nda_free(small_out), nda_free(small_infer);
+    nda_free(large_out), nda_free(expected);
+    return fft && err < 1e-3f;
+}
 
 int main(){
+    if (!check_conv_resize()) {
+        fprintf(stderr, "conv layer differs after a change of input size\n");
+        return 1;
+    }
+    if (!check_conv_bias_grad()) {
+        fprintf(stderr, "conv bias gradient differs from finite differences\n");
+        return 1;
+    }
     srand(time(NULL));
 
     time_t current_time;
     time(&current_time);
     struct tm *local_time = localtime(&current_time);
 
-    char networkname[50];
+    char networkname[100];
     sprintf(networkname, "../models/test_%d_%d_%d_%d_%d_%d.txt", 
             local_time->tm_year+1900, local_time->tm_mon+1, local_time->tm_mday,
             local_time->tm_hour, local_time->tm_min, local_time->tm_sec);
@@ -0,0 +1,143 @@
+#include "dataset.h"
+#include "prefetch.h"
+#include "misc.h"
+#include "threadpool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define IMAGE_SIZE 20
+
+// Prefetched batches hold the samples of dataset_batch in order, or every
+// label as often as the dataset per epoch when shuffled.
+static int check_prefetch(Dataset *dataset){
+    int mismatches = 0;
+    ndarray *expected = nda_zero(2, (int[]){IMAGE_SIZE * IMAGE_SIZE, 64});
+    ndarray *expected_targets = nda_zero(2, (int[]){10, 64});
+    Prefetcher *prefetcher = create_prefetcher(dataset, 2, (int[]){IMAGE_SIZE * IMAGE_SIZE, 64}, 10, 3, 0);
+    for (int start = 0; start < dataset->num; start += 64) {
+        Batch *batch = next_batch(prefetcher);
+        ndarray *x = nda_slice(expected, 1, 0, batch->size);
+        ndarray *t = nda_slice(expected_targets, 1, 0, batch->size);
+        dataset_batch(dataset, NULL, start, x, t);
+        for (int i = 0; i < x->size; i++) {
+            int r = i / batch->size, c = i % batch->size;
+            mismatches += x->data[r * x->strides[0] + c] != batch->inputs->data[r * batch->inputs->strides[0] + c];
+        }
+        for (int i = 0; i < batch->size; i++) {
+            mismatches += batch->labels[i] != dataset->labels[start + i] || batch->epoch != 0;
+            mismatches += batch->targets->data[batch->labels[i] * batch->targets->strides[0] + i] != 1;
+        }
+        nda_free(x), nda_free(t);
+    }
+    free_prefetcher(prefetcher);
+
+    // Two shuffled epochs, then stop while the producer waits on a full ring.
+    int *counts = calloc(10, sizeof(int)), *expected_counts = calloc(10, sizeof(int));
+    for (int i = 0; i < dataset->num; i++) {
+        expected_counts[dataset->labels[i]] += 2;
+    }
+    prefetcher = create_prefetcher(dataset, 4, (int[]){50, 1, IMAGE_SIZE, IMAGE_SIZE}, 10, 2, 1);
+    int batches = 2 * ((dataset->num + 49) / 50), samples = 0;
+    for (int b = 0; b < batches; b++) {
+        Batch *batch = next_batch(prefetcher);
+        mismatches += batch->epoch != b / ((dataset->num + 49) / 50);
+        mismatches += batch->inputs->shape[0] != batch->size || batch->inputs->size != batch->size * IMAGE_SIZE * IMAGE_SIZE;
+        mismatches += batch->targets->shape[1] != batch->size || batch->targets->size != batch->size * 10;
+        for (int i = 0; i < batch->size; i++) {
+            counts[batch->labels[i]]++;
+        }
+        samples += batch->size;
+    }
+    next_batch(prefetcher);
+    free_prefetcher(prefetcher);
+    for (int c = 0; c < 10; c++) {
+        mismatches += counts[c] != expected_counts[c];
+    }
+    mismatches += samples != 2 * dataset->num;
+    printf("prefetched batches: %d mismatches\n", mismatches);
+
+    free(counts), free(expected_counts);
+    nda_free(expected), nda_free(expected_targets);
+    return mismatches == 0;
+}
+
+// A packed dataset holds the images and labels read_data reads, and its
+// batches match those of data_batch, for the matrix and the 4D layouts.
+int main(){
+    const char *index = "../datasets/mnist_20x20/val_labels.txt", *packed = "test_dataset.bin";
+    int num = pack_dataset(index, 2, (int[]){IMAGE_SIZE, IMAGE_SIZE}, packed);
+    Dataset *dataset = open_dataset(packed);
+    ndarray **images = malloc(num * sizeof(ndarray *));
+    int *labels = malloc(num * sizeof(int));
+    read_data(index, images, labels, num, IMAGE_SIZE, 2, (int[]){IMAGE_SIZE * IMAGE_SIZE, 1});
+
+    int mismatches = dataset->num != num || dataset->sample_size != IMAGE_SIZE * IMAGE_SIZE;
+    for (int i = 0; i < num && !mismatches; i++) {
+        const uint8_t *sample = dataset_sample(dataset, i);
+        mismatches += dataset->labels[i] != labels[i];
+        for (int j = 0; j < dataset->sample_size; j++) {
+            mismatches += sample[j] != images[i]->data[j];
+        }
+    }
+    printf("packed dataset: %d samples, %d mismatches\n", dataset->num, mismatches);
+
+    // The parallel text loader reads the same images.
+    ndarray **loaded = malloc(num * sizeof(ndarray *));
+    int *loaded_labels = malloc(num * sizeof(int));
+    nda_set_num_threads(3);
+    ndarray *data = read_data_parallel(index, loaded, loaded_labels, num, IMAGE_SIZE, 3, (int[]){1, IMAGE_SIZE, IMAGE_SIZE});
+    nda_set_num_threads(0);
+    int load_mismatches = 0;
+    for (int i = 0; i < num; i++) {
+        load_mismatches += loaded_labels[i] != labels[i] || loaded[i]->ndim != 3;
+        load_mismatches += memcmp(loaded[i]->data, images[i]->data, images[i]->size * sizeof(float)) != 0;
+        nda_free(loaded[i]);
+    }
+    nda_free(data);
+    free(loaded), free(loaded_labels);
+    printf("parallel text loader: %d mismatches\n", load_mismatches);
+
+    // Read into memory as bytes, the images are those of the packed file.
+    nda_set_num_threads(3);
+    Dataset *in_memory = read_dataset(index, num, 2, (int[]){IMAGE_SIZE * IMAGE_SIZE, 1});
+    nda_set_num_threads(0);
+    int memory_mismatches = in_memory->map != NULL || in_memory->num != num
+        || in_memory->sample_size != dataset->sample_size;
+    memory_mismatches += memcmp(in_memory->labels, dataset->labels, num * sizeof(int32_t)) != 0;
+    memory_mismatches += memcmp(in_memory->samples, dataset->samples, (size_t)num * dataset->sample_size) != 0;
+    close_dataset(in_memory);
+    printf("dataset read into memory: %d mismatches\n", memory_mismatches);
+
+    // Batches of shuffled samples.
+    int order[7] = {5, 700, 3, 42, 0, 749, 100};
+    ndarray *shuffled[7];
+    int shuffled_labels[7];
+    for (int i = 0; i < 7; i++) {
+        shuffled[i] = images[order[i]];
+        shuffled_labels[i] = labels[order[i]];
+    }
+    int batch_mismatches = 0;
+    int shapes[2][4] = {{IMAGE_SIZE * IMAGE_SIZE, 7}, {7, 1, IMAGE_SIZE, IMAGE_SIZE}};
+    for (int layout = 0; layout < 2; layout++) {
+        int ndim = layout == 0 ? 2 : 4;
+        ndarray *expected = nda_zero(ndim, shapes[layout]), *inputs = nda_zero(ndim, shapes[layout]);
+        ndarray *expected_targets = nda_zero(2, (int[]){10, 7}), *targets = nda_zero(2, (int[]){10, 7});
+        data_batch(shuffled, shuffled_labels, 0, expected, expected_targets);
+        dataset_batch(dataset, order, 0, inputs, targets);
+        batch_mismatches += memcmp(expected->data, inputs->data, inputs->size * sizeof(float)) != 0;
+        batch_mismatches += memcmp(expected_targets->data, targets->data, targets->size * sizeof(float)) != 0;
+        nda_free(expected), nda_free(inputs), nda_free(expected_targets), nda_free(targets);
+    }
+    printf("packed batches: %d mismatches\n", batch_mismatches);
+    int prefetched = check_prefetch(dataset);
+
+    for (int i = 0; i < num; i++) {
+        nda_free(images[i]);
+    }
+    free(images), free(labels);
+    close_dataset(dataset);
+    remove(packed);
+    return mismatches != 0 || load_mismatches != 0 || memory_mismatches != 0 || batch_mismatches != 0 || !prefetched;
+}
@@ -1,8 +1,15 @@
 #include "ndarray.h"
+#include "simd.h"
+#include "gemm.h"
+#include "threadpool.h"
 
 #include <stdio.h>
 #include <time.h>
 #include <stdlib.h>
+#include <math.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
 
 void test_cal(){
     ndarray *a = nda_zero(3, (int[]){2, 3, 2});
@@ -45,13 +52,49 @@ void test_reshape(){
     // nda_print_mat(a);
     printf("\n");
 
-    nda_reshape(a, 2, (int[]){3, 4});
-    nda_print_mat(a);
+    ndarray *b = nda_reshape(a, 2, (int[]){3, 4});
+    nda_print_mat(b);
     printf("\n");
 
+    nda_free(b);
     nda_free(a);
 }
 
+void test_view(){
+    ndarray *a = nda_zero(2, (int[]){3, 4});
+    nda_init_data(a, (float[]){0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11});
+
+    // Columns 1 and 2, a strided (3, 2) view.
+    ndarray *cols = nda_slice(a, 1, 1, 3);
+    ndarray *out = nda_zero(2, (int[]){3, 2});
+    nda_add_scalar(cols, 100, out);
+    float expected[6] = {101, 102, 105, 106, 109, 110};
+    int ok = !nda_is_contiguous(cols) && nda_sum(cols) == 33;
+    // A deep copy of the view is packed and aligned.
+    ndarray *copy = nda_deepcopy(cols);
+    ok = ok && nda_is_contiguous(copy) && (size_t)copy->data % NDA_ALIGN == 0 && copy->data[3] == 6;
+    nda_free(copy);
+    for (int i = 0; i < 6; i++) {
+        ok = ok && out->data[i] == expected[i];
+    }
+    // Writes through the view land in the parent.
+    nda_mul_scalar(cols, 0, cols);
+    ok = ok && a->data[0] == 0 && a->data[1] == 0 && a->data[2] == 0 && a->data[3] == 3 && nda_sum(a) == 33;
+
+    ndarray *flat = nda_reshape(a, 2, (int[]){12, 1});
+    ok = ok && flat->data == a->data && nda_argmax(flat) == 11;
+
+    nda_free(flat);
+    nda_free(out);
+    nda_free(cols);
+    nda_free(a);
+    if (!ok) {
+        fprintf(stderr, "view mismatch\n");
+        exit(1);
+    }
+    printf("view: ok\n");
+}
+
 // void test_conv3d(){
 //     ndarray *a = nda_zero(3, (int[]){3, 3, 3});
 //     ndarray *b = nda_zero(4, (int[]){1, 3, 2, 2});
@@ -124,6 +167,600 @@ void test_flip(){
     nda_free(a);
 }
 
+void test_gemm(){
+    // Compare nda_gemm with a naive loop for every transpose combination,
+    // with shapes that are not multiples of the register tile.
+    int shapes[][3] = {{1, 7, 5}, {9, 1, 4}, {13, 17, 1}, {67, 45, 300}, {256, 130, 400}};
+    float max_err = 0;
+    for (int s = 0; s < 5; s++) {
+        int m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+        for (int t = 0; t < 4; t++) {
+            TransposeType ta = t & 1 ? TRANS : NO_TRANS, tb = t & 2 ? TRANS : NO_TRANS;
+            ndarray *a = ta == TRANS ? nda_zero(2, (int[]){k, m}) : nda_zero(2, (int[]){m, k});
+            ndarray *b = tb == TRANS ? nda_zero(2, (int[]){n, k}) : nda_zero(2, (int[]){k, n});
+            ndarray *out = nda_zero(2, (int[]){m, n});
+            nda_init_rand(a);
+            nda_init_rand(b);
+            nda_init_rand(out);
+            ndarray *ref = nda_deepcopy(out);
+
+            nda_gemm(ta, tb, 0.5, a, b, 2, out);
+            for (int i = 0; i < m; i++) {
+                for (int j = 0; j < n; j++) {
+                    float sum = 0;
+                    for (int p = 0; p < k; p++) {
+                        float aip = ta == TRANS ? a->data[p * m + i] : a->data[i * k + p];
+                        float bpj = tb == TRANS ? b->data[j * k + p] : b->data[p * n + j];
+                        sum += aip * bpj;
+                    }
+                    float err = fabsf(0.5f * sum + 2.0f * ref->data[i * n + j] - out->data[i * n + j]);
+                    max_err = err > max_err ? err : max_err;
+                }
+            }
+            nda_free(a);
+            nda_free(b);
+            nda_free(out);
+            nda_free(ref);
+        }
+    }
+    printf("gemm max error: %e\n", max_err);
+    if (max_err > 1e-3) {
+        fprintf(stderr, "gemm mismatch\n");
+        exit(1);
+    }
+}
+
+void test_dot_bias(){
+    // Compare the fused bias and ReLU of nda_dot_bias with separate passes,
+    // for a single column, a single K panel and several panels.
+    int shapes[][3] = {{256, 1, 400}, {13, 17, 9}, {300, 40, 600}};
+    float max_err = 0;
+    for (int s = 0; s < 3; s++) {
+        int m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+        ndarray *a = nda_zero(2, (int[]){m, k});
+        ndarray *b = nda_zero(2, (int[]){k, n});
+        ndarray *bias = nda_zero(2, (int[]){m, 1});
+        ndarray *out = nda_zero(2, (int[]){m, n});
+        ndarray *ref = nda_zero(2, (int[]){m, n});
+        nda_init_rand(a);
+        nda_init_rand(b);
+        nda_init_rand(bias);
+        nda_sub_scalar(a, 0.5, a);
+        for (int relu = 0; relu < 2; relu++) {
+            nda_dot_bias(a, b, bias, relu, out);
+            nda_dot(a, b, ref);
+            nda_add_cols(ref, bias, ref);
+            if (relu) {
+                nda_relu(ref, ref);
+            }
+            for (int i = 0; i < out->size; i++) {
+                float err = fabsf(out->data[i] - ref->data[i]);
+                max_err = err > max_err ? err : max_err;
+            }
+        }
+        nda_free(a);
+        nda_free(b);
+        nda_free(bias);
+        nda_free(out);
+        nda_free(ref);
+    }
+    printf("dot bias max error: %e\n", max_err);
+    if (max_err > 1e-3) {
+        fprintf(stderr, "dot bias mismatch\n");
+        exit(1);
+    }
+}
+
+void test_gemm_u8(){
+    // Compare sgemm_u8_bias on bytes stored sample by sample, as a dataset
+    // holds them, with sgemm_bias on the same values scaled to floats.
+    int shapes[][3] = {{256, 1, 400}, {13, 17, 9}, {300, 70, 600}};
+    float scale = 1.0f / 255;
+    float max_err = 0;
+    for (int s = 0; s < 3; s++) {
+        int m = shapes[s][0], n = shapes[s][1], k = shapes[s][2];
+        ndarray *a = nda_zero(2, (int[]){m, k});
+        ndarray *b = nda_zero(2, (int[]){k, n});
+        ndarray *bias = nda_zero(2, (int[]){m, 1});
+        ndarray *out = nda_zero(2, (int[]){m, n});
+        ndarray *ref = nda_zero(2, (int[]){m, n});
+        uint8_t *bytes = malloc((size_t)k * n);
+        nda_init_rand(a);
+        nda_init_rand(bias);
+        nda_sub_scalar(a, 0.5, a);
+        for (int j = 0; j < n; j++) {
+            for (int p = 0; p < k; p++) {
+                bytes[j * k + p] = rand() % 256;
+                b->data[p * n + j] = bytes[j * k + p] * scale;
+            }
+        }
+        for (int relu = 0; relu < 2; relu++) {
+            sgemm_u8_bias(m, n, k, a->data, k, 1, bytes, 1, k, scale, bias->data, relu, out->data, n, 1);
+            sgemm_bias(m, n, k, a->data, k, 1, b->data, n, 1, bias->data, relu, ref->data, n, 1);
+            for (int i = 0; i < out->size; i++) {
+                float err = fabsf(out->data[i] - ref->data[i]);
+                max_err = err > max_err ? err : max_err;
+            }
+        }
+        free(bytes);
+        nda_free(a);
+        nda_free(b);
+        nda_free(bias);
+        nda_free(out);
+        nda_free(ref);
+    }
+    printf("gemm u8 max error: %e\n", max_err);
+    if (max_err > 1e-3) {
+        fprintf(stderr, "gemm u8 mismatch\n");
+        exit(1);
+    }
+}
+
+void test_softmax_cross_entropy(){
+    // Compare the softmax of the columns and the fused loss and gradient
+    // with double precision, for batches that are not multiples of the
+    // vector width nor of the column block.
+    int batches[] = {1, 13, 203};
+    float max_err = 0, loss_err = 0;
+    for (int s = 0; s < 3; s++) {
+        int rows = 10, batch = batches[s];
+        ndarray *a = nda_zero(2, (int[]){rows, batch});
+        ndarray *pr = nda_zero(2, (int[]){rows, batch});
+        ndarray *tr = nda_zero(2, (int[]){rows, batch});
+        ndarray *grad = nda_zero(2, (int[]){rows, batch});
+        nda_init_rand(a);
+        nda_mul_scalar(a, 40, a);
+        for (int j = 0; j < batch; j++) {
+            tr->data[(j % rows) * batch + j] = 1;
+        }
+        nda_softmax(a, pr);
+        float loss = nda_softmax_cross_entropy(pr, tr, grad);
+        double ref_loss = 0;
+        for (int j = 0; j < batch; j++) {
+            double max = a->data[j], sum = 0;
+            for (int i = 1; i < rows; i++) {
+                max = a->data[i * batch + j] > max ? a->data[i * batch + j] : max;
+            }
+            for (int i = 0; i < rows; i++) {
+                sum += exp(a->data[i * batch + j] - max);
+            }
+            for (int i = 0; i < rows; i++) {
+                double p = exp(a->data[i * batch + j] - max) / sum, t = tr->data[i * batch + j];
+                float err = fabs(pr->data[i * batch + j] - p) + fabs(grad->data[i * batch + j] - (p - t));
+                max_err = err > max_err ? err : max_err;
+                ref_loss -= t * log(p > 1e-8 ? p : 1e-8);
+            }
+        }
+        ref_loss /= rows * batch;
+        float err = fabs(loss - ref_loss) / ref_loss;
+        loss_err = err > loss_err ? err : loss_err;
+        nda_free(a);
+        nda_free(pr);
+        nda_free(tr);
+        nda_free(grad);
+    }
+    printf("softmax max error: %e, cross entropy relative error: %e\n", max_err, loss_err);
+    if (max_err > 1e-5 || loss_err > 1e-5) {
+        fprintf(stderr, "softmax cross entropy mismatch\n");
+        exit(1);
+    }
+}
+
+void test_broadcast(){
+    // Compare broadcast sub and div (not commutative) with a naive loop over
+    // the output, for a repeated along the rows, b along the columns, a
+    // per-channel b, a scalar b and a repeated along the last axis.
+    int shapes[][3][3] = {
+        // out, a, b; 0 for a missing leading axis
+        {{3, 70, 9}, {1, 70, 9}, {0, 70, 1}},
+        {{4, 5, 6}, {4, 5, 6}, {4, 1, 1}},
+        {{2, 3, 33}, {0, 1, 33}, {0, 0, 1}},
+        {{3, 70, 9}, {0, 70, 1}, {1, 70, 9}},
+    };
+    float max_err = 0;
+    for (int s = 0; s < 4; s++) {
+        ndarray *arr[3];
+        for (int k = 0; k < 3; k++) {
+            int ndim = shapes[s][k][0] == 0 ? (shapes[s][k][1] == 0 ? 1 : 2) : 3;
+            arr[k] = nda_zero(ndim, shapes[s][k] + 3 - ndim);
+            nda_init_rand(arr[k]);
+            nda_add_scalar(arr[k], 0.5, arr[k]);
+        }
+        ndarray *out = arr[0], *a = arr[1], *b = arr[2];
+        for (int op = 0; op < 2; op++) {
+            op == 0 ? nda_sub(a, b, out) : nda_div(a, b, out);
+            for (int i = 0; i < out->size; i++) {
+                // Index of element i of out in a broadcast operand.
+                int ia = 0, ib = 0, r = i;
+                for (int d = 2; d >= 0; d--) {
+                    int index = r % out->shape[d];
+                    r /= out->shape[d];
+                    int da = d - 3 + a->ndim, db = d - 3 + b->ndim;
+                    if (da >= 0 && a->shape[da] > 1) {
+                        ia += index * a->strides[da];
+                    }
+                    if (db >= 0 && b->shape[db] > 1) {
+                        ib += index * b->strides[db];
+                    }
+                }
+                float ref = op == 0 ? a->data[ia] - b->data[ib] : a->data[ia] / b->data[ib];
+                float err = fabsf(out->data[i] - ref);
+                max_err = err > max_err ? err : max_err;
+            }
+        }
+        nda_free(out);
+        nda_free(a);
+        nda_free(b);
+    }
+    printf("broadcast max error: %e\n", max_err);
+    if (max_err > 1e-6) {
+        fprintf(stderr, "broadcast mismatch\n");
+        exit(1);
+    }
+}
+
+static float max_abs_diff(int n, const float *a, const float *b){
+    float max = 0;
+    for (int i = 0; i < n; i++) {
+        float d = fabsf(a[i] - b[i]);
+        max = d > max ? d : max;
+    }
+    return max;
+}
+
+void test_simd(){
+    // Cross-check every kernel of every instruction set the CPU supports
+    // with the scalar ones, on lengths around the vector widths and long
+    // enough for the pairwise sum to split.
+    int sizes[] = {1, 3, 4, 7, 8, 15, 16, 17, 33, 100, 1000, 4099, 100003};
+    int max_n = 100003;
+    float *a = malloc(max_n * sizeof(float)), *b = malloc(max_n * sizeof(float));
+    float *p = malloc(max_n * sizeof(float)), *t = malloc(max_n * sizeof(float));
+    float *ref = malloc(max_n * sizeof(float)), *out = malloc(max_n * sizeof(float));
+    float *ref_sum = malloc(max_n * sizeof(float)), *out_sum = malloc(max_n * sizeof(float));
+    for (int i = 0; i < max_n; i++) {
+        a[i] = (float)rand() / RAND_MAX * 20 - 10;
+        b[i] = (float)rand() / RAND_MAX + 0.5f;
+        p[i] = (float)rand() / RAND_MAX;
+        t[i] = (float)rand() / RAND_MAX;
+    }
+    // Ties: the first occurrence of the maximum wins.
+    a[5000] = a[6000] = 11;
+
+    const SimdKernels *scalar = simd_kernels_for(SIMD_SCALAR);
+    printf("simd kernels bound: %s\n", simd_kernels()->name);
+    for (SimdIsa isa = SIMD_SSE42; isa < SIMD_ISA_COUNT; isa++) {
+        const SimdKernels *k = simd_kernels_for(isa);
+        if (k == NULL) {
+            printf("simd %d not supported, skipped\n", isa);
+            continue;
+        }
+        float max_err = 0, sum_err = 0;
+        int index_err = 0;
+        for (int s = 0; s < 13; s++) {
+            int n = sizes[s];
+            void (*binary[][2])(int, const float *, const float *, float *) = {
+                {scalar->add, k->add}, {scalar->sub, k->sub}, {scalar->mul, k->mul}, {scalar->div, k->div},
+                {scalar->relu_grad, k->relu_grad},
+            };
+            for (int f = 0; f < 5; f++) {
+                binary[f][0](n, a, b, ref);
+                binary[f][1](n, a, b, out);
+                max_err = fmaxf(max_err, max_abs_diff(n, ref, out));
+            }
+            void (*with_scalar[][2])(int, const float *, float, float *) = {
+                {scalar->add_scalar, k->add_scalar}, {scalar->sub_scalar, k->sub_scalar},
+                {scalar->mul_scalar, k->mul_scalar}, {scalar->div_scalar, k->div_scalar},
+            };
+            for (int f = 0; f < 4; f++) {
+                with_scalar[f][0](n, a, 1.5f, ref);
+                with_scalar[f][1](n, a, 1.5f, out);
+                max_err = fmaxf(max_err, max_abs_diff(n, ref, out));
+            }
+            void (*unary[][2])(int, const float *, float *) = {
+                {scalar->relu, k->relu}, {scalar->relu_prime, k->relu_prime},
+            };
+            for (int f = 0; f < 2; f++) {
+                unary[f][0](n, a, ref);
+                unary[f][1](n, a, out);
+                max_err = fmaxf(max_err, max_abs_diff(n, ref, out));
+            }
+            memcpy(ref, b, n * sizeof(float));
+            memcpy(out, b, n * sizeof(float));
+            scalar->axpy(n, -0.3f, a, ref);
+            k->axpy(n, -0.3f, a, out);
+            max_err = fmaxf(max_err, max_abs_diff(n, ref, out));
+
+            memset(ref_sum, 0, n * sizeof(float));
+            memset(out_sum, 0, n * sizeof(float));
+            scalar->exp_row(n, a, b, ref, ref_sum);
+            k->exp_row(n, a, b, out, out_sum);
+            for (int i = 0; i < n; i++) {
+                max_err = fmaxf(max_err, fabsf(ref[i] - out[i]) / ref[i]);
+            }
+            float ref_xent = scalar->xent(n, p, t, ref), out_xent = k->xent(n, p, t, out);
+            max_err = fmaxf(max_err, max_abs_diff(n, ref, out));
+            sum_err = fmaxf(sum_err, fabsf(ref_xent - out_xent) / fabsf(ref_xent));
+
+            double exact = 0;
+            for (int i = 0; i < n; i++) {
+                exact += a[i];
+            }
+            sum_err = fmaxf(sum_err, fabs(k->sum(n, a) - exact) / n);
+            max_err = fmaxf(max_err, fabsf(scalar->max(n, a) - k->max(n, a)));
+            index_err += scalar->argmax(n, a) != k->argmax(n, a);
+        }
+        printf("simd %s max error: %e, sum error: %e, argmax mismatches: %d\n", k->name, max_err, sum_err, index_err);
+        if (max_err > 1e-5 || sum_err > 1e-5 || index_err) {
+            fprintf(stderr, "simd %s mismatch\n", k->name);
+            exit(1);
+        }
+    }
+    free(a), free(b), free(p), free(t), free(ref), free(out), free(ref_sum), free(out_sum);
+}
+
+void test_conv3d_gemm(){
+    // Compare the im2col convolution with per-channel nda_conv2d sums.
+    ndarray *a = nda_zero(3, (int[]){3, 11, 9});
+    ndarray *b = nda_zero(4, (int[]){5, 3, 3, 2});
+    ndarray *out = nda_zero(3, (int[]){5, 9, 8});
+    ndarray *mat = nda_zero(2, (int[]){11, 9});
+    ndarray *filter = nda_zero(2, (int[]){3, 2});
+    ndarray *tmp = nda_zero(2, (int[]){9, 8});
+    nda_init_rand(a);
+    nda_init_rand(b);
+
+    nda_conv3d(a, b, out);
+    float max_err = 0;
+    for (int n = 0; n < 5; n++) {
+        float ref[9 * 8] = {0};
+        for (int c = 0; c < 3; c++) {
+            memcpy(mat->data, a->data + c * a->strides[0], mat->size * sizeof(float));
+            memcpy(filter->data, b->data + n * b->strides[0] + c * b->strides[1], filter->size * sizeof(float));
+            nda_conv2d(mat, filter, tmp);
+            for (int i = 0; i < tmp->size; i++) {
+                ref[i] += tmp->data[i];
+            }
+        }
+        for (int i = 0; i < tmp->size; i++) {
+            float err = fabsf(ref[i] - out->data[n * out->strides[0] + i]);
+            max_err = err > max_err ? err : max_err;
+        }
+    }
+    printf("conv3d max error: %e\n", max_err);
+    if (max_err > 1e-4) {
+        fprintf(stderr, "conv3d mismatch\n");
+        exit(1);
+    }
+
+    nda_free(a);
+    nda_free(b);
+    nda_free(out);
+    nda_free(mat);
+    nda_free(filter);
+    nda_free(tmp);
+}
+
+void test_conv3d_grad(){
+    // Compare the GEMM/col2im gradients with their direct definitions.
+    int C = 2, H = 8, W = 7, K = 4, KH = 3, KW = 2;
+    int OH = H - KH + 1, OW = W - KW + 1;
+    ndarray *a = nda_zero(3, (int[]){C, H, W});
+    ndarray *b = nda_zero(4, (int[]){K, C, KH, KW});
+    ndarray *dy = nda_zero(3, (int[]){K, OH, OW});
+    ndarray *col = nda_zero(2, (int[]){C * KH * KW, OH * OW});
+    ndarray *col_grad = nda_zero(2, (int[]){C * KH * KW, OH * OW});
+    ndarray *db = nda_zero(4, (int[]){K, C, KH, KW});
+    ndarray *da = nda_zero(3, (int[]){C, H, W});
+    nda_init_rand(a);
+    nda_init_rand(b);
+    nda_init_rand(dy);
+
+    nda_im2col(a, KH, KW, col);
+    nda_conv3d_grad_weights(1, dy, col, 0, db);
+    nda_conv3d_grad_input(dy, b, col_grad, da);
+
+    float max_err = 0;
+    for (int n = 0; n < K; n++) {
+        for (int c = 0; c < C; c++) {
+            for (int i = 0; i < KH; i++) {
+                for (int j = 0; j < KW; j++) {
+                    float ref = 0;
+                    for (int y = 0; y < OH; y++) {
+                        for (int x = 0; x < OW; x++) {
+                            ref += dy->data[(n * OH + y) * OW + x] * a->data[(c * H + y + i) * W + x + j];
+                        }
+                    }
+                    float err = fabsf(ref - db->data[((n * C + c) * KH + i) * KW + j]);
+                    max_err = err > max_err ? err : max_err;
+                }
+            }
+        }
+    }
+    for (int c = 0; c < C; c++) {
+        for (int y = 0; y < H; y++) {
+            for (int x = 0; x < W; x++) {
+                float ref = 0;
+                for (int n = 0; n < K; n++) {
+                    for (int i = 0; i < KH; i++) {
+                        for (int j = 0; j < KW; j++) {
+                            if (y - i < 0 || y - i >= OH || x - j < 0 || x - j >= OW) continue;
+                            ref += dy->data[(n * OH + y - i) * OW + x - j] * b->data[((n * C + c) * KH + i) * KW + j];
+                        }
+                    }
+                }
+                float err = fabsf(ref - da->data[(c * H + y) * W + x]);
+                max_err = err > max_err ? err : max_err;
+            }
+        }
+    }
+    printf("conv3d grad max error: %e\n", max_err);
+    if (max_err > 1e-4) {
+        fprintf(stderr, "conv3d grad mismatch\n");
+        exit(1);
+    }
+
+    nda_free(a);
+    nda_free(b);
+    nda_free(dy);
+    nda_free(col);
+    nda_free(col_grad);
+    nda_free(db);
+    nda_free(da);
+}
+
+// Direct 3D convolution of a zero padded input, used as reference.
+static void conv3d_direct(ndarray *a, ndarray *b, int pad, ndarray *out){
+    for (int n = 0; n < out->shape[0]; n++) {
+        for (int y = 0; y < out->shape[1]; y++) {
+            for (int x = 0; x < out->shape[2]; x++) {
+                float sum = 0;
+                for (int c = 0; c < a->shape[0]; c++) {
+                    for (int i = 0; i < b->shape[2]; i++) {
+                        for (int j = 0; j < b->shape[3]; j++) {
+                            int yy = y + i - pad, xx = x + j - pad;
+                            if (yy < 0 || yy >= a->shape[1] || xx < 0 || xx >= a->shape[2]) continue;
+                            sum += a->data[(c * a->shape[1] + yy) * a->shape[2] + xx]
+                                 * b->data[((n * b->shape[1] + c) * b->shape[2] + i) * b->shape[3] + j];
+                        }
+                    }
+                }
+                out->data[(n * out->shape[1] + y) * out->shape[2] + x] = sum;
+            }
+        }
+    }
+}
+
+void test_winograd(){
+    // Winograd F(2x2, 3x3) and F(4x4, 3x3) against the direct convolution,
+    // forward and with the rotated filters of the input gradient.
+    int C = 3, H = 18, W = 13, K = 5;
+    ndarray *a = nda_zero(3, (int[]){C, H, W});
+    ndarray *b = nda_zero(4, (int[]){K, C, 3, 3});
+    ndarray *out = nda_zero(3, (int[]){K, H - 2, W - 2});
+    ndarray *ref = nda_zero(3, (int[]){K, H - 2, W - 2});
+    ndarray *dy = nda_zero(3, (int[]){K, H - 2, W - 2});
+    ndarray *da = nda_zero(3, (int[]){C, H, W});
+    ndarray *da_ref = nda_zero(3, (int[]){C, H, W});
+    ndarray *b_rot = nda_zero(4, (int[]){C, K, 3, 3});
+    nda_init_rand(a);
+    nda_init_rand(b);
+    nda_init_rand(dy);
+    for (int n = 0; n < K; n++) {
+        for (int c = 0; c < C; c++) {
+            for (int i = 0; i < 9; i++) {
+                b_rot->data[(c * K + n) * 9 + 8 - i] = b->data[(n * C + c) * 9 + i];
+            }
+        }
+    }
+    conv3d_direct(a, b, 0, ref);
+    conv3d_direct(dy, b_rot, 2, da_ref);
+
+    for (int m = 2; m <= 4; m += 2) {
+        int alpha = m + 2;
+        ndarray *u = nda_zero(3, (int[]){alpha * alpha, K, C});
+        ndarray *u_grad = nda_zero(3, (int[]){alpha * alpha, C, K});
+        nda_winograd_filter(b, m, u);
+        nda_winograd_filter_grad(b, m, u_grad);
+        nda_conv3d_winograd(a, u, m, 0, out);
+        nda_conv3d_winograd(dy, u_grad, m, 2, da);
+
+        float max_err = 0;
+        for (int i = 0; i < out->size; i++) {
+            float err = fabsf(out->data[i] - ref->data[i]);
+            max_err = err > max_err ? err : max_err;
+        }
+        for (int i = 0; i < da->size; i++) {
+            float err = fabsf(da->data[i] - da_ref->data[i]);
+            max_err = err > max_err ? err : max_err;
+        }
+        printf("winograd F(%dx%d, 3x3) max error: %e\n", m, m, max_err);
+        if (max_err > 1e-4) {
+            fprintf(stderr, "winograd mismatch\n");
+            exit(1);
+        }
+        nda_free(u);
+        nda_free(u_grad);
+    }
+
+    nda_free(a);
+    nda_free(b);
+    nda_free(out);
+    nda_free(ref);
+    nda_free(dy);
+    nda_free(da);
+    nda_free(da_ref);
+    nda_free(b_rot);
+}
+
+void test_fft_conv(){
+    // FFT convolution with a large kernel against the direct convolution.
+    int C = 3, H = 24, W = 19, K = 4, KS = 7;
+    int rows = nda_fft_length(H), cols = nda_fft_length(W);
+    ndarray *a = nda_zero(3, (int[]){C, H, W});
+    ndarray *b = nda_zero(4, (int[]){K, C, KS, KS});
+    ndarray *spectra = nda_zero(4, (int[]){K, C, rows, 2 * cols});
+    ndarray *out = nda_zero(3, (int[]){K, H - KS + 1, W - KS + 1});
+    ndarray *ref = nda_zero(3, (int[]){K, H - KS + 1, W - KS + 1});
+    nda_init_rand(a);
+    nda_init_rand(b);
+
+    conv3d_direct(a, b, 0, ref);
+    nda_fft_filter(b, spectra);
+    nda_conv3d_fft(a, spectra, KS, out);
+    float max_err = 0;
+    for (int i = 0; i < out->size; i++) {
+        float err = fabsf(out->data[i] - ref->data[i]);
+        max_err = err > max_err ? err : max_err;
+    }
+    printf("fft conv3d max error: %e\n", max_err);
+    if (max_err > 1e-3) {
+        fprintf(stderr, "fft conv3d mismatch\n");
+        exit(1);
+    }
+    printf("algorithm for (1, 20, 20) * 32x3x3: %d, (16, 64, 64) * 32x5x5: %d, (16, 64, 64) * 32x11x11: %d\n",
+           nda_conv_select(1, 20, 20, 32, 3), nda_conv_select(16, 64, 64, 32, 5), nda_conv_select(16, 64, 64, 32, 11));
+
+    nda_free(a);
+    nda_free(b);
+    nda_free(spectra);
+    nda_free(out);
+    nda_free(ref);
+}
+
+static void count_range(void *arg, int begin, int end){
+    atomic_fetch_add((atomic_int *)arg, end - begin);
+}
+
+static void *run_loops(void *arg){
+    int *failures = arg;
+    for (int i = 0; i < 2000; i++) {
+        atomic_int count = 0;
+        nda_parallel_for(64, 1, count_range, &count);
+        *failures += atomic_load(&count) != 64;
+    }
+    return NULL;
+}
+
+void test_pool_resize(){
+    // Resize the pool while another thread runs loops on it: every loop
+    // still covers all its iterations.
+    int failures = 0;
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_loops, &failures);
+    for (int i = 0; i < 200; i++) {
+        nda_set_num_threads(i % 4 + 1);
+        nda_set_thread_pinning(0);
+    }
+    pthread_join(thread, NULL);
+    nda_set_num_threads(0);
+    printf("pool resized during loops: %d failures\n", failures);
+    if (failures != 0) {
+        fprintf(stderr, "pool resize mismatch\n");
+        exit(1);
+    }
+}
+
 int main() {
     // srand(time(NULL));
     // test_cal();
@@ -133,5 +770,17 @@ int main() {
     // test_reshape();
     // test_transpose();
     test_flip();
+    test_view();
+    test_gemm();
+    test_dot_bias();
+    test_gemm_u8();
+    test_softmax_cross_entropy();
+    test_simd();
+    test_broadcast();
+    test_conv3d_gemm();
+    test_conv3d_grad();
+    test_winograd();
+    test_fft_conv();
+    test_pool_resize();
     return 0;
 }
\ No newline at end of file
@@ -1,11 +1,362 @@
 #include "network.h"
 #include "layer.h"
+#include "threadpool.h"
+#include "misc.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <time.h>
+#include <math.h>
+#include <pthread.h>
+
+// The gradient of a batch is the mean of the gradients of its samples.
+static int check_batch(){
+    Network *network = create_network(0.01);
+    ndarray *inputs = nda_zero(2, (int[]){400, 2});
+    ndarray *targets = nda_zero(2, (int[]){10, 2});
+    ndarray *outputs = nda_zero(2, (int[]){10, 2});
+    nda_init_rand(inputs);
+    targets->data[1 * 2 + 0] = 1;
+    targets->data[7 * 2 + 1] = 1;
+
+    network_forward(network, inputs, outputs);
+    network_backward(network, targets);
+    ndarray *batch_grad = nda_deepcopy(network->dense1->weights_grad);
+    ndarray *mean_grad = nda_zero(2, batch_grad->shape);
+    for (int i = 0; i < 2; i++) {
+        ndarray *input = nda_slice(inputs, 1, i, i + 1);
+        ndarray *target = nda_slice(targets, 1, i, i + 1);
+        ndarray *output = nda_slice(outputs, 1, i, i + 1);
+        network_forward(network, input, output);
+        network_backward(network, target);
+        nda_add(mean_grad, network->dense1->weights_grad, mean_grad);
+        nda_free(input), nda_free(target), nda_free(output);
+    }
+    nda_div_scalar(mean_grad, 2, mean_grad);
+
+    float max_err = 0, max_grad = 0;
+    for (int i = 0; i < batch_grad->size; i++) {
+        max_err = fmaxf(max_err, fabsf(batch_grad->data[i] - mean_grad->data[i]));
+        max_grad = fmaxf(max_grad, fabsf(mean_grad->data[i]));
+    }
+    printf("batch gradient: max error %g (max gradient %g)\n", max_err, max_grad);
+
+    free_network(network);
+    nda_free(inputs), nda_free(targets), nda_free(outputs);
+    nda_free(batch_grad), nda_free(mean_grad);
+    return max_err <= 1e-3f * max_grad;
+}
+
+static float max_diff(ndarray *a, ndarray *b){
+    float diff = 0;
+    for (int i = 0; i < a->size; i++) {
+        diff = fmaxf(diff, fabsf(a->data[i] - b->data[i]));
+    }
+    return diff;
+}
+
+// A data-parallel step matches the serial step, and gives the same weights
+// every time it runs with the same number of threads.
+static int check_data_parallel(){
+    ndarray *inputs = nda_zero(2, (int[]){400, 7});
+    ndarray *targets = nda_zero(2, (int[]){10, 7});
+    ndarray *outputs = nda_zero(2, (int[]){10, 7});
+    nda_init_rand(inputs);
+    for (int j = 0; j < 7; j++) {
+        targets->data[j % 10 * 7 + j] = 1;
+    }
+    Network *serial = create_network(0.1);
+    network_forward(serial, inputs, outputs);
+    Network *parallel[2] = {create_network(0.1), create_network(0.1)};
+    copy_network(parallel[0], serial);
+    copy_network(parallel[1], serial);
+
+    network_forward(serial, inputs, outputs);
+    network_backward(serial, targets);
+    network_update(serial);
+    nda_set_num_threads(3);
+    network_train_batch(parallel[0], inputs, targets, outputs);
+    network_train_batch(parallel[1], inputs, targets, outputs);
+    nda_set_num_threads(0);
+
+    float err = max_diff(serial->dense1->weights, parallel[0]->dense1->weights);
+    float repeat = max_diff(parallel[0]->dense1->weights, parallel[1]->dense1->weights);
+    printf("data-parallel step: max error %g, max difference between runs %g\n", err, repeat);
+
+    free_network(serial), free_network(parallel[0]), free_network(parallel[1]);
+    nda_free(inputs), nda_free(targets), nda_free(outputs);
+    return err <= 1e-5f && repeat == 0;
+}
+
+// Hogwild training on one thread is the serial loop over the batches. On
+// several threads every sample is trained on once per epoch, and the loss
+// still drops.
+static int check_hogwild(){
+    int num = 40, batch_size = 3;
+    ndarray *inputs = nda_zero(2, (int[]){400, num});
+    ndarray *targets = nda_zero(2, (int[]){10, num});
+    ndarray *outputs = nda_zero(2, (int[]){10, num});
+    nda_init_rand(inputs);
+    for (int j = 0; j < num; j++) {
+        targets->data[j % 10 * num + j] = 1;
+    }
+    Network *serial = create_network(0.1);
+    network_forward(serial, inputs, outputs);
+    Network *hogwild = create_network(0.1);
+    copy_network(hogwild, serial);
+
+    float serial_loss = 0;
+    for (int start = 0; start < num; start += batch_size) {
+        int stop = start + batch_size < num ? start + batch_size : num;
+        ndarray *x = nda_slice(inputs, 1, start, stop);
+        ndarray *y = nda_slice(outputs, 1, start, stop);
+        ndarray *target = nda_slice(targets, 1, start, stop);
+        network_forward(serial, x, y);
+        network_backward(serial, target);
+        network_update(serial);
+        serial_loss += serial->loss * (stop - start);
+        nda_free(x), nda_free(y), nda_free(target);
+    }
+    serial_loss /= num;
+    nda_set_num_threads(1);
+    float loss = network_train_hogwild(hogwild, inputs, targets, outputs, batch_size);
+    float err = max_diff(serial->dense1->weights, hogwild->dense1->weights);
+    int serial_ok = err == 0 && loss == serial_loss;
+
+    // Without updates the mean loss is that of the whole set only if every
+    // sample was trained on once, and every output column is a softmax.
+    nda_set_num_threads(4);
+    network_forward(serial, inputs, outputs);
+    network_backward(serial, targets);
+    copy_network(hogwild, serial);
+    hogwild->learning_rate = 0;
+    for (int i = 0; i < outputs->size; i++) {
+        outputs->data[i] = -1;
+    }
+    loss = network_train_hogwild(hogwild, inputs, targets, outputs, batch_size);
+    int consumed_ok = fabsf(loss - serial->loss) <= 1e-5f * serial->loss;
+    for (int j = 0; j < num; j++) {
+        float sum = 0;
+        for (int i = 0; i < 10; i++) {
+            sum += outputs->data[i * num + j];
+        }
+        consumed_ok = consumed_ok && fabsf(sum - 1) <= 1e-4f;
+    }
+
+    hogwild->learning_rate = 0.1;
+    float first = network_train_hogwild(hogwild, inputs, targets, outputs, batch_size), last = first;
+    for (int epoch = 1; epoch < 10; epoch++) {
+        last = network_train_hogwild(hogwild, inputs, targets, outputs, batch_size);
+    }
+    nda_set_num_threads(0);
+    printf("hogwild: max error %g on 1 thread, loss %g over the set (expected %g), %g -> %g over 10 epochs\n",
+           err, loss, serial->loss, first, last);
+
+    free_network(serial), free_network(hogwild);
+    nda_free(inputs), nda_free(targets), nda_free(outputs);
+    return serial_ok && consumed_ok && last < first;
+}
+
+typedef struct
+{
+    Network *network;
+    ndarray *inputs;
+    ndarray *expected;
+    float err;
+} InferArgs;
+
+static void *infer_thread(void *arg){
+    InferArgs *a = arg;
+    NetworkContext *context = create_network_context();
+    ndarray *outputs = nda_zero(2, a->expected->shape);
+    a->err = 0;
+    for (int i = 0; i < 20; i++) {
+        network_infer(a->network, context, a->inputs, outputs);
+        a->err = fmaxf(a->err, max_diff(outputs, a->expected));
+    }
+    nda_free(outputs);
+    free_network_context(context);
+    return NULL;
+}
+
+// Threads sharing one network, each with its own context, get the outputs
+// of the forward pass.
+static int check_contexts(){
+    Network *network = create_network(0.1);
+    ndarray *inputs = nda_zero(2, (int[]){400, 5});
+    ndarray *expected = nda_zero(2, (int[]){10, 5});
+    nda_init_rand(inputs);
+    network_forward(network, inputs, expected);
+
+    pthread_t threads[4];
+    InferArgs args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i] = (InferArgs){network, inputs, expected, 0};
+        pthread_create(&threads[i], NULL, infer_thread, &args[i]);
+    }
+    float err = 0;
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+        err = fmaxf(err, args[i].err);
+    }
+    printf("concurrent inference: max error %g\n", err);
+
+    free_network(network);
+    nda_free(inputs), nda_free(expected);
+    return err <= 1e-6f;
+}
+
+// Batched predictions match the argmax of the sample by sample forward pass,
+// including the last, smaller batch.
+static int check_predict(){
+    Network *network = create_network(0.1);
+    ndarray *samples[37];
+    int expected[37], predictions[37];
+    ndarray *output = nda_zero(2, (int[]){10, 1});
+    for (int i = 0; i < 37; i++) {
+        samples[i] = nda_zero(2, (int[]){400, 1});
+        nda_init_rand(samples[i]);
+        network_forward(network, samples[i], output);
+        expected[i] = nda_argmax(output);
+    }
+    network_predict(network, samples, 37, 8, predictions);
+    float acc = evaluate_predictions(predictions, expected, 37, NULL);
+    printf("batched predictions: %.0f%% match\n", acc * 100);
+
+    for (int i = 0; i < 37; i++) {
+        nda_free(samples[i]);
+    }
+    nda_free(output);
+    free_network(network);
+    return acc == 1;
+}
+
+// Predictions on the bytes of a dataset, scaled inside the first layer, match
+// those on the same samples converted to floats.
+static int check_predict_dataset(){
+    Network *network = create_network(0.1);
+    uint8_t *bytes = nda_alloc(37 * 400);
+    int32_t labels[37];
+    ndarray *samples[37];
+    int expected[37], predictions[37];
+    for (int i = 0; i < 37; i++) {
+        samples[i] = nda_zero(2, (int[]){400, 1});
+        for (int j = 0; j < 400; j++) {
+            bytes[i * 400 + j] = rand() % 256;
+            samples[i]->data[j] = bytes[i * 400 + j] / 255.0f;
+        }
+        labels[i] = 0;
+    }
+    Dataset dataset = {
+        .num = 37,
+        .ndim = 2,
+        .shape = {400, 1},
+        .sample_size = 400,
+        .scale = 1 / 255.0f,
+        .labels = labels,
+        .samples = bytes,
+    };
+    network_predict(network, samples, 37, 8, expected);
+    network_predict_dataset(network, &dataset, 8, predictions);
+    float acc = evaluate_predictions(predictions, expected, 37, NULL);
+    printf("predictions on bytes: %.0f%% match\n", acc * 100);
+
+    for (int i = 0; i < 37; i++) {
+        nda_free(samples[i]);
+    }
+    nda_dealloc(bytes);
+    free_network(network);
+    return acc == 1;
+}
+
+// The prepared single-sample path gives the outputs of the forward pass.
+static int check_sample(){
+    Network *network = create_network(0.1);
+    ndarray *input = nda_zero(2, (int[]){400, 1});
+    ndarray *expected = nda_zero(2, (int[]){10, 1});
+    ndarray *output = nda_zero(2, (int[]){10, 1});
+    nda_init_rand(input);
+    network_forward(network, input, expected);
+    NetworkContext *context = create_network_context();
+    network_prepare_sample(network, context);
+    network_infer_sample(network, context, input->data, output->data);
+    float err = max_diff(output, expected);
+    printf("prepared single-sample inference: max error %g\n", err);
+
+    free_network_context(context);
+    free_network(network);
+    nda_free(input), nda_free(expected), nda_free(output);
+    return err <= 1e-5f;
+}
+
+// A saved model loads back bit for bit, its weights mapped from the file and
+// still trainable; the text format of older versions loads too.
+static int check_model(){
+    const char *binary = "test_network_model.bin", *text = "test_network_model.txt";
+    Network *network = create_network(0.1);
+    ndarray *input = nda_zero(2, (int[]){400, 3});
+    ndarray *expected = nda_zero(2, (int[]){10, 3});
+    ndarray *output = nda_zero(2, (int[]){10, 3});
+    nda_init_rand(input);
+    network_forward(network, input, expected);
+    save_network(network, binary);
+    FILE *file = fopen(text, "w");
+    save_dense_layer(network->dense1, file);
+    save_dense_layer(network->dense2, file);
+    save_dense_layer(network->dense3, file);
+    fclose(file);
+
+    Network *loaded = create_network(0.1);
+    load_network(loaded, binary);
+    int mapped = loaded->model != NULL && loaded->dense3->bias->data >= loaded->model->payload
+        && loaded->dense3->bias->data < loaded->model->payload + loaded->params->size;
+    network_forward(loaded, input, output);
+    float err = max_diff(output, expected);
+    network_train_batch(loaded, input, expected, output);
+    load_network(loaded, text);
+    network_forward(loaded, input, output);
+    float text_err = max_diff(output, expected);
+    printf("saved model: mapped %d, max error %g, from text %g\n", mapped, err, text_err);
+
+    remove(binary), remove(text);
+    free_network(network), free_network(loaded);
+    nda_free(input), nda_free(expected), nda_free(output);
+    return mapped && err == 0 && text_err <= 1e-4f;
+}
 
 int main(){
+    if (!check_batch()) {
+        fprintf(stderr, "batch gradient differs from the mean of the sample gradients\n");
+        return 1;
+    }
+    if (!check_contexts()) {
+        fprintf(stderr, "concurrent inference differs from the forward pass\n");
+        return 1;
+    }
+    if (!check_sample()) {
+        fprintf(stderr, "prepared inference differs from the forward pass\n");
+        return 1;
+    }
+    if (!check_predict()) {
+        fprintf(stderr, "batched predictions differ from the forward pass\n");
+        return 1;
+    }
+    if (!check_predict_dataset()) {
+        fprintf(stderr, "predictions on bytes differ from those on floats\n");
+        return 1;
+    }
+    if (!check_model()) {
+        fprintf(stderr, "loaded model differs from the saved network\n");
+        return 1;
+    }
+    if (!check_data_parallel()) {
+        fprintf(stderr, "data-parallel step differs from the serial step\n");
+        return 1;
+    }
+    if (!check_hogwild()) {
+        fprintf(stderr, "hogwild training differs from the serial loop or skips samples\n");
+        return 1;
+    }
     srand(time(NULL));
 
     Network *network = create_network(0.01);